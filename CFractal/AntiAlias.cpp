@@ -0,0 +1,298 @@
+//
+// Adaptive anti aliasing of solved blocks.
+//
+// Date: 2016/08/04
+//
+
+#include "stdafx.h"
+#include "AntiAlias.h"
+#include "ColorMap.h"
+#include <math.h>
+#include <vector>
+#include <algorithm>
+#include <functional>
+#include <string.h>
+
+// Returns a value in [0, 1) hashed from seed.  The jitter only depends on the pixel and its tile,
+// so a resumed export matches what was rendered before.
+static double jitter(unsigned int seed)
+{
+	seed ^= seed >> 16;
+	seed *= 0x7feb352d;
+	seed ^= seed >> 15;
+	seed *= 0x846ca68b;
+	seed ^= seed >> 16;
+	return (seed & 0xFFFFFF) / 16777216.0;
+}
+
+// Hashes a tile's place in the image (FNV-1a over each field), so tiles do not all share one
+// jitter pattern.
+static unsigned int hashTile(long long tileX, long long tileY, int depth)
+{
+	unsigned int hash = 2166136261u;
+	long long fields[] = { tileX, tileY, depth };
+	for (int i = 0; i < 3; i++)
+		for (int b = 0; b < 8; b++) {
+			hash ^= (fields[i] >> (b * 8)) & 0xff;
+			hash *= 16777619u;
+		}
+	return hash;
+}
+
+static int gcd(int a, int b)
+{
+	while (b) {
+		int t = a % b;
+		a = b;
+		b = t;
+	}
+	return a;
+}
+
+void AdaptiveAntiAlias::subSamples(double px, double py, double pixelSize, int pixel, int first, int count, double *x, double *y)
+{
+	// one sample somewhere in each cell of a grid covering the pixel.  Cells are visited in a
+	// scattered order so that the first few samples already cover the whole pixel.
+	int grid = (int)ceil(sqrt((double)samples));
+	int cells = grid * grid;
+	int step = (int)(cells * 0.618) | 1;
+	while (gcd(step, cells) != 1)
+		step += 2;
+
+	for (int i = 0; i < count; i++)
+	{
+		int sample = first + i;
+		int cell = (int)((long long)sample * step % cells);
+		unsigned int seed = ((unsigned int)(pixel * samples + sample) ^ tileSeed) * 2;
+		double u = ((cell % grid) + jitter(seed)) / grid - 0.5;
+		double v = ((cell / grid) + jitter(seed + 1)) / grid - 0.5;
+		x[i] = px + u * pixelSize;
+		y[i] = py + v * pixelSize;
+	}
+}
+
+// Solves count points with the settings of block and returns their colors, 3 bytes per point.
+// All points go through the solver as one block, padded out to a whole number of lanes.
+static uint8_t *solvePoints(MandelbrotSolver &solver, const FractalBlock &block, const double *x, const double *y, int count)
+{
+	int lanes = MandelbrotSolver::getKernelLanes(solver.getKernel());
+	int padded = (count + lanes - 1) / lanes * lanes;
+
+	FractalBlock batch;
+	batch.width = padded;
+	batch.height = 1;
+	batch.itterations = block.itterations;
+	batch.x_in = new double[padded];
+	batch.y_in = new double[padded];
+	batch.values_out = new int[padded];
+
+	memcpy(batch.x_in, x, count * sizeof(double));
+	memcpy(batch.y_in, y, count * sizeof(double));
+	for (int i = count; i < padded; i++)
+	{
+		batch.x_in[i] = x[count - 1];
+		batch.y_in[i] = y[count - 1];
+	}
+
+	solver.Solve(batch);
+
+	auto colors = new uint8_t[count * 3];
+	mapColors(batch.values_out, count, block.itterations, colors);
+	solver.ReleaseBlock(batch);
+	return colors;
+}
+
+// Solves the sub samples first..first + count of each pixel and returns their colors, count * 3
+// bytes per pixel.
+uint8_t *AdaptiveAntiAlias::solveSamples(MandelbrotSolver &solver, FractalBlock &block, double pixelSize, const std::vector<int> &pixels, int first, int count)
+{
+	int total = (int)pixels.size() * count;
+	std::vector<double> x(total), y(total);
+	for (size_t p = 0; p < pixels.size(); p++)
+	{
+		int pixel = pixels[p];
+		subSamples(block.x_in[pixel], block.y_in[pixel], pixelSize, pixel, first, count, x.data() + p * count, y.data() + p * count);
+	}
+
+	// colors are averaged rather than counts, so the result does not depend on the palette.
+	return solvePoints(solver, block, x.data(), y.data(), total);
+}
+
+// Fills framed with the colors of block surrounded by a one pixel border, (width + 2) * (height + 2)
+// pixels.  The border is solved here, so pixels along the block's sides are compared with the
+// real pixels of the blocks next to it rather than left out.
+void AdaptiveAntiAlias::frame(MandelbrotSolver &solver, FractalBlock &block, double pixelSize, const uint8_t *rgb, uint8_t *framed)
+{
+	int width = block.width;
+	int height = block.height;
+	int stride = width + 2;
+
+	for (int y = 0; y < height; y++)
+		memcpy(framed + (1 + (y + 1) * stride) * 3, rgb + y * width * 3, width * 3);
+
+	// the border, in frame coordinates.
+	std::vector<int> border;
+	for (int x = 0; x < stride; x++)
+	{
+		border.push_back(x);
+		border.push_back(x + (height + 1) * stride);
+	}
+	for (int y = 1; y <= height; y++)
+	{
+		border.push_back(y * stride);
+		border.push_back(width + 1 + y * stride);
+	}
+
+	std::vector<double> x(border.size()), y(border.size());
+	for (size_t i = 0; i < border.size(); i++)
+	{
+		x[i] = block.x_in[0] + (border[i] % stride - 1) * pixelSize;
+		y[i] = block.y_in[0] + (border[i] / stride - 1) * pixelSize;
+	}
+
+	auto colors = solvePoints(solver, block, x.data(), y.data(), (int)border.size());
+	for (size_t i = 0; i < border.size(); i++)
+		memcpy(framed + border[i] * 3, colors + i * 3, 3);
+	delete[] colors;
+}
+
+// Keeps the items with the highest scores whose costs add up to no more than budget, in their
+// original order, and returns what they cost.  scores and costs hold one entry for each item.
+static long long keepStrongest(std::vector<int> &items, const std::vector<int> &scores, const std::vector<long long> &costs, long long budget)
+{
+	std::vector<int> order(items.size());
+	for (size_t i = 0; i < order.size(); i++)
+		order[i] = (int)i;
+	std::stable_sort(order.begin(), order.end(), [&](int a, int b) { return scores[a] > scores[b]; });
+
+	std::vector<uint8_t> keep(items.size(), 0);
+	long long spent = 0;
+	for (auto i : order)
+		if (spent + costs[i] <= budget) {
+			spent += costs[i];
+			keep[i] = 1;
+		}
+
+	size_t kept = 0;
+	for (size_t i = 0; i < items.size(); i++)
+		if (keep[i])
+			items[kept++] = items[i];
+	items.resize(kept);
+	return spent;
+}
+
+int AdaptiveAntiAlias::apply(MandelbrotSolver &solver, FractalBlock &block, double pixelSize, uint8_t *rgb, long long tileX, long long tileY, int depth)
+{
+	if (samples < 2)
+		return 0;
+	tileSeed = hashTile(tileX, tileY, depth);
+
+	int width = block.width;
+	int height = block.height;
+
+	int stride = width + 2;
+	std::vector<uint8_t> framed((size_t)stride * (height + 2) * 3);
+	frame(solver, block, pixelSize, rgb, framed.data());
+
+	// find pixels that differ from any of their neighbours, and by how much.
+	std::vector<int> edges;
+	std::vector<int> contrast;
+	for (int y = 0; y < height; y++)
+		for (int x = 0; x < width; x++)
+		{
+			auto color = framed.data() + (x + 1 + (y + 1) * stride) * 3;
+			int most = 0;
+			for (int dy = -1; dy <= 1; dy++)
+				for (int dx = -1; dx <= 1; dx++)
+				{
+					auto neighbour = color + (dx + dy * stride) * 3;
+					for (int c = 0; c < 3; c++)
+						most = std::max(most, abs(color[c] - neighbour[c]));
+				}
+			if (most > threshold) {
+				edges.push_back(x + y * width);
+				contrast.push_back(most);
+			}
+		}
+
+	// a sub sample costs about as many itterations as the pixel it is in, the budget is a share
+	// of what the block itself took.
+	long long blockCost = 0;
+	for (int i = 0; i < width * height; i++)
+		blockCost += block.values_out[i] + 1;
+	long long available = (long long)(budget * blockCost);
+
+	// a few samples first.  Pixels where these agree with the pixel itself are smooth enough
+	// already, the rest get the remaining samples.  Where the budget does not stretch to every
+	// edge pixel the ones that stand out most are refined.
+	int coarse = samples / 4 < 2 ? samples : samples / 4;
+	int remaining = samples - coarse;
+
+	std::vector<long long> costs;
+	for (auto pixel : edges)
+		costs.push_back((long long)coarse * (block.values_out[pixel] + 1));
+	available -= keepStrongest(edges, contrast, costs, available);
+	if (edges.empty())
+		return 0;
+
+	auto coarseColors = solveSamples(solver, block, pixelSize, edges, 0, coarse);
+
+	std::vector<int> detailed;
+	std::vector<int> disagreement;
+	std::vector<int> total(edges.size() * 3);
+	for (size_t e = 0; e < edges.size(); e++)
+	{
+		auto center = rgb + edges[e] * 3;
+		int most = 0;
+		for (int c = 0; c < 3; c++)
+		{
+			total[e * 3 + c] = 0;
+			for (int i = 0; i < coarse; i++)
+			{
+				int value = coarseColors[(e * coarse + i) * 3 + c];
+				total[e * 3 + c] += value;
+				most = std::max(most, abs(value - center[c]));
+			}
+		}
+		if (most > threshold && coarse < samples) {
+			detailed.push_back((int)e);
+			disagreement.push_back(most);
+		}
+	}
+	delete[] coarseColors;
+
+	costs.clear();
+	for (auto e : detailed)
+		costs.push_back((long long)remaining * (block.values_out[edges[e]] + 1));
+	keepStrongest(detailed, disagreement, costs, available);
+
+	if (!detailed.empty())
+	{
+		std::vector<int> pixels;
+		for (auto e : detailed)
+			pixels.push_back(edges[e]);
+		auto detailColors = solveSamples(solver, block, pixelSize, pixels, coarse, remaining);
+		for (size_t d = 0; d < detailed.size(); d++)
+			for (int c = 0; c < 3; c++)
+				for (int i = 0; i < remaining; i++)
+					total[detailed[d] * 3 + c] += detailColors[(d * remaining + i) * 3 + c];
+		delete[] detailColors;
+	}
+
+	// write out the averages, the coarse only pixels include their original sample as well.
+	size_t next = 0;
+	for (size_t e = 0; e < edges.size(); e++)
+	{
+		auto target = rgb + edges[e] * 3;
+		bool isDetailed = next < detailed.size() && detailed[next] == (int)e;
+		int count = isDetailed ? samples : coarse + 1;
+		if (isDetailed)
+			next++;
+		for (int c = 0; c < 3; c++)
+		{
+			int sum = total[e * 3 + c] + (isDetailed ? 0 : target[c]);
+			target[c] = (uint8_t)((sum + count / 2) / count);
+		}
+	}
+	return (int)edges.size();
+}
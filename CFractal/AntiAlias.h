@@ -0,0 +1,42 @@
+#pragma once
+
+#include <stdint.h>
+#include <vector>
+#include "Mandel.h"
+
+// Adaptive anti aliasing for solved blocks.  Only pixels that differ visibly from a neighbour
+// are supersampled, and of those only the ones whose first few samples disagree get the full
+// number, so the result is close to full supersampling at a fraction of the cost.  Pixels along
+// a block's sides are compared with a border solved around the block, so edges that line up
+// with the seams between blocks are found as well.
+class AdaptiveAntiAlias
+{
+private:
+	// Mixed into every jitter seed, set by apply from the block's place in the image.
+	unsigned int tileSeed = 0;
+
+	// Fills x and y with sub samples first..first + count of the pixel at (px, py).
+	void subSamples(double px, double py, double pixelSize, int pixel, int first, int count, double *x, double *y);
+	void frame(MandelbrotSolver &solver, FractalBlock &block, double pixelSize, const uint8_t *rgb, uint8_t *framed);
+	uint8_t *solveSamples(MandelbrotSolver &solver, FractalBlock &block, double pixelSize, const std::vector<int> &pixels, int first, int count);
+
+public:
+	// Sub samples for each refined pixel.  Samples are spread over a jittered grid, so a
+	// square number works best.
+	int samples = 16;
+
+	// Largest difference in any color channel between a pixel and its neighbours that is
+	// left alone.
+	int threshold = 8;
+
+	// Most work spent refining a block, as a share of the itterations it took to solve.  Where
+	// there are more edges than that pays for, the pixels that differ most are refined and the
+	// rest left alone, so a busy region costs about 1 + budget times the plain render.
+	double budget = 0.65;
+
+	// Replaces the colors in rgb of every edge pixel in block with the average of its sub
+	// samples, which are solved in one batch with solver.  rgb holds the colors mapped from
+	// block.values_out.  tileX, tileY and depth place the block in the image, each tile gets its
+	// own jitter pattern from them.  Returns the number of pixels refined.
+	int apply(MandelbrotSolver &solver, FractalBlock &block, double pixelSize, uint8_t *rgb, long long tileX, long long tileY, int depth);
+};
@@ -0,0 +1,216 @@
+//
+// Solver micro-benchmark.
+//
+// Date: 2016/07/29
+//
+
+#include "stdafx.h"
+#include "Benchmark.h"
+#include <fstream>
+
+// Reference regions, chosen to cover the very different workloads seen while exploring.
+static const BenchmarkRegion regions[] = {
+	// whole set, a mix of everything.
+	{ "full set", -0.75, 0.0, 3.0 },
+	// lots of detail with long but escaping orbits.
+	{ "seahorse valley", -0.7453, 0.1127, 0.01 },
+	// inside the main cardioid, every point runs to the itteration limit.
+	{ "deep interior", -0.15, 0.0, 0.3 },
+	// almost every point escapes within a few itterations.
+	{ "mostly exterior", 1.0, 1.0, 2.0 }
+};
+
+string BenchmarkResult::toJSON()
+{
+	char buffer[512];
+	sprintf_s(buffer, "{\"kernel\": \"%s\", \"region\": \"%s\", \"pixels\": %lld, \"iterations\": %lld, \"seconds\": %.6f, "
+		"\"pixelsPerSecond\": %.1f, \"iterationsPerSecond\": %.1f, \"laneUtilisation\": %.4f}",
+		kernel.c_str(), region.c_str(), pixels, itterations, seconds, pixelsPerSecond, itterationsPerSecond, laneUtilisation);
+	return buffer;
+}
+
+std::vector<FractalBlock> Benchmark::createBlocks(const BenchmarkRegion &region)
+{
+	int blockSize = solver.getBlockSize();
+	double pixelSize = region.width / (blockSize * tilesAcross);
+	double left = region.x - region.width / 2;
+	double top = region.y - region.width / 2;
+
+	std::vector<FractalBlock> blocks;
+	for (int y = 0; y < tilesAcross; y++)
+		for (int x = 0; x < tilesAcross; x++)
+			blocks.push_back(solver.CreateBlock(left + x * blockSize * pixelSize, top + y * blockSize * pixelSize, pixelSize));
+	return blocks;
+}
+
+BenchmarkResult Benchmark::runKernel(SolverKernel kernel, const BenchmarkRegion &region)
+{
+	solver.setKernel(kernel);
+	auto blocks = createBlocks(region);
+
+	// only the solve itself is timed, block setup is not part of the kernel.
+	int passes = 0;
+	double startTime = wallTime();
+	double elapsed;
+	do
+	{
+		for (auto &block : blocks)
+			solver.Solve(block);
+		passes++;
+		elapsed = wallTime() - startTime;
+	} while (elapsed < minSeconds);
+
+	BenchmarkResult result;
+	result.kernel = MandelbrotSolver::getKernelName(kernel);
+	result.region = region.name;
+	result.seconds = elapsed;
+
+	// a SIMD kernel keeps stepping a group of lanes until the slowest one escapes, so the lane
+	// steps taken are the largest count in each group times the number of lanes.
+	int lanes = MandelbrotSolver::getKernelLanes(kernel);
+	long long laneSteps = 0;
+	for (auto &block : blocks)
+	{
+		int length = block.width * block.height;
+		for (int i = 0; i < length; i += lanes)
+		{
+			int slowest = 0;
+			for (int j = i; j < i + lanes && j < length; j++)
+			{
+				result.itterations += block.values_out[j];
+				if (block.values_out[j] > slowest) slowest = block.values_out[j];
+			}
+			laneSteps += (long long)slowest * lanes;
+		}
+		result.pixels += length;
+		solver.ReleaseBlock(block);
+	}
+	result.laneUtilisation = laneSteps > 0 ? (double)result.itterations / laneSteps : 1;
+
+	result.pixels *= passes;
+	result.itterations *= passes;
+	result.pixelsPerSecond = result.pixels / elapsed;
+	result.itterationsPerSecond = result.itterations / elapsed;
+	return result;
+}
+
+std::vector<BenchmarkResult> Benchmark::run()
+{
+	results.clear();
+	for (int kernel = 0; kernel < SOLVER_KERNELS; kernel++)
+		for (auto &region : regions)
+		{
+			auto result = runKernel((SolverKernel)kernel, region);
+			TRACE(result.kernel + " / " + result.region + ": " + floatToStr(result.pixelsPerSecond / 1e6) + " Mpixels/s, " +
+				floatToStr(result.itterationsPerSecond / 1e6) + " Mitterations/s, lanes " + floatToStr(result.laneUtilisation * 100) + "% used");
+			results.push_back(result);
+		}
+	return results;
+}
+
+int Benchmark::verify()
+{
+	int mismatches = 0;
+	for (auto &region : regions)
+	{
+		auto blocks = createBlocks(region);
+		solver.setKernel(skINTRINSIC_32);
+		std::vector<int> reference;
+		for (auto &block : blocks)
+		{
+			solver.Solve(block);
+			reference.insert(reference.end(), block.values_out, block.values_out + block.width * block.height);
+		}
+
+		// the simple kernel works in double precision, so its counts are expected to differ.
+		for (int kernel = 0; kernel < SOLVER_KERNELS; kernel++)
+		{
+			if (kernel == skSIMPLE || kernel == skINTRINSIC_32)
+				continue;
+			solver.setKernel((SolverKernel)kernel);
+			int differing = 0;
+			size_t index = 0;
+			for (auto &block : blocks)
+			{
+				solver.Solve(block);
+				for (int i = 0; i < block.width * block.height; i++)
+					if (block.values_out[i] != reference[index++])
+						differing++;
+			}
+			if (differing > 0) {
+				TRACE(string(MandelbrotSolver::getKernelName((SolverKernel)kernel)) + " / " + region.name + ": " +
+					intToStr(differing) + " points differ from " + MandelbrotSolver::getKernelName(skINTRINSIC_32));
+				mismatches++;
+			}
+		}
+
+		for (auto &block : blocks)
+			solver.ReleaseBlock(block);
+	}
+	return mismatches;
+}
+
+bool Benchmark::save(string filename)
+{
+	FILE *file;
+	if (fopen_s(&file, filename.c_str(), "w") != 0) {
+		TRACE("Could not write " + filename);
+		return false;
+	}
+	fprintf(file, "[\n");
+	for (size_t i = 0; i < results.size(); i++)
+		fprintf(file, "  %s%s\n", results[i].toJSON().c_str(), i + 1 < results.size() ? "," : "");
+	fprintf(file, "]\n");
+	fclose(file);
+	return true;
+}
+
+// Returns the value of a string field in a single line JSON object, or "" if it is missing.
+static string jsonString(const string &line, const string &key)
+{
+	size_t start = line.find("\"" + key + "\": \"");
+	if (start == string::npos)
+		return "";
+	start += key.size() + 5;
+	return line.substr(start, line.find('"', start) - start);
+}
+
+static double jsonNumber(const string &line, const string &key)
+{
+	size_t start = line.find("\"" + key + "\": ");
+	if (start == string::npos)
+		return 0;
+	return atof(line.c_str() + start + key.size() + 4);
+}
+
+int Benchmark::compare(string baselineFile, double tolerance)
+{
+	std::ifstream file(baselineFile);
+	if (!file) {
+		TRACE("Could not read baseline " + baselineFile);
+		return -1;
+	}
+
+	int regressions = 0;
+	string line;
+	while (std::getline(file, line))
+	{
+		string kernel = jsonString(line, "kernel");
+		string region = jsonString(line, "region");
+		double baseline = jsonNumber(line, "pixelsPerSecond");
+		if (kernel.empty() || baseline <= 0)
+			continue;
+
+		for (auto &result : results)
+		{
+			if (result.kernel != kernel || result.region != region)
+				continue;
+			double change = result.pixelsPerSecond / baseline - 1;
+			if (change < -tolerance) {
+				TRACE("SLOWER: " + kernel + " / " + region + " " + floatToStr(change * 100) + "%");
+				regressions++;
+			}
+		}
+	}
+	return regressions;
+}
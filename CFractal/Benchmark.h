@@ -0,0 +1,65 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include "helper.h"
+#include "Mandel.h"
+
+using std::string;
+
+// Area of the fractal a kernel is timed over.
+struct BenchmarkRegion
+{
+	const char *name;
+	// Center and width in fractal space.
+	double x;
+	double y;
+	double width;
+};
+
+struct BenchmarkResult
+{
+	string kernel;
+	string region;
+	long long pixels = 0;
+	long long itterations = 0;
+	double seconds = 0;
+	double pixelsPerSecond = 0;
+	double itterationsPerSecond = 0;
+	// Fraction of the lane steps a SIMD kernel spent on points that had not yet escaped.
+	double laneUtilisation = 0;
+
+	string toJSON();
+};
+
+// Times each solver kernel over a fixed set of reference regions on a single thread.
+// Results are written as JSON, one result per line, and can be compared with a previous
+// run to catch slowdowns.
+class Benchmark
+{
+private:
+	MandelbrotSolver solver;
+	std::vector<BenchmarkResult> results;
+
+	std::vector<FractalBlock> createBlocks(const BenchmarkRegion &region);
+	BenchmarkResult runKernel(SolverKernel kernel, const BenchmarkRegion &region);
+
+public:
+	// Each kernel and region pair is repeated until at least this much wall time has passed.
+	double minSeconds = 0.5;
+
+	// Regions are rendered as tilesAcross x tilesAcross solver blocks.
+	int tilesAcross = 4;
+
+	std::vector<BenchmarkResult> run();
+
+	// Solves each region with every kernel that should give the same counts as skINTRINSIC_32
+	// and compares them point by point.  Returns the number of kernel and region pairs that differ.
+	int verify();
+
+	bool save(string filename);
+
+	// Compares the last run with a baseline written by save().  Returns the number of results
+	// whose pixel rate dropped by more than tolerance (0.1 = 10%), or -1 if the baseline could not be read.
+	int compare(string baselineFile, double tolerance);
+};
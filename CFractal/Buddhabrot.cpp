@@ -0,0 +1,342 @@
+//
+// Buddhabrot and Nebulabrot orbit density rendering.
+//
+// Date: 2016/08/05
+//
+
+#include "stdafx.h"
+#include "Buddhabrot.h"
+#include "ImageWriter.h"
+#include <math.h>
+#include <random>
+#include <algorithm>
+
+// Samples each worker claims at a time.  Large enough that claiming is rare, small enough that a
+// merge is never held up for long.
+static const int BATCH_SIZE = 4096;
+
+// Spreads the bits of a sample number so that neighbouring batches get unrelated seeds.
+static uint64_t mixSeed(uint64_t value)
+{
+	value += 0x9E3779B97F4A7C15ULL;
+	value = (value ^ (value >> 30)) * 0xBF58476D1CE4E5B9ULL;
+	value = (value ^ (value >> 27)) * 0x94D049BB133111EBULL;
+	return value ^ (value >> 31);
+}
+
+// Returns the first line of the checkpoint.  Only the settings that change the image are in
+// it, so a render can be resumed with more samples or threads.
+string BuddhabrotRenderer::checkpointHeader()
+{
+	char buffer[256];
+	sprintf_s(buffer, "cfractal buddhabrot %d %d %.17g %.17g %.17g %d %d %d\n", settings.width, settings.height, settings.center.x, settings.center.y, settings.pixelSize,
+		settings.itterations[0], settings.itterations[1], settings.itterations[2]);
+	return buffer;
+}
+
+// Loads the totals of a previous render with the same settings.  Returns false if there are none.
+bool BuddhabrotRenderer::loadCheckpoint()
+{
+	FILE *file;
+	if (fopen_s(&file, (settings.filename + ".checkpoint").c_str(), "rb") != 0)
+		return false;
+
+	char buffer[256] = {};
+	fgets(buffer, sizeof(buffer), file);
+	bool loaded = false;
+	if (checkpointHeader() == buffer)
+	{
+		long long count = 0;
+		loaded = fread(&count, sizeof(count), 1, file) == 1 &&
+			fread(density.data(), sizeof(double), density.size(), file) == density.size();
+		if (loaded)
+			samplesDone = count;
+		else
+			std::fill(density.begin(), density.end(), 0.0);
+	}
+	else
+		TRACE("Buddhabrot settings have changed, starting from the beginning.");
+	fclose(file);
+	return loaded;
+}
+
+// Writes the totals so far.  The new checkpoint is written next to the old one and then moved
+// over it, so there is always a complete checkpoint on disk.
+bool BuddhabrotRenderer::saveCheckpoint()
+{
+	string filename = settings.filename + ".checkpoint";
+	string temporary = filename + ".tmp";
+
+	FILE *file;
+	if (fopen_s(&file, temporary.c_str(), "wb") != 0) {
+		TRACE("Could not write checkpoint " + temporary);
+		return false;
+	}
+	string header = checkpointHeader();
+	bool written = fputs(header.c_str(), file) >= 0 &&
+		fwrite(&samplesDone, sizeof(samplesDone), 1, file) == 1 &&
+		fwrite(density.data(), sizeof(double), density.size(), file) == density.size();
+	fclose(file);
+
+	if (!written || !MoveFileExA(temporary.c_str(), filename.c_str(), MOVEFILE_REPLACE_EXISTING)) {
+		TRACE("Could not write checkpoint " + filename);
+		return false;
+	}
+	return true;
+}
+
+// Solves a coarse grid over the sampling area with the Mandelbrot solver and weights each cell
+// by the escape counts around it.  Long orbits come from near the boundary, cells well inside
+// the set have none at all.  Every cell keeps a small weight so no orbit is impossible to pick.
+void BuddhabrotRenderer::buildImportance()
+{
+	int limit = *std::max_element(settings.itterations, settings.itterations + 3);
+	int blockSize = solver.getBlockSize();
+	int blocks = std::max(1, (settings.importanceSize + blockSize - 1) / blockSize);
+	int size = blocks * blockSize;
+	double cellSize = 4.0 / size;
+
+	std::vector<int> counts((size_t)size * size);
+	parallelFor(blocks * blocks, settings.threads, [&](int i) {
+		int bx = i % blocks;
+		int by = i / blocks;
+		auto block = solver.CreateBlock(-2.0 + bx * blockSize * cellSize, -2.0 + by * blockSize * cellSize, cellSize);
+		block.itterations = limit;
+		solver.Solve(block);
+		for (int y = 0; y < blockSize; y++)
+			memcpy(&counts[(size_t)(by * blockSize + y) * size + bx * blockSize], block.values_out + y * blockSize, blockSize * sizeof(int));
+		solver.ReleaseBlock(block);
+	});
+
+	// a cell is worth as much as the slowest escaping point next to it, which also picks up the
+	// edges of cells that are inside the set at their centre.
+	std::vector<double> weights((size_t)size * size);
+	double maxWeight = 0;
+	for (int y = 0; y < size; y++)
+		for (int x = 0; x < size; x++)
+		{
+			double weight = 0;
+			for (int dy = -1; dy <= 1; dy++)
+				for (int dx = -1; dx <= 1; dx++)
+				{
+					int nx = x + dx;
+					int ny = y + dy;
+					if (nx < 0 || ny < 0 || nx >= size || ny >= size)
+						continue;
+					int count = counts[(size_t)ny * size + nx];
+					if (count < limit)
+						weight = std::max(weight, (double)count);
+				}
+			weights[(size_t)y * size + x] = weight;
+			maxWeight = std::max(maxWeight, weight);
+		}
+
+	double minimum = std::max(maxWeight, 1.0) * 1e-3;
+	cellCdf.resize(weights.size());
+	double total = 0;
+	for (size_t i = 0; i < weights.size(); i++)
+	{
+		weights[i] = std::max(weights[i], minimum);
+		total += weights[i];
+		cellCdf[i] = total;
+	}
+
+	// a cell picked n times more often than it would be uniformly counts 1/n.
+	double mean = total / weights.size();
+	cellScale.resize(weights.size());
+	for (size_t i = 0; i < weights.size(); i++)
+		cellScale[i] = (float)(mean / weights[i]);
+	settings.importanceSize = size;
+}
+
+// Samples count points and records the orbits of the ones that escape into the thread's buffer.
+// orbit must have room for two doubles per itteration.
+void BuddhabrotRenderer::sampleBatch(int thread, uint64_t seed, int count, std::vector<double> &orbit)
+{
+	int limit = *std::max_element(settings.itterations, settings.itterations + 3);
+	int size = settings.importanceSize;
+	double cellSize = 4.0 / size;
+
+	std::mt19937_64 random(mixSeed(seed));
+	std::uniform_real_distribution<double> unit(0.0, 1.0);
+
+	// padded out to whole SIMD lanes.
+	int lanes = MandelbrotSolver::getKernelLanes(solver.getKernel());
+	int padded = (count + lanes - 1) / lanes * lanes;
+
+	FractalBlock batch;
+	batch.width = padded;
+	batch.height = 1;
+	batch.itterations = limit;
+	batch.x_in = new double[padded];
+	batch.y_in = new double[padded];
+	batch.values_out = new int[padded];
+	std::vector<int> cells(padded);
+
+	for (int i = 0; i < padded; i++)
+	{
+		int cell = (int)(std::upper_bound(cellCdf.begin(), cellCdf.end(), unit(random) * cellCdf.back()) - cellCdf.begin());
+		cell = std::min(cell, (int)cellCdf.size() - 1);
+		cells[i] = cell;
+		batch.x_in[i] = -2.0 + (cell % size + unit(random)) * cellSize;
+		batch.y_in[i] = -2.0 + (cell / size + unit(random)) * cellSize;
+	}
+
+	solver.Solve(batch);
+
+	auto &buffer = threadDensity[thread];
+	size_t plane = (size_t)settings.width * settings.height;
+	double left = settings.center.x - settings.width / 2.0 * settings.pixelSize;
+	double top = settings.center.y - settings.height / 2.0 * settings.pixelSize;
+	double scale = 1.0 / settings.pixelSize;
+
+	for (int i = 0; i < count; i++)
+	{
+		if (batch.values_out[i] >= limit)
+			continue;
+
+		// the kernel only says which points escape, their orbits are traced again in double
+		// precision.  This decides in the end, points near the boundary can differ.
+		double cr = batch.x_in[i];
+		double ci = batch.y_in[i];
+		double zr = 0;
+		double zi = 0;
+		int length = 0;
+		for (; length < limit; length++)
+		{
+			double t = zr * zr - zi * zi + cr;
+			zi = 2 * zr * zi + ci;
+			zr = t;
+			orbit[length * 2] = zr;
+			orbit[length * 2 + 1] = zi;
+			if (zr * zr + zi * zi > 4.0)
+				break;
+		}
+		if (length >= limit)
+			continue;
+
+		float weight = cellScale[cells[i]];
+		for (int k = 0; k < length; k++)
+		{
+			int px = (int)floor((orbit[k * 2] - left) * scale);
+			int py = (int)floor((orbit[k * 2 + 1] - top) * scale);
+			if (px < 0 || py < 0 || px >= settings.width || py >= settings.height)
+				continue;
+			size_t index = (size_t)py * settings.width + px;
+			for (int channel = 0; channel < 3; channel++)
+				if (length < settings.itterations[channel])
+					buffer[channel * plane + index] += weight;
+		}
+	}
+
+	solver.ReleaseBlock(batch);
+}
+
+// Adds every thread's buffer into the totals and clears them.  Rows are summed in parallel,
+// each by one thread, so no two threads touch the same memory.
+void BuddhabrotRenderer::merge()
+{
+	size_t plane = (size_t)settings.width * settings.height;
+	parallelFor(settings.height, settings.threads, [&](int y) {
+		for (int channel = 0; channel < 3; channel++)
+		{
+			size_t first = channel * plane + (size_t)y * settings.width;
+			for (auto &buffer : threadDensity)
+			{
+				for (int x = 0; x < settings.width; x++)
+				{
+					density[first + x] += buffer[first + x];
+					buffer[first + x] = 0;
+				}
+			}
+		}
+	});
+}
+
+// Maps each channel's density to brightness, with the brightest 0.1% of pixels saturated and a
+// square root curve so faint orbits still show.
+bool BuddhabrotRenderer::writeImage()
+{
+	size_t plane = (size_t)settings.width * settings.height;
+	std::vector<uint8_t> rgb(plane * 3);
+	for (int channel = 0; channel < 3; channel++)
+	{
+		std::vector<double> sorted(density.begin() + channel * plane, density.begin() + (channel + 1) * plane);
+		size_t bright = std::min(plane - 1, (size_t)(plane * 0.999));
+		std::nth_element(sorted.begin(), sorted.begin() + bright, sorted.end());
+		double white = sorted[bright] > 0 ? sorted[bright] : 1.0;
+
+		for (size_t i = 0; i < plane; i++)
+		{
+			double value = std::min(1.0, density[channel * plane + i] / white);
+			rgb[i * 3 + channel] = (uint8_t)(sqrt(value) * 255.0 + 0.5);
+		}
+	}
+	return writePPM(settings.filename, settings.width, settings.height, rgb.data());
+}
+
+// Renders the image described by settings.  Returns false if it could not be written.
+bool BuddhabrotRenderer::run(BuddhabrotSettings settings)
+{
+	this->settings = settings;
+	if (settings.width <= 0 || settings.height <= 0 || settings.pixelSize <= 0) {
+		TRACE("Invalid Buddhabrot image size.");
+		return false;
+	}
+	if (settings.threads < 1)
+		this->settings.threads = 1;
+	solver.setKernel(settings.kernel);
+
+	size_t plane = (size_t)settings.width * settings.height;
+	density.assign(plane * 3, 0.0);
+	samplesDone = 0;
+	if (settings.resume && loadCheckpoint())
+		TRACE("Resuming from " + floatToStr(samplesDone / 1e6) + " million samples.");
+
+	buildImportance();
+
+	int threads = this->settings.threads;
+	threadDensity.assign(threads, std::vector<float>(plane * 3, 0.0f));
+	int limit = *std::max_element(settings.itterations, settings.itterations + 3);
+
+	TRACE("Rendering " + intToStr(settings.width) + "x" + intToStr(settings.height) + " orbit density to " + settings.filename + " (" +
+		floatToStr(settings.samples / 1e6) + " million samples, " + intToStr(threads) + " threads)");
+
+	double startTime = time();
+	double checkpointAt = wallTime() + settings.checkpointSeconds;
+	long long startSamples = samplesDone;
+	while (samplesDone < settings.samples)
+	{
+		// every thread samples into its own buffer until it is time to merge.
+		samplesClaimed = samplesDone;
+		double mergeAt = wallTime() + settings.mergeSeconds;
+		parallelFor(threads, threads, [&](int thread) {
+			std::vector<double> orbit((size_t)limit * 2);
+			while (wallTime() < mergeAt)
+			{
+				long long first = samplesClaimed.fetch_add(BATCH_SIZE);
+				if (first >= this->settings.samples)
+					break;
+				int count = (int)std::min((long long)BATCH_SIZE, this->settings.samples - first);
+				sampleBatch(thread, (uint64_t)first, count, orbit);
+			}
+		});
+		samplesDone = std::min((long long)samplesClaimed, settings.samples);
+		merge();
+
+		double elapsed = time() - startTime;
+		TRACE(floatToStr(100.0 * samplesDone / settings.samples) + "% done, " + floatToStr((samplesDone - startSamples) / elapsed / 1e6) + " million samples/s");
+
+		if (wallTime() >= checkpointAt || samplesDone >= settings.samples) {
+			saveCheckpoint();
+			checkpointAt = wallTime() + settings.checkpointSeconds;
+		}
+	}
+
+	if (!writeImage()) {
+		TRACE("Could not write " + settings.filename);
+		return false;
+	}
+	TRACE("Buddhabrot finished in " + floatToStr(time() - startTime) + " seconds, run again with more samples and resume to refine it.");
+	return true;
+}
@@ -0,0 +1,87 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <atomic>
+#include "helper.h"
+#include "Mandel.h"
+
+struct BuddhabrotSettings
+{
+	// Output image, written as a PPM.
+	string filename;
+
+	// Size of the image in pixels.
+	int width = 1024;
+	int height = 1024;
+
+	// Location of the center of the image in fractal space, and the width of a pixel.
+	Vector2d center = Vector2d(-0.5, 0);
+	double pixelSize = 3.0 / 1024;
+
+	// Itteration limits of the red, green and blue channels.  A channel records every orbit
+	// that escapes within its limit, so equal limits give a plain Buddhabrot and different ones
+	// a Nebulabrot.
+	int itterations[3] = { 5000, 500, 50 };
+
+	// Orbits to sample in total.
+	long long samples = 100000000;
+
+	int threads = 4;
+
+	// Kernel the escaping orbits and the importance pre-pass are solved with.
+	SolverKernel kernel = skINTRINSIC_32;
+
+	// Carry on from the checkpoint of a previous render to the same file.
+	bool resume = false;
+
+	// Seconds between merging the per thread buffers, and between checkpoints.  Merging often
+	// keeps the single precision per thread counts small enough to be exact.
+	double mergeSeconds = 10;
+	double checkpointSeconds = 300;
+
+	// Cells across the coarse pre-pass that importance sampling works from.
+	int importanceSize = 256;
+};
+
+// Renders orbit density images.  Points are sampled in batches, escaping orbits are found with
+// the Mandelbrot solver's SIMD kernel and only those are traced again to record where they go.
+// Each thread records into its own density buffer so nothing is shared while sampling, the
+// buffers are summed into the image in a parallel reduction every few seconds.
+//
+// Points are drawn from a coarse Mandelbrot pre-pass so that more of them land near the
+// boundary where the long orbits are, and each is weighted by how much more likely it was to be
+// picked than under uniform sampling, so the image is the same as with uniform sampling.  The
+// totals are written to <filename>.checkpoint so a render can be stopped and resumed.
+class BuddhabrotRenderer
+{
+private:
+	BuddhabrotSettings settings;
+	MandelbrotSolver solver;
+
+	// Sample points are drawn from the square [-2, 2] x [-2, 2], cells of importanceSize
+	// across are picked with probability proportional to their weight.
+	std::vector<double> cellCdf;
+	std::vector<float> cellScale;
+
+	// Per thread density, three channels of width * height each.
+	std::vector<std::vector<float>> threadDensity;
+
+	// Sum of all merged densities, and the number of samples in it.
+	std::vector<double> density;
+	long long samplesDone = 0;
+
+	std::atomic<long long> samplesClaimed{ 0 };
+
+	string checkpointHeader();
+	bool loadCheckpoint();
+	bool saveCheckpoint();
+
+	void buildImportance();
+	void sampleBatch(int thread, uint64_t seed, int count, std::vector<double> &orbit);
+	void merge();
+	bool writeImage();
+
+public:
+	bool run(BuddhabrotSettings settings);
+};
@@ -12,9 +12,21 @@
 #include "Windows.h"
 #include "Winuser.h"
 #include "glHelper.h"
+#include "Exporter.h"
+#include "Buddhabrot.h"
+#include "ZoomAnimation.h"
+#include "TileServer.h"
+#include "Benchmark.h"
+#include "PipelineBenchmark.h"
+#include "ViewportTrace.h"
+#include "StageTrace.h"
+#include "Metrics.h"
+#include "Config.h"
 #include <gl/freeglut.h>
 #include <chrono>
 #include <thread>
+#include <vector>
+#include <algorithm>
 
 #define MAX_LOADSTRING 100
 
@@ -24,6 +36,34 @@ MandelbrotSolver *solver = NULL;
 
 RenderGrid *renderGrid = NULL;
 
+// Solved tiles are kept here between sessions.
+TileCache *tileCache = NULL;
+
+// Viewport movement is written here when started with --record.
+ViewportTrace *viewportTrace = NULL;
+
+// Stage timings are written here when started with --trace.
+string stageTraceFile;
+
+// Metrics overlay, toggled with 'm'.
+bool showMetrics = false;
+// Snapshot the overlay's rates are measured from, taken about once a second.
+MetricsSnapshot overlayMark;
+MetricsSnapshot overlayRates;
+
+// Draw with the Compositor instead of GL textures, set by --software.
+bool softwareDisplay = false;
+Compositor compositor;
+
+// Screenshots taken with 'p' so far.
+int screenshots = 0;
+
+// Machine settings, see loadConfig.
+const char *CONFIG_FILE = "cfractal.cfg";
+Config config;
+std::vector<string> configOverrides;
+bool retune = false;
+
 int ticker = 0;
 
 double elapsed = 0;
@@ -33,6 +73,7 @@ HBITMAP page = NULL;
 
 Viewport viewport;
 
+// Set when the viewport has moved and the grid needs preparing again.
 bool dirty = true;
 
 int VIEWPORT_WIDTH = 1440;
@@ -57,6 +98,16 @@ char *window_title = "Sample OpenGL FreeGlut App";
 void drawFractalGrid();
 void handleKeyboardInput(unsigned char key, int x, int y);
 void update();
+void saveStageTrace();
+void loadConfig();
+void saveScreenshot();
+void runExport(int argc, char **argv);
+void runBuddhabrot(int argc, char **argv);
+void runAnimation(int argc, char **argv);
+void runServer(int argc, char **argv);
+void runBenchmark(int argc, char **argv);
+void runScaling(int argc, char **argv);
+void runReplay(int argc, char **argv);
 
 //-------------------------------------------------------------------------
 //  Set OpenGL program initial state.
@@ -69,7 +120,21 @@ void init()
 	viewport = Viewport();
 	viewport.size = Vector2d(VIEWPORT_WIDTH, VIEWPORT_HEIGHT);
 	setOrtho(VIEWPORT_WIDTH, VIEWPORT_HEIGHT);
-	renderGrid = new RenderGrid(&viewport);
+
+	loadConfig();
+	renderGrid = new RenderGrid(&viewport, config.threads, config.tileSize);
+	renderGrid->renderQueue->solver.setKernel(config.kernel);
+	renderGrid->renderQueue->solver.setSeriesApproximation(config.series);
+	renderGrid->renderQueue->progressive = true;
+	renderGrid->renderQueue->previewItterations = 256;
+	renderGrid->adaptiveItterations = true;
+	renderGrid->renderQueue->histograms = true;
+	renderGrid->renderQueue->software = softwareDisplay;
+	compositor.threads = config.threads;
+
+	tileCache = new TileCache();
+	if (tileCache->open("tilecache"))
+		renderGrid->renderQueue->cache = tileCache;
 
 	solver = new MandelbrotSolver();
 
@@ -81,6 +146,79 @@ void init()
 //-------------------------------------------------------------------------
 void main(int argc, char **argv)
 {
+	// Diagnostic and configuration options, these go before the mode.
+	while (argc > 1)
+	{
+		string option = argv[1];
+		int used = 2;
+		// Stage tracing for this run, written when the program exits.
+		if (option == "--trace" && argc > 2) {
+			stageTraceFile = argv[2];
+			StageTrace::start();
+			atexit(saveStageTrace);
+		}
+		// Metrics snapshot once a second.
+		else if (option == "--metrics" && argc > 2)
+			metrics.startDump(argv[2], 1.0);
+		// Override a setting for this run only, e.g. --config threads=2
+		else if (option == "--config" && argc > 2)
+			configOverrides.push_back(argv[2]);
+		// Calibrate again even if there is a config file.
+		else if (option == "--retune") {
+			retune = true;
+			used = 1;
+		}
+		// Draw the viewer in software, for machines without a GPU.
+		else if (option == "--software") {
+			softwareDisplay = true;
+			used = 1;
+		}
+		else
+			break;
+		argv[used] = argv[0];
+		argc -= used;
+		argv += used;
+	}
+
+	// Headless modes.
+	if (argc > 1 && string(argv[1]) == "--export") {
+		runExport(argc, argv);
+		return;
+	}
+	if (argc > 1 && string(argv[1]) == "--buddhabrot") {
+		runBuddhabrot(argc, argv);
+		return;
+	}
+	if (argc > 1 && string(argv[1]) == "--animate") {
+		runAnimation(argc, argv);
+		return;
+	}
+	if (argc > 1 && string(argv[1]) == "--serve") {
+		runServer(argc, argv);
+		return;
+	}
+	if (argc > 1 && string(argv[1]) == "--bench") {
+		runBenchmark(argc, argv);
+		return;
+	}
+	if (argc > 1 && string(argv[1]) == "--scaling") {
+		runScaling(argc, argv);
+		return;
+	}
+	if (argc > 1 && string(argv[1]) == "--replay") {
+		runReplay(argc, argv);
+		return;
+	}
+
+	// Record the viewport path for later replay with --replay.
+	if (argc > 2 && string(argv[1]) == "--record") {
+		viewportTrace = new ViewportTrace();
+		if (!viewportTrace->startRecording(argv[2], Vector2d(VIEWPORT_WIDTH, VIEWPORT_HEIGHT))) {
+			delete viewportTrace;
+			viewportTrace = NULL;
+		}
+	}
+
 	TRACE("Initializing cFractal");
 	//  Connect to the windowing system + create a window
 	//  with the specified dimensions and position
@@ -107,6 +245,240 @@ void main(int argc, char **argv)
 
 
 
+//-------------------------------------------------------------------------
+//  Write the stage trace.  Any mode can be traced by putting --trace <file.json> first,
+//  and metrics can be logged the same way with --metrics <file>.
+//-------------------------------------------------------------------------
+void saveStageTrace()
+{
+	StageTrace::save(stageTraceFile);
+}
+
+//-------------------------------------------------------------------------
+//  Load the machine settings, calibrating first if this is the first start (or --retune
+//  was given).  --config overrides are applied afterwards and are not saved.
+//-------------------------------------------------------------------------
+void loadConfig()
+{
+	if (retune || !config.load(CONFIG_FILE)) {
+		Autotuner autotuner;
+		config = autotuner.run();
+		config.save(CONFIG_FILE);
+	}
+
+	for (auto &assignment : configOverrides)
+		if (!config.set(assignment))
+			TRACE("Invalid setting " + assignment);
+
+	TRACE("Config: " + config.toString());
+}
+
+//-------------------------------------------------------------------------
+//  Export an image straight to disk without opening a window.
+//  --export <file.ppm|tif|raw> <width> <height> <x> <y> <pixel size> [threads] [memory MB] [--resume] [--aa[=samples]]
+//-------------------------------------------------------------------------
+void runExport(int argc, char **argv)
+{
+	if (argc < 8) {
+		TRACE("Usage: --export <file.ppm|tif|raw> <width> <height> <x> <y> <pixel size> [threads] [memory MB] [--resume] [--aa[=samples]]");
+		return;
+	}
+
+	ExportSettings settings;
+	settings.filename = argv[2];
+	settings.width = atoi(argv[3]);
+	settings.height = atoi(argv[4]);
+	settings.center = Vector2d(atof(argv[5]), atof(argv[6]));
+	settings.pixelSize = atof(argv[7]);
+	settings.threads = std::thread::hardware_concurrency();
+
+	int position = 0;
+	for (int i = 8; i < argc; i++)
+	{
+		if (string(argv[i]) == "--resume")
+			settings.resume = true;
+		// supersample edge pixels, 16 samples unless given.
+		else if (string(argv[i]).compare(0, 4, "--aa") == 0)
+			settings.antiAlias = argv[i][4] == '=' ? atoi(argv[i] + 5) : 16;
+		else if (position++ == 0)
+			settings.threads = atoi(argv[i]);
+		else
+			settings.memoryBudget = atoi(argv[i]);
+	}
+
+	loadConfig();
+	settings.tileSize = config.tileSize;
+
+	Exporter exporter;
+	exporter.run(settings);
+}
+
+//-------------------------------------------------------------------------
+//  Render a Buddhabrot (or with different limits per channel a Nebulabrot) orbit density image.
+//  --buddhabrot <file.ppm> <width> <height> <x> <y> <pixel size> <million samples> [red,green,blue limits] [threads] [--resume]
+//-------------------------------------------------------------------------
+void runBuddhabrot(int argc, char **argv)
+{
+	if (argc < 9) {
+		TRACE("Usage: --buddhabrot <file.ppm> <width> <height> <x> <y> <pixel size> <million samples> [red,green,blue limits] [threads] [--resume]");
+		return;
+	}
+
+	BuddhabrotSettings settings;
+	settings.filename = argv[2];
+	settings.width = atoi(argv[3]);
+	settings.height = atoi(argv[4]);
+	settings.center = Vector2d(atof(argv[5]), atof(argv[6]));
+	settings.pixelSize = atof(argv[7]);
+	settings.samples = (long long)(atof(argv[8]) * 1e6);
+	settings.threads = std::thread::hardware_concurrency();
+
+	int position = 0;
+	for (int i = 9; i < argc; i++)
+	{
+		if (string(argv[i]) == "--resume")
+			settings.resume = true;
+		else if (position++ == 0) {
+			int limits[3];
+			if (sscanf_s(argv[i], "%d,%d,%d", &limits[0], &limits[1], &limits[2]) == 3)
+				memcpy(settings.itterations, limits, sizeof(limits));
+			else
+				settings.itterations[0] = settings.itterations[1] = settings.itterations[2] = atoi(argv[i]);
+		}
+		else
+			settings.threads = atoi(argv[i]);
+	}
+
+	loadConfig();
+	settings.kernel = config.kernel;
+
+	BuddhabrotRenderer renderer;
+	renderer.run(settings);
+}
+
+//-------------------------------------------------------------------------
+//  Render a zoom animation without opening a window.
+//  --animate <frame%05d.ppm | "|command"> <width> <height> <x> <y> <frames> [end scale] [threads]
+//-------------------------------------------------------------------------
+void runAnimation(int argc, char **argv)
+{
+	if (argc < 8) {
+		TRACE("Usage: --animate <frame%05d.ppm | \"|command\"> <width> <height> <x> <y> <frames> [end scale] [threads]");
+		return;
+	}
+
+	AnimationSettings settings;
+	settings.output = argv[2];
+	settings.width = atoi(argv[3]);
+	settings.height = atoi(argv[4]);
+	settings.target = Vector2d(atof(argv[5]), atof(argv[6]));
+	settings.frames = atoi(argv[7]);
+	settings.threads = std::thread::hardware_concurrency();
+	if (argc > 8) settings.endScale = atof(argv[8]);
+	if (argc > 9) settings.threads = atoi(argv[9]);
+
+	loadConfig();
+	ZoomAnimation animation(config.tileSize);
+	animation.run(settings);
+}
+
+//-------------------------------------------------------------------------
+//  Serve tiles to a slippy map viewer at http://127.0.0.1:<port>/z/x/y.png
+//  --serve [port] [cache directory]
+//-------------------------------------------------------------------------
+void runServer(int argc, char **argv)
+{
+	int port = argc > 2 ? atoi(argv[2]) : 8080;
+	string cacheDirectory = argc > 3 ? argv[3] : "tilecache";
+
+	loadConfig();
+
+	Viewport serverViewport;
+	RenderGrid grid(&serverViewport, config.threads, config.tileSize);
+	grid.renderQueue->solver.setKernel(config.kernel);
+	grid.renderQueue->solver.setSeriesApproximation(config.series);
+	grid.renderQueue->headless = true;
+
+	TileCache cache;
+	if (cache.open(cacheDirectory))
+		grid.renderQueue->cache = &cache;
+
+	TileServer server(&grid);
+	server.maxDepth = config.serverMaxDepth;
+	server.maxResidentTiles = config.serverTiles;
+	if (!server.start(port))
+		return;
+
+	TRACE("Press enter to stop the server.");
+	getchar();
+
+	server.stop();
+	TRACE(server.getStats());
+}
+
+//-------------------------------------------------------------------------
+//  Time the solver kernels over the reference regions.  Exits with 1 if any kernel's counts
+//  differ from the one it should match, or any result is slower than the baseline by more
+//  than tolerance (default 0.1).
+//  --bench [results.json] [baseline.json] [tolerance]
+//-------------------------------------------------------------------------
+void runBenchmark(int argc, char **argv)
+{
+	Benchmark benchmark;
+	if (benchmark.verify() != 0)
+		exit(1);
+	TRACE("Kernel counts match");
+	benchmark.run();
+
+	if (argc > 2)
+		benchmark.save(argv[2]);
+
+	if (argc > 3) {
+		double tolerance = argc > 4 ? atof(argv[4]) : 0.1;
+		int regressions = benchmark.compare(argv[3], tolerance);
+		if (regressions != 0)
+			exit(1);
+		TRACE("No regressions against " + string(argv[3]));
+	}
+}
+
+//-------------------------------------------------------------------------
+//  Measure how the render queue scales with the number of worker threads.
+//  --scaling [max threads] [results.json]
+//-------------------------------------------------------------------------
+void runScaling(int argc, char **argv)
+{
+	PipelineBenchmark benchmark;
+	benchmark.maxThreads = argc > 2 ? atoi(argv[2]) : std::thread::hardware_concurrency();
+	benchmark.run();
+
+	if (argc > 3)
+		benchmark.save(argv[3]);
+}
+
+//-------------------------------------------------------------------------
+//  Replay a viewport path recorded with --record and report how quickly the screen
+//  reached full detail.
+//  --replay <trace file> [frames.csv]
+//-------------------------------------------------------------------------
+void runReplay(int argc, char **argv)
+{
+	if (argc < 3) {
+		TRACE("Usage: --replay <trace file> [frames.csv]");
+		return;
+	}
+
+	ViewportTrace trace;
+	if (!trace.load(argv[2]))
+		return;
+
+	loadConfig();
+	TraceReplay replay(config.tileSize);
+	if (argc > 3)
+		replay.frameLog = argv[3];
+	replay.run(trace);
+}
+
 //-------------------------------------------------------------------------
 //  This function is passed to glutDisplayFunc in order to display 
 //  OpenGL contents on the window.
@@ -151,17 +523,49 @@ void drawFractalGrid()
 {
 	//drawRect(destination, Vector2d(0, 0), Vector2d(VIEWPORT_WIDTH, VIEWPORT_HEIGHT), RGB(0, 0, 0));
 
-	int layer = (int)log2(viewport.scale);
+	// prepare never goes above depth 1, so don't try to draw anything above it either.
+	int layer = renderGrid->layerForScale(viewport.scale);
+	if (layer < 1) layer = 1;
 	double startTime;
 
+	// only needed when the view has moved, the grid works out which tiles are new.
 	startTime = time();
-	renderGrid->prepare(layer); 
+	if (dirty) {
+		STAGE_SPAN("prepare", NULL);
+		renderGrid->prepare(layer);
+		dirty = false;
+	}
+	renderGrid->deepen();
+	renderGrid->updateColors();
+	renderGrid->garbageCollect();
 	//TRACE("Took " + floatToStr(time() - startTime) + " seconds to prep." + "[" + intToStr(ticker) + "]");
 
 	renderGrid->targetDepth = layer;
 
 	startTime = time();
-	renderGrid->root->recursiveDraw();
+	{
+		STAGE_SPAN("draw", NULL);
+		if (softwareDisplay) {
+			compositor.resize(VIEWPORT_WIDTH, VIEWPORT_HEIGHT);
+			compositor.clear(Color(0, 0, 128));
+			renderGrid->compose(compositor);
+			drawPixels(compositor.width, compositor.height, compositor.frame.data());
+		}
+		else
+			renderGrid->root->recursiveDraw();
+	}
+
+	if (showMetrics) {
+		// a single frame is far too short to measure rates over.
+		auto current = metrics.snapshot(&overlayMark);
+		if (current.time - overlayMark.time >= 1.0) {
+			overlayRates = current;
+			overlayMark = current;
+		}
+		current.tilesPerSecond = overlayRates.tilesPerSecond;
+		current.itterationsPerSecond = overlayRates.itterationsPerSecond;
+		drawText(Vector2d(10, 20), current.toString(), Color(255, 255, 255));
+	}
 	//TRACE("Took " + floatToStr(time() - startTime) + " seconds to draw." + "[" + intToStr(ticker) + "]");
 
 }
@@ -184,7 +588,35 @@ void handleKeyboardInput(unsigned char key, int x, int y)
 	case 'q': viewport.scale *= 1.1;
 		break;
 	case 'e': viewport.scale /= 1.1;
+		break;
+	case 'm': showMetrics = !showMetrics;
+		break;
+	// quality of the adaptive itteration limits, blocks are solved again once the view is idle.
+	case '[': renderGrid->quality = std::max(0.25, renderGrid->quality / 2);
+		break;
+	case ']': renderGrid->quality = std::min(8.0, renderGrid->quality * 2);
+		break;
+	case 'h': renderGrid->colorMode = renderGrid->colorMode == cmLINEAR ? cmHISTOGRAM : cmLINEAR;
+		break;
+	case 'p': saveScreenshot();
+		break;
 	}		
+
+	dirty = true;
+}
+
+// Writes the view as it is now to screenshot<n>.ppm, drawn with the Compositor whichever way
+// the window is drawn.
+void saveScreenshot()
+{
+	compositor.resize(VIEWPORT_WIDTH, VIEWPORT_HEIGHT);
+	compositor.clear(Color(0, 0, 128));
+	renderGrid->compose(compositor);
+
+	char filename[64];
+	sprintf_s(filename, "screenshot%03d.ppm", screenshots++);
+	if (writePPM(filename, compositor.width, compositor.height, compositor.frame.data()))
+		TRACE(string("Saved ") + filename);
 }
 
 void update()
@@ -194,6 +626,9 @@ void update()
 	lastTime = time();
 	ticker++;		
 
+	if (viewportTrace)
+		viewportTrace->record(&viewport);
+
 	// handle updates.
 	renderGrid->renderQueue->update();
 }
@@ -207,11 +642,11 @@ void __drawBlock(HBITMAP destination, int atX, int atY, FractalBlock block, bool
 
 	// this is quite slow, some kind of blit would be much faster
 	COLORREF color = RGB(255, 0, 0);
-	for (int ylp = 0; ylp < 64; ylp++)
+	for (int ylp = 0; ylp < block.height; ylp++)
 	{
-		for (int xlp = 0; xlp < 64; xlp++)
+		for (int xlp = 0; xlp < block.width; xlp++)
 		{
-			int it = block.values_out[xlp + ylp * 64];
+			int it = block.values_out[xlp + ylp * block.width];
 			color = RGB(it / 4, it / 4, 128);
 
 			if (debug && ((xlp == 0) || (ylp == 0)))
@@ -239,12 +674,14 @@ void __renderFractal(HBITMAP destination, MandelbrotSolver solver, HDC _hdc = NU
 	using namespace std;
 	clock_t begin = clock();
 
+	int size = solver.getBlockSize();
+
 	for (int blockY = 0; blockY < 30; blockY++) {
 		for (int blockX = 0; blockX < 30; blockX++) {
 
 			float scale = 0.5f / 64.0f / 10.0f;
-			float atX = blockX * 64.0f * scale - 1.5f;
-			float atY = blockY * 64.0f * scale - 1.0f;
+			float atX = blockX * size * scale - 1.5f;
+			float atY = blockY * size * scale - 1.0f;
 			
 
 			FractalBlock block = solver.CreateBlock(atX, atY, scale);
@@ -252,14 +689,14 @@ void __renderFractal(HBITMAP destination, MandelbrotSolver solver, HDC _hdc = NU
 
 			// this is quite slow, some kind of blit would be much faster
 			COLORREF color = RGB(255, 0, 0);
-			for (int ylp = 0; ylp < 64; ylp++)
+			for (int ylp = 0; ylp < size; ylp++)
 			{
-				for (int xlp = 0; xlp < 64; xlp++)
+				for (int xlp = 0; xlp < size; xlp++)
 				{
-					int it = block.values_out[xlp + ylp * 64];
+					int it = block.values_out[xlp + ylp * size];
 					color = RGB(it / 4, it / 4, it / 4);
 
-					SetPixel(newdc, blockX * 64 + xlp, blockY * 64 + ylp, color);
+					SetPixel(newdc, blockX * size + xlp, blockY * size + ylp, color);
 				}
 			}
 
@@ -0,0 +1,132 @@
+//
+// Color mapping for fractal itteration data.
+//
+// Date: 2016/07/20
+//
+
+#include "stdafx.h"
+#include "ColorMap.h"
+#include <algorithm>
+
+void mapColors(const int *values, int count, int maxItterations, uint8_t *rgb)
+{
+	double factor = 256.0 / maxItterations;
+	for (int i = 0; i < count; i++)
+	{
+		int shade = 255 - (int)(values[i] * factor);
+		if (shade < 0) shade = 0;
+		rgb[i * 3 + 0] = shade;
+		rgb[i * 3 + 1] = shade;
+		rgb[i * 3 + 2] = shade;
+	}
+}
+
+void buildHistogram(const int *values, int count, int limit, std::vector<HistogramEntry> &histogram)
+{
+	std::vector<int> sorted(values, values + count);
+	std::sort(sorted.begin(), sorted.end());
+
+	histogram.clear();
+	for (int i = 0; i < count && sorted[i] < limit;)
+	{
+		int value = sorted[i];
+		int run = 0;
+		while (i < count && sorted[i] == value) {
+			run++;
+			i++;
+		}
+		histogram.push_back({ value, run });
+	}
+}
+
+///  ------------------------------------------------------------------
+///  ViewHistogram
+///  ------------------------------------------------------------------
+
+ViewHistogram::ViewHistogram(int maxValue)
+{
+	size = maxValue + 1;
+	counts = new std::atomic<int>[size];
+	for (int i = 0; i < size; i++)
+		counts[i] = 0;
+}
+
+ViewHistogram::~ViewHistogram()
+{
+	delete[] counts;
+}
+
+void ViewHistogram::add(const std::vector<HistogramEntry> &histogram)
+{
+	long long added = 0;
+	for (auto &entry : histogram)
+	{
+		counts[std::min(entry.value, size - 1)].fetch_add(entry.count, std::memory_order_relaxed);
+		added += entry.count;
+	}
+	total += added;
+	changes++;
+}
+
+void ViewHistogram::remove(const std::vector<HistogramEntry> &histogram)
+{
+	long long removed = 0;
+	for (auto &entry : histogram)
+	{
+		counts[std::min(entry.value, size - 1)].fetch_sub(entry.count, std::memory_order_relaxed);
+		removed += entry.count;
+	}
+	total -= removed;
+	changes++;
+}
+
+void ViewHistogram::cumulative(std::vector<float> &cdf)
+{
+	cdf.resize(size);
+	long long sum = 0;
+	for (int i = 0; i < size; i++)
+	{
+		sum += counts[i].load(std::memory_order_relaxed);
+		cdf[i] = (float)sum;
+	}
+	float scale = sum > 0 ? 1.0f / sum : 0;
+	for (int i = 0; i < size; i++)
+		cdf[i] *= scale;
+}
+
+///  ------------------------------------------------------------------
+///  HistogramPalette
+///  ------------------------------------------------------------------
+
+void HistogramPalette::build(ViewHistogram &histogram)
+{
+	std::vector<float> cdf;
+	histogram.cumulative(cdf);
+
+	// same direction as the linear ramp, the fastest escaping points are white.  Each count
+	// gets the middle of its share of the ramp.
+	table.resize(cdf.size());
+	float below = 0;
+	for (size_t i = 0; i < cdf.size(); i++)
+	{
+		int shade = 255 - (int)((below + cdf[i]) * 0.5f * 255.0f + 0.5f);
+		below = cdf[i];
+		table[i] = shade * 0x010101;
+	}
+	version++;
+}
+
+void HistogramPalette::apply(const int *values, int count, int limit, uint8_t *rgb)
+{
+	// one table load per point.  SSE2 has no gather, so there is nothing to gain from SIMD here.
+	int last = (int)table.size() - 1;
+	const uint32_t *lookup = table.data();
+	for (int i = 0; i < count; i++)
+	{
+		int value = values[i];
+		uint32_t color = value >= limit ? 0 : lookup[value < last ? value : last];
+		rgb[i * 3 + 0] = (uint8_t)color;
+		rgb[i * 3 + 1] = (uint8_t)(color >> 8);
+		rgb[i * 3 + 2] = (uint8_t)(color >> 16);
+	}
+}
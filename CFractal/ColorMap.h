@@ -0,0 +1,73 @@
+#pragma once
+
+#include <stdint.h>
+#include <vector>
+#include <atomic>
+
+// Ways of coloring itteration counts.
+enum ColorMode {
+	// Fixed grey ramp over the highest itteration limit in use, see mapColors.
+	cmLINEAR,
+	// Grey ramp spread evenly over the counts in view, see HistogramPalette.
+	cmHISTOGRAM
+};
+
+// Maps itteration counts to 8 bit RGB triples using a linear grey ramp.
+// rgb must have room for count * 3 bytes.
+void mapColors(const int *values, int count, int maxItterations, uint8_t *rgb);
+
+// Number of points in a tile with the same itteration count.
+struct HistogramEntry
+{
+	int value;
+	int count;
+};
+
+// Fills histogram with the counts of the points in values that escaped, in order of value.
+// Points that reached limit are colored as inside the set so are left out.
+void buildHistogram(const int *values, int count, int limit, std::vector<HistogramEntry> &histogram);
+
+// Number of points with each itteration count over a set of tiles.  The counts are atomic, so
+// tiles can be added and removed from any thread without taking a lock.
+class ViewHistogram
+{
+private:
+	std::atomic<int> *counts;
+	int size;
+
+public:
+	// Points counted, and the number of adds and removes so far.
+	std::atomic<long long> total{ 0 };
+	std::atomic<int> changes{ 0 };
+
+	// Counts values from 0 to maxValue, higher values are counted as maxValue.
+	ViewHistogram(int maxValue);
+	~ViewHistogram();
+
+	void add(const std::vector<HistogramEntry> &histogram);
+	void remove(const std::vector<HistogramEntry> &histogram);
+
+	// Fills cdf with the fraction of points counted at or below each value.
+	void cumulative(std::vector<float> &cdf);
+
+	int getSize() { return size; }
+};
+
+// Lookup table from itteration count to color that spreads the palette evenly over the points
+// in a ViewHistogram.  Each build gets a new version, so tiles colored with an older table can
+// be found and colored again.
+class HistogramPalette
+{
+private:
+	// One 0x00BBGGRR entry per itteration count.
+	std::vector<uint32_t> table;
+
+public:
+	// 0 until the first build.
+	int version = 0;
+
+	void build(ViewHistogram &histogram);
+
+	// Like mapColors, points at or above limit are colored as inside the set.
+	void apply(const int *values, int count, int limit, uint8_t *rgb);
+};
@@ -0,0 +1,181 @@
+//
+// Software compositor, draws tiles into a frame on the CPU with SSE2.
+//
+// Date: 2016/08/06
+//
+
+#include "stdafx.h"
+#include "Compositor.h"
+#include "emmintrin.h"
+#include <math.h>
+#include <string.h>
+#include <algorithm>
+
+// Where a frame pixel samples a tile along one axis.
+struct TileSample
+{
+	// Byte offset of the first of the two texels blended along this axis.
+	int offset;
+	// Weights of the two texels, 0 to 256, four copies of each so they line up with two texels
+	// unpacked to 16 bit lanes.
+	int16_t weights[8];
+};
+
+// Pixels from first up to end have their centres in [from, to), clipped to [0, limit).
+static void pixelRange(double from, double to, int limit, int &first, int &end)
+{
+	first = std::max(0, (int)ceil(from - 0.5));
+	end = std::min(limit, (int)ceil(to - 0.5));
+}
+
+// Works out which two texels of a size texel row the tile coordinate t (0 to 1) falls between.
+// Texel centres are at (i + 0.5) / size, past the first or last centre the edge texel is used.
+static TileSample sampleAt(double t, int size, int stride)
+{
+	double position = t * size - 0.5;
+	position = std::max(0.0, std::min((double)(size - 1), position));
+	int first = std::min((int)position, size - 2);
+	int weight = (int)((position - first) * 256 + 0.5);
+
+	TileSample sample;
+	sample.offset = first * stride;
+	for (int i = 0; i < 4; i++)
+	{
+		sample.weights[i] = (int16_t)(256 - weight);
+		sample.weights[i + 4] = (int16_t)weight;
+	}
+	return sample;
+}
+
+void Compositor::resize(int width, int height)
+{
+	if (width == this->width && height == this->height)
+		return;
+	this->width = width;
+	this->height = height;
+	frame.assign((size_t)width * height * 3, 0);
+}
+
+void Compositor::clear(Color color)
+{
+	addRect(Vector2d(0, 0), Vector2d(width, height), color);
+}
+
+void Compositor::addRect(Vector2d topLeft, Vector2d bottomRight, Color color)
+{
+	CompositeTile tile;
+	tile.color = color;
+	tile.topLeft = topLeft;
+	tile.bottomRight = bottomRight;
+	drawList.push_back(tile);
+}
+
+void Compositor::compose()
+{
+	int bands = (height + BAND_HEIGHT - 1) / BAND_HEIGHT;
+	parallelFor(bands, threads, [&](int band) {
+		drawBand(band);
+	});
+	drawList.clear();
+}
+
+void Compositor::toTexels(const uint8_t *rgb, int count, uint8_t *texels)
+{
+	for (int i = 0; i < count; i++)
+	{
+		texels[i * 4 + 0] = rgb[i * 3 + 0];
+		texels[i * 4 + 1] = rgb[i * 3 + 1];
+		texels[i * 4 + 2] = rgb[i * 3 + 2];
+		texels[i * 4 + 3] = 0;
+	}
+}
+
+void Compositor::drawBand(int band)
+{
+	int top = band * BAND_HEIGHT;
+	int bottom = std::min(height, top + BAND_HEIGHT);
+	for (auto &tile : drawList)
+	{
+		if (tile.bottomRight.y <= top || tile.topLeft.y >= bottom)
+			continue;
+		if (tile.texels)
+			drawTile(tile, top, bottom);
+		else
+			fillRect(tile, top, bottom);
+	}
+}
+
+void Compositor::fillRect(const CompositeTile &tile, int top, int bottom)
+{
+	int x1, x2, y1, y2;
+	pixelRange(tile.topLeft.x, tile.bottomRight.x, width, x1, x2);
+	pixelRange(tile.topLeft.y, tile.bottomRight.y, bottom, y1, y2);
+	y1 = std::max(y1, top);
+
+	for (int y = y1; y < y2; y++)
+	{
+		auto target = frame.data() + ((size_t)y * width + x1) * 3;
+		for (int x = x1; x < x2; x++, target += 3)
+		{
+			target[0] = (uint8_t)tile.color.r;
+			target[1] = (uint8_t)tile.color.g;
+			target[2] = (uint8_t)tile.color.b;
+		}
+	}
+}
+
+// Draws the rows of tile between top and bottom.  Each pixel blends the four texels around it,
+// first the two rows then the two columns, in 16 bit lanes with 8 bits of fraction.
+void Compositor::drawTile(const CompositeTile &tile, int top, int bottom)
+{
+	int x1, x2, y1, y2;
+	pixelRange(tile.topLeft.x, tile.bottomRight.x, width, x1, x2);
+	pixelRange(tile.topLeft.y, tile.bottomRight.y, bottom, y1, y2);
+	y1 = std::max(y1, top);
+	if (x1 >= x2 || y1 >= y2)
+		return;
+
+	int stride = tile.size * TEXEL_BYTES;
+	double uPerPixel = (tile.uv2.x - tile.uv1.x) / (tile.bottomRight.x - tile.topLeft.x);
+	double vPerPixel = (tile.uv2.y - tile.uv1.y) / (tile.bottomRight.y - tile.topLeft.y);
+
+	// every row samples the same columns.
+	std::vector<TileSample> columns(x2 - x1);
+	for (int x = x1; x < x2; x++)
+		columns[x - x1] = sampleAt(tile.uv1.x + (x + 0.5 - tile.topLeft.x) * uPerPixel, tile.size, TEXEL_BYTES);
+
+	__m128i zero = _mm_setzero_si128();
+	__m128i round = _mm_set1_epi16(128);
+
+	for (int y = y1; y < y2; y++)
+	{
+		auto row = sampleAt(tile.uv1.y + (y + 0.5 - tile.topLeft.y) * vPerPixel, tile.size, stride);
+		auto row0 = tile.texels + row.offset;
+		auto row1 = row0 + stride;
+		__m128i weight0 = _mm_set1_epi16(row.weights[0]);
+		__m128i weight1 = _mm_set1_epi16(row.weights[4]);
+
+		auto target = frame.data() + ((size_t)y * width + x1) * 3;
+		for (int x = x1; x < x2; x++, target += 3)
+		{
+			auto &column = columns[x - x1];
+
+			// the two texels either side on each row, as r g b - r g b - in 16 bit lanes.
+			__m128i above = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*)(row0 + column.offset)), zero);
+			__m128i below = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*)(row1 + column.offset)), zero);
+
+			// at most 255 * 256 + 128, so this fits in 16 bits unsigned.
+			__m128i blend = _mm_add_epi16(_mm_mullo_epi16(above, weight0), _mm_mullo_epi16(below, weight1));
+			blend = _mm_srli_epi16(_mm_add_epi16(blend, round), 8);
+
+			blend = _mm_mullo_epi16(blend, _mm_loadu_si128((const __m128i*)column.weights));
+			blend = _mm_add_epi16(blend, _mm_srli_si128(blend, 8));
+			blend = _mm_srli_epi16(_mm_add_epi16(blend, round), 8);
+
+			uint32_t color = (uint32_t)_mm_cvtsi128_si32(_mm_packus_epi16(blend, blend));
+			target[0] = (uint8_t)color;
+			target[1] = (uint8_t)(color >> 8);
+			target[2] = (uint8_t)(color >> 16);
+		}
+	}
+}
@@ -0,0 +1,66 @@
+#pragma once
+
+#include <vector>
+#include <stdint.h>
+#include "helper.h"
+
+// Bytes per texel of a tile drawn by the Compositor: red, green, blue and one unused byte, so a
+// texel is loaded with a single 32 bit read.
+const int TEXEL_BYTES = 4;
+
+// A tile's colors and the part of the frame they are drawn over.
+struct CompositeTile
+{
+	// size * size texels, top row first.  NULL fills the area with color instead.
+	const uint8_t *texels = NULL;
+	int size = 0;
+	Color color = Color(0, 0, 0);
+
+	// Area of the frame covered, in pixels.
+	Vector2d topLeft;
+	Vector2d bottomRight;
+
+	// Part of the tile stretched over that area, 0 to 1 across the tile as for drawTexture.
+	Vector2d uv1 = Vector2d(0, 0);
+	Vector2d uv2 = Vector2d(1, 1);
+};
+
+// Draws tiles into an RGB frame on the CPU, for when there is no GPU to do it or no window to
+// draw to.  Tiles are resampled bilinearly at pixel centres the way GL_LINEAR textures are, and
+// pixels are covered by the same rule so the result matches drawTexture.
+//
+// Tiles are added to a draw list and drawn together by compose.  The frame is split into bands
+// of rows that are drawn in parallel, each band drawing the tiles that touch it in list order.
+class Compositor
+{
+private:
+	std::vector<CompositeTile> drawList;
+
+	void drawBand(int band);
+	void drawTile(const CompositeTile &tile, int top, int bottom);
+	void fillRect(const CompositeTile &tile, int top, int bottom);
+
+public:
+	// Rows of the frame drawn by one task.
+	static const int BAND_HEIGHT = 32;
+
+	int threads = 4;
+
+	int width = 0;
+	int height = 0;
+	// width * height pixels of RGB, top row first.
+	std::vector<uint8_t> frame;
+
+	// Sets the frame size, keeping the frame if it is the same.
+	void resize(int width, int height);
+	void clear(Color color);
+
+	void add(const CompositeTile &tile) { drawList.push_back(tile); }
+	void addRect(Vector2d topLeft, Vector2d bottomRight, Color color);
+
+	// Draws everything in the draw list into the frame, the list is emptied.
+	void compose();
+
+	// Converts count RGB colors to texels.
+	static void toTexels(const uint8_t *rgb, int count, uint8_t *texels);
+};
@@ -0,0 +1,218 @@
+//
+// Machine configuration and startup calibration.
+//
+// Date: 2016/08/03
+//
+
+#include "stdafx.h"
+#include "Config.h"
+#include "helper.h"
+#include "PipelineBenchmark.h"
+#include <thread>
+
+///  ------------------------------------------------------------------
+///  Config
+///  ------------------------------------------------------------------
+
+bool Config::load(string filename)
+{
+	FILE *file;
+	if (fopen_s(&file, filename.c_str(), "r") != 0)
+		return false;
+
+	char line[256];
+	while (fgets(line, sizeof(line), file))
+	{
+		string text = line;
+		while (!text.empty() && (text.back() == '\n' || text.back() == '\r'))
+			text.pop_back();
+		if (text.empty() || text[0] == '#')
+			continue;
+		if (!set(text))
+			TRACE("Ignoring config line '" + text + "' in " + filename);
+	}
+	fclose(file);
+	return true;
+}
+
+bool Config::save(string filename)
+{
+	FILE *file;
+	if (fopen_s(&file, filename.c_str(), "w") != 0) {
+		TRACE("Could not write config " + filename);
+		return false;
+	}
+	fprintf(file, "# cFractal settings for this machine, delete this file to recalibrate.\n");
+	fprintf(file, "kernel=%s\n", MandelbrotSolver::getKernelName(kernel));
+	fprintf(file, "tileSize=%d\n", tileSize);
+	fprintf(file, "threads=%d\n", threads);
+	fprintf(file, "series=%d\n", series ? 1 : 0);
+	fprintf(file, "serverMaxDepth=%d\n", serverMaxDepth);
+	fprintf(file, "serverTiles=%d\n", serverTiles);
+	fclose(file);
+	return true;
+}
+
+bool Config::set(string assignment)
+{
+	size_t split = assignment.find('=');
+	if (split == string::npos)
+		return false;
+	string key = assignment.substr(0, split);
+	string value = assignment.substr(split + 1);
+
+	if (key == "kernel") {
+		for (int i = 0; i < SOLVER_KERNELS; i++)
+			if (value == MandelbrotSolver::getKernelName((SolverKernel)i)) {
+				kernel = (SolverKernel)i;
+				return true;
+			}
+		return false;
+	}
+	if (key == "tileSize") {
+		int size = atoi(value.c_str());
+		if (size < 32 || size > 512 || (size & (size - 1)) != 0)
+			return false;
+		tileSize = size;
+		return true;
+	}
+	if (key == "threads") {
+		int count = atoi(value.c_str());
+		if (count < 1 || count > 256)
+			return false;
+		threads = count;
+		return true;
+	}
+	if (key == "series") {
+		if (value != "0" && value != "1")
+			return false;
+		series = value == "1";
+		return true;
+	}
+	if (key == "serverMaxDepth") {
+		int depth = atoi(value.c_str());
+		if (depth < 0 || depth > 30)
+			return false;
+		serverMaxDepth = depth;
+		return true;
+	}
+	if (key == "serverTiles") {
+		int count = atoi(value.c_str());
+		if (count < 1)
+			return false;
+		serverTiles = count;
+		return true;
+	}
+	return false;
+}
+
+string Config::toString()
+{
+	return string("kernel ") + MandelbrotSolver::getKernelName(kernel) + ", tile size " + intToStr(tileSize) + ", " + intToStr(threads) + " threads";
+}
+
+///  ------------------------------------------------------------------
+///  Autotuner
+///  ------------------------------------------------------------------
+
+// Solves the whole set at a resolution where it has a bit of everything in it.
+static const double TUNE_X = -0.75;
+static const double TUNE_Y = 0.0;
+static const double TUNE_WIDTH = 3.0;
+
+// Returns the kernel with the best single threaded pixel rate.
+SolverKernel Autotuner::tuneKernel()
+{
+	MandelbrotSolver solver;
+	int blockSize = solver.getBlockSize();
+	int tilesAcross = 4;
+	double pixelSize = TUNE_WIDTH / (blockSize * tilesAcross);
+
+	SolverKernel best = skINTRINSIC_32;
+	double bestTime = 0;
+	for (int i = 0; i < SOLVER_KERNELS; i++)
+	{
+		solver.setKernel((SolverKernel)i);
+		double startTime = wallTime();
+		for (int y = 0; y < tilesAcross; y++)
+			for (int x = 0; x < tilesAcross; x++)
+			{
+				auto block = solver.CreateBlock(TUNE_X - TUNE_WIDTH / 2 + x * blockSize * pixelSize, TUNE_Y - TUNE_WIDTH / 2 + y * blockSize * pixelSize, pixelSize);
+				solver.Solve(block);
+				solver.ReleaseBlock(block);
+			}
+		double elapsed = wallTime() - startTime;
+		TRACE(string("  kernel ") + MandelbrotSolver::getKernelName((SolverKernel)i) + ": " + floatToStr(elapsed * 1000) + "ms");
+		if (i == 0 || elapsed < bestTime) {
+			best = (SolverKernel)i;
+			bestTime = elapsed;
+		}
+	}
+	return best;
+}
+
+// Returns the number of queue workers with the best throughput.  More threads are only used if
+// they are worth at least a few percent, hyper threads often are not.
+int Autotuner::tuneThreads(SolverKernel kernel)
+{
+	PipelineBenchmark benchmark;
+	benchmark.kernel = kernel;
+	benchmark.repeats = 1;
+	PipelineWorkload workload = { "autotune", TUNE_X, TUNE_Y, TUNE_WIDTH, 5 };
+
+	int maxThreads = std::thread::hardware_concurrency();
+	if (maxThreads < 1) maxThreads = 4;
+
+	int best = 1;
+	double bestRate = 0;
+	for (int threads = 1; threads <= maxThreads; threads++)
+	{
+		double rate = benchmark.runWorkload(workload, threads).tilesPerSecond;
+		TRACE("  " + intToStr(threads) + " threads: " + floatToStr(rate) + " tiles/s");
+		if (rate > bestRate * 1.03) {
+			best = threads;
+			bestRate = rate;
+		}
+	}
+	return best;
+}
+
+// Width of the square around the origin that tile sizes are timed over.  Its sides lie on tile
+// edges from depth 2 down, so every size solves exactly the same area.
+static const double TILE_TUNE_WIDTH = 4.0;
+
+// Returns the tile size that solves the same area at the same resolution fastest through the
+// render queue.  Small tiles pay more per job overhead, large ones balance poorly across threads.
+int Autotuner::tuneTileSize(SolverKernel kernel, int threads)
+{
+	PipelineBenchmark benchmark;
+	benchmark.kernel = kernel;
+	benchmark.repeats = 1;
+
+	int best = 64;
+	double bestTime = 0;
+	for (int size = 32, depth = 6; size <= 512; size *= 2, depth--)
+	{
+		// one level up for each doubling keeps the pixel spacing the same.
+		PipelineWorkload workload = { "autotune", 0.0, 0.0, TILE_TUNE_WIDTH, depth };
+		benchmark.tileSize = size;
+		double elapsed = benchmark.runWorkload(workload, threads).seconds;
+		TRACE("  tile size " + intToStr(size) + ": " + floatToStr(elapsed * 1000) + "ms");
+		if (size == 32 || elapsed < bestTime) {
+			best = size;
+			bestTime = elapsed;
+		}
+	}
+	return best;
+}
+
+Config Autotuner::run()
+{
+	TRACE("Calibrating for this machine...");
+	Config config;
+	config.kernel = tuneKernel();
+	config.threads = tuneThreads(config.kernel);
+	config.tileSize = tuneTileSize(config.kernel, config.threads);
+	TRACE("Using " + config.toString());
+	return config;
+}
@@ -0,0 +1,41 @@
+#pragma once
+
+#include <string>
+#include "Mandel.h"
+
+using std::string;
+
+// Machine specific settings, chosen by the Autotuner on first start and kept in a
+// key=value file.  Any value can be overridden from the command line with --config key=value.
+struct Config
+{
+	SolverKernel kernel = skINTRINSIC_32;
+	int tileSize = 64;
+	int threads = 4;
+	// Start blocks part way with a series approximation.
+	bool series = true;
+	// Deepest zoom level and most tiles kept in memory for --server.
+	int serverMaxDepth = 24;
+	int serverTiles = 4096;
+
+	bool load(string filename);
+	bool save(string filename);
+
+	// Applies a single "key=value" setting.  Returns false if the key or value is not valid.
+	bool set(string assignment);
+
+	string toString();
+};
+
+// Picks the fastest kernel, worker count and tile size for this machine with a short run over
+// representative tiles.  Takes a second or two.
+class Autotuner
+{
+private:
+	SolverKernel tuneKernel();
+	int tuneThreads(SolverKernel kernel);
+	int tuneTileSize(SolverKernel kernel, int threads);
+
+public:
+	Config run();
+};
@@ -0,0 +1,195 @@
+//
+// Streams large fractal images to disk with a fixed memory budget.
+//
+// Date: 2016/07/20
+//
+
+#include "stdafx.h"
+#include "Exporter.h"
+#include "ColorMap.h"
+#include "AntiAlias.h"
+
+// Returns the first line of the progress file, used to make sure we only ever resume
+// an export with exactly the same settings.
+static string progressHeader(ExportSettings settings)
+{
+	char buffer[256];
+	sprintf_s(buffer, "cfractal export %d %d %.17g %.17g %.17g %d %d\n", settings.width, settings.height, settings.center.x, settings.center.y, settings.pixelSize, settings.antiAlias, settings.tileSize);
+	return buffer;
+}
+
+// Opens (or creates) the progress file, loading finished rows when resuming.
+bool Exporter::openProgress()
+{
+	string filename = settings.filename + ".progress";
+	string header = progressHeader(settings);
+
+	if (settings.resume)
+	{
+		fopen_s(&progressFile, filename.c_str(), "r+b");
+		if (progressFile)
+		{
+			char buffer[256] = {};
+			fgets(buffer, sizeof(buffer), progressFile);
+			if (header == buffer) {
+				for (size_t row = 0; row < rowsDone.size(); row++)
+					rowsDone[row] = fgetc(progressFile) == '1';
+			}
+			else {
+				TRACE("Export settings have changed, starting from the beginning.");
+				fclose(progressFile);
+				progressFile = NULL;
+			}
+		}
+	}
+
+	if (!progressFile)
+	{
+		fopen_s(&progressFile, filename.c_str(), "w+b");
+		if (!progressFile)
+			return false;
+		fputs(header.c_str(), progressFile);
+		for (size_t row = 0; row < rowsDone.size(); row++)
+			fputc('0', progressFile);
+		fflush(progressFile);
+	}
+	return true;
+}
+
+// Records that a tile row has been written to disk.
+void Exporter::markRowDone(int row)
+{
+	std::lock_guard<std::mutex> guard(progressLock);
+	rowsDone[row] = 1;
+	_fseeki64(progressFile, progressHeader(settings).size() + row, SEEK_SET);
+	fputc('1', progressFile);
+	fflush(progressFile);
+}
+
+// Renders a single row of tiles, chunk by chunk, and writes it out.
+void Exporter::renderRow(int row, uint8_t *buffer)
+{
+	int tileSize = solver.getBlockSize();
+	int rows = settings.height - row * tileSize < tileSize ? settings.height - row * tileSize : tileSize;
+
+	double left = settings.center.x - settings.width / 2.0 * settings.pixelSize;
+	double top = settings.center.y - settings.height / 2.0 * settings.pixelSize + row * tileSize * settings.pixelSize;
+
+	auto colors = new uint8_t[tileSize * tileSize * 3];
+	bool failed = false;
+
+	AdaptiveAntiAlias antiAlias;
+	antiAlias.samples = settings.antiAlias;
+
+	for (int chunkX = 0; chunkX < settings.width; chunkX += chunkWidth)
+	{
+		int width = settings.width - chunkX < chunkWidth ? settings.width - chunkX : chunkWidth;
+
+		for (int tileX = 0; tileX < width; tileX += tileSize)
+		{
+			int columns = width - tileX < tileSize ? width - tileX : tileSize;
+
+			auto block = solver.CreateBlock(left + (chunkX + tileX) * settings.pixelSize, top, settings.pixelSize);
+			solver.Solve(block);
+			mapColors(block.values_out, tileSize * tileSize, solver.getItterations(), colors);
+			// an export is a single level of tiles, so they are all at depth 0.
+			if (settings.antiAlias > 0)
+				antiAliased += antiAlias.apply(solver, block, settings.pixelSize, colors, (chunkX + tileX) / tileSize, row, 0);
+			solver.ReleaseBlock(block);
+
+			for (int y = 0; y < rows; y++)
+				memcpy(buffer + ((size_t)y * width + tileX) * 3, colors + y * tileSize * 3, columns * 3);
+		}
+
+		if (!writer->writeRect(chunkX, row * tileSize, width, rows, buffer))
+			failed = true;
+	}
+
+	delete[] colors;
+
+	// a failed row is left unmarked so that resuming will render it again.
+	if (failed) {
+		TRACE("Failed to write row " + intToStr(row) + " of " + settings.filename);
+		return;
+	}
+
+	writer->flush();
+	markRowDone(row);
+}
+
+// Renders the image described by settings.  Returns false if the output could not be written.
+bool Exporter::run(ExportSettings settings)
+{
+	this->settings = settings;
+
+	solver.setBlockSize(settings.tileSize);
+	int tileSize = solver.getBlockSize();
+	int tileRows = (settings.height + tileSize - 1) / tileSize;
+	int alignedWidth = (settings.width + tileSize - 1) / tileSize * tileSize;
+
+	// Work out how many workers we can afford, and how wide a chunk each one can render.
+	long long budget = (long long)settings.memoryBudget * 1024 * 1024;
+	long long blockBytes = (long long)tileSize * tileSize * (sizeof(double) * 2 + sizeof(int) + 3);
+	long long minimumWorkerBytes = blockBytes + (long long)tileSize * tileSize * 3;
+	int threads = settings.threads;
+	if (threads > budget / minimumWorkerBytes) threads = (int)(budget / minimumWorkerBytes);
+	if (threads < 1) threads = 1;
+
+	long long chunkBytes = budget / threads - blockBytes;
+	long long chunk = chunkBytes / (tileSize * 3) / tileSize * tileSize;
+	chunkWidth = (int)(chunk < tileSize ? tileSize : (chunk > alignedWidth ? alignedWidth : chunk));
+
+	writer = createImageWriter(settings.filename, tileSize);
+	if (!writer) {
+		TRACE("Unknown export format for " + settings.filename);
+		return false;
+	}
+
+	rowsDone = std::vector<uint8_t>(tileRows, 0);
+	if (!openProgress()) {
+		TRACE("Could not create progress file for " + settings.filename);
+		delete writer;
+		return false;
+	}
+
+	int remaining = 0;
+	for (int row = 0; row < tileRows; row++)
+		if (!rowsDone[row]) remaining++;
+
+	if (!writer->open(settings.filename, settings.width, settings.height, settings.resume && remaining < tileRows)) {
+		delete writer;
+		fclose(progressFile);
+		return false;
+	}
+
+	TRACE("Exporting " + intToStr(settings.width) + "x" + intToStr(settings.height) + " to " + settings.filename + " (" + intToStr(remaining) + " of " + intToStr(tileRows) + " rows remaining, " + intToStr(threads) + " threads, " + intToStr(chunkWidth) + " pixel chunks)");
+
+	double startTime = time();
+
+	parallelFor(tileRows, threads, [&](int row) {
+		if (rowsDone[row])
+			return;
+		std::vector<uint8_t> buffer((size_t)chunkWidth * tileSize * 3);
+		renderRow(row, buffer.data());
+	});
+
+	writer->close();
+	delete writer;
+	writer = NULL;
+
+	fclose(progressFile);
+	progressFile = NULL;
+
+	for (int row = 0; row < tileRows; row++)
+		if (!rowsDone[row]) {
+			TRACE("Export incomplete, run again with resume to finish it.");
+			return false;
+		}
+
+	remove((settings.filename + ".progress").c_str());
+
+	TRACE("Export finished in " + floatToStr(time() - startTime) + " seconds.");
+	if (settings.antiAlias > 0)
+		TRACE("Anti aliased " + floatToStr(100.0 * antiAliased / ((double)settings.width * settings.height)) + "% of pixels.");
+	return true;
+}
@@ -0,0 +1,68 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <mutex>
+#include <atomic>
+#include "helper.h"
+#include "Mandel.h"
+#include "ImageWriter.h"
+
+struct ExportSettings
+{
+	// Output file, format is chosen from the extension (.ppm, .tif or .raw).
+	string filename;
+
+	// Size of the image in pixels.
+	int width = 0;
+	int height = 0;
+
+	// Location of the center of the image in fractal space.
+	Vector2d center;
+
+	// Width of a single pixel in fractal space.
+	double pixelSize = 0;
+
+	int threads = 4;
+
+	// Upper limit in megabytes for the render buffers, independent of the image size.
+	int memoryBudget = 256;
+
+	// Carry on from a previous (interrupted) export to the same file.
+	bool resume = false;
+
+	// Sub samples for each pixel on an edge, 0 turns anti aliasing off.
+	int antiAlias = 0;
+
+	// Width and height of the blocks the image is solved in, and of a tile row.
+	int tileSize = 64;
+};
+
+// Renders images of any size straight to disk, one row of blocks at a time.
+// Each worker renders its tile row in column chunks sized to fit the memory budget, and
+// progress is recorded per tile row in <filename>.progress so an export can be resumed.
+class Exporter
+{
+private:
+	MandelbrotSolver solver;
+	ExportSettings settings;
+	ImageWriter *writer = NULL;
+
+	// One entry per tile row, true once the row is on disk.
+	std::vector<uint8_t> rowsDone;
+	FILE *progressFile = NULL;
+	std::mutex progressLock;
+
+	// Width in pixels of the chunks a tile row is rendered in.
+	int chunkWidth;
+
+	// Pixels that were supersampled.
+	std::atomic<long long> antiAliased{ 0 };
+
+	bool openProgress();
+	void markRowDone(int row);
+	void renderRow(int row, uint8_t *buffer);
+
+public:
+	bool run(ExportSettings settings);
+};
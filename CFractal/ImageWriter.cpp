@@ -0,0 +1,407 @@
+//
+// Streaming image output used by the exporter.
+//
+// Date: 2016/07/20
+//
+
+#include "stdafx.h"
+#include "ImageWriter.h"
+#include "helper.h"
+
+// Opens filename for random access writing, keeping the existing contents if resume is set.
+static FILE *openForWriting(string filename, bool resume)
+{
+	FILE *file = NULL;
+	if (resume)
+		fopen_s(&file, filename.c_str(), "r+b");
+	if (!file)
+		fopen_s(&file, filename.c_str(), "w+b");
+	return file;
+}
+
+///  ------------------------------------------------------------------
+///  PPMWriter
+///  ------------------------------------------------------------------
+
+bool PPMWriter::open(string filename, int width, int height, bool resume)
+{
+	this->width = width;
+	this->height = height;
+
+	file = openForWriting(filename, resume);
+	if (!file) {
+		TRACE("Could not open " + filename + " for writing.");
+		return false;
+	}
+
+	char header[64];
+	sprintf_s(header, "P6\n%d %d\n255\n", width, height);
+	headerSize = strlen(header);
+	fwrite(header, 1, (size_t)headerSize, file);
+	return true;
+}
+
+bool PPMWriter::writeRect(int x, int y, int w, int h, const uint8_t *rgb)
+{
+	std::lock_guard<std::mutex> guard(lock);
+	for (int row = 0; row < h; row++)
+	{
+		long long position = headerSize + ((long long)(y + row) * width + x) * 3;
+		if (_fseeki64(file, position, SEEK_SET) != 0)
+			return false;
+		if (fwrite(rgb + (size_t)row * w * 3, 3, w, file) != (size_t)w)
+			return false;
+	}
+	return true;
+}
+
+void PPMWriter::flush()
+{
+	std::lock_guard<std::mutex> guard(lock);
+	if (file)
+		fflush(file);
+}
+
+void PPMWriter::close()
+{
+	if (file)
+		fclose(file);
+	file = NULL;
+}
+
+///  ------------------------------------------------------------------
+///  RawWriter
+///  ------------------------------------------------------------------
+
+bool RawWriter::open(string filename, int width, int height, bool resume)
+{
+	this->width = width;
+	this->height = height;
+
+	file = CreateFileA(filename.c_str(), GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ, NULL, resume ? OPEN_ALWAYS : CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (file == INVALID_HANDLE_VALUE) {
+		TRACE("Could not open " + filename + " for writing.");
+		return false;
+	}
+
+	LARGE_INTEGER size;
+	size.QuadPart = (long long)width * height * 3;
+	mapping = CreateFileMappingA(file, NULL, PAGE_READWRITE, size.HighPart, size.LowPart, NULL);
+	if (!mapping) {
+		TRACE("Could not map " + filename + ".");
+		close();
+		return false;
+	}
+	return true;
+}
+
+bool RawWriter::writeRect(int x, int y, int w, int h, const uint8_t *rgb)
+{
+	// views must start on the allocation granularity (64k on all current versions of windows)
+	const long long granularity = 65536;
+
+	long long first = ((long long)y * width + x) * 3;
+	long long last = ((long long)(y + h - 1) * width + x + w) * 3;
+	long long viewStart = first - (first % granularity);
+
+	LARGE_INTEGER offset;
+	offset.QuadPart = viewStart;
+	auto view = (uint8_t*)MapViewOfFile(mapping, FILE_MAP_ALL_ACCESS, offset.HighPart, offset.LowPart, (size_t)(last - viewStart));
+	if (!view)
+		return false;
+
+	for (int row = 0; row < h; row++)
+	{
+		long long position = ((long long)(y + row) * width + x) * 3 - viewStart;
+		memcpy(view + position, rgb + (size_t)row * w * 3, (size_t)w * 3);
+	}
+
+	// unmapping hands the pages to the OS, flush() is what guarantees they are on disk.
+	FlushViewOfFile(view, 0);
+	UnmapViewOfFile(view);
+	return true;
+}
+
+void RawWriter::flush()
+{
+	// all views are flushed as they are released.
+}
+
+void RawWriter::close()
+{
+	if (mapping)
+		CloseHandle(mapping);
+	if (file != INVALID_HANDLE_VALUE)
+		CloseHandle(file);
+	mapping = NULL;
+	file = INVALID_HANDLE_VALUE;
+}
+
+///  ------------------------------------------------------------------
+///  TIFFWriter
+///  ------------------------------------------------------------------
+
+// TIFF field types.
+const int TIFF_SHORT = 3;
+const int TIFF_LONG = 4;
+const int TIFF_LONG8 = 16;
+
+// Appends a little endian integer of the given number of bytes.
+static void putInt(std::vector<uint8_t> &buffer, unsigned long long value, int bytes)
+{
+	for (int i = 0; i < bytes; i++)
+		buffer.push_back((uint8_t)(value >> (i * 8)));
+}
+
+// Builds the header, the single IFD and the tile offset / byte count tables.  Tile data
+// follows directly after and is laid out row by row, so the header never needs patching
+// and a resumed export rebuilds exactly the same bytes.
+std::vector<uint8_t> TIFFWriter::buildHeader(bool bigTiff)
+{
+	int tilesDown = (height + tileSize - 1) / tileSize;
+	int tileCount = tilesAcross * tilesDown;
+	long long tileBytes = (long long)tileSize * tileSize * 3;
+
+	int offsetSize = bigTiff ? 8 : 4;
+	int offsetType = bigTiff ? TIFF_LONG8 : TIFF_LONG;
+	const int entries = 11;
+	int headerSize = bigTiff ? 16 : 8;
+	int ifdSize = bigTiff ? 8 + entries * 20 + 8 : 2 + entries * 12 + 4;
+
+	// external data: bits per sample (classic only), tile offsets, tile byte counts.
+	long long bitsPosition = headerSize + ifdSize;
+	long long offsetsPosition = bitsPosition + (bigTiff ? 0 : 8);
+	long long countsPosition = offsetsPosition + (long long)tileCount * offsetSize;
+	dataStart = countsPosition + (long long)tileCount * offsetSize;
+
+	std::vector<uint8_t> buffer;
+	buffer.push_back('I');
+	buffer.push_back('I');
+	if (bigTiff) {
+		putInt(buffer, 43, 2);
+		putInt(buffer, 8, 2);
+		putInt(buffer, 0, 2);
+		putInt(buffer, headerSize, 8);
+	}
+	else {
+		putInt(buffer, 42, 2);
+		putInt(buffer, headerSize, 4);
+	}
+
+	putInt(buffer, entries, bigTiff ? 8 : 2);
+	auto entry = [&](int tag, int type, long long count, unsigned long long value) {
+		putInt(buffer, tag, 2);
+		putInt(buffer, type, 2);
+		putInt(buffer, count, bigTiff ? 8 : 4);
+		putInt(buffer, value, bigTiff ? 8 : 4);
+	};
+	// single tile images keep their one offset inline.
+	bool inlineTables = tileCount == 1;
+	entry(256, TIFF_LONG, 1, width);
+	entry(257, TIFF_LONG, 1, height);
+	entry(258, TIFF_SHORT, 3, bigTiff ? 0x000800080008ULL : bitsPosition);
+	entry(259, TIFF_SHORT, 1, 1);	// no compression
+	entry(262, TIFF_SHORT, 1, 2);	// RGB
+	entry(277, TIFF_SHORT, 1, 3);
+	entry(284, TIFF_SHORT, 1, 1);	// chunky
+	entry(322, TIFF_LONG, 1, tileSize);
+	entry(323, TIFF_LONG, 1, tileSize);
+	entry(324, offsetType, tileCount, inlineTables ? dataStart : offsetsPosition);
+	entry(325, offsetType, tileCount, inlineTables ? tileBytes : countsPosition);
+	putInt(buffer, 0, offsetSize);
+
+	if (!bigTiff) {
+		for (int i = 0; i < 3; i++)
+			putInt(buffer, 8, 2);
+		putInt(buffer, 0, 2);
+	}
+	for (int i = 0; i < tileCount; i++)
+		putInt(buffer, dataStart + i * tileBytes, offsetSize);
+	for (int i = 0; i < tileCount; i++)
+		putInt(buffer, tileBytes, offsetSize);
+
+	return buffer;
+}
+
+bool TIFFWriter::open(string filename, int width, int height, bool resume)
+{
+	this->width = width;
+	this->height = height;
+	tilesAcross = (width + tileSize - 1) / tileSize;
+
+	file = openForWriting(filename, resume);
+	if (!file) {
+		TRACE("Could not open " + filename + " for writing.");
+		return false;
+	}
+
+	// classic tiff offsets are 32 bit, leave some room for the tables.
+	long long tilesDown = (height + tileSize - 1) / tileSize;
+	long long estimatedSize = tilesAcross * tilesDown * ((long long)tileSize * tileSize * 3 + 8);
+	auto header = buildHeader(estimatedSize > 0xF0000000LL);
+	fwrite(header.data(), 1, header.size(), file);
+	return true;
+}
+
+// Rectangle must start on a tile boundary.  Parts of tiles outside the rectangle (or image)
+// are written as black.
+bool TIFFWriter::writeRect(int x, int y, int w, int h, const uint8_t *rgb)
+{
+	Assert(x % tileSize == 0 && y % tileSize == 0, "TIFF rectangles must be tile aligned.");
+
+	std::vector<uint8_t> tile(tileSize * tileSize * 3);
+	long long tileBytes = tile.size();
+
+	for (int tileY = 0; tileY * tileSize < h; tileY++)
+	{
+		for (int tileX = 0; tileX * tileSize < w; tileX++)
+		{
+			std::fill(tile.begin(), tile.end(), 0);
+			int columns = w - tileX * tileSize < tileSize ? w - tileX * tileSize : tileSize;
+			int rows = h - tileY * tileSize < tileSize ? h - tileY * tileSize : tileSize;
+			for (int row = 0; row < rows; row++)
+				memcpy(&tile[row * tileSize * 3], rgb + ((size_t)(tileY * tileSize + row) * w + tileX * tileSize) * 3, columns * 3);
+
+			long long index = (long long)(y / tileSize + tileY) * tilesAcross + x / tileSize + tileX;
+
+			std::lock_guard<std::mutex> guard(lock);
+			if (_fseeki64(file, dataStart + index * tileBytes, SEEK_SET) != 0)
+				return false;
+			if (fwrite(tile.data(), 1, tile.size(), file) != tile.size())
+				return false;
+		}
+	}
+	return true;
+}
+
+void TIFFWriter::flush()
+{
+	std::lock_guard<std::mutex> guard(lock);
+	if (file)
+		fflush(file);
+}
+
+void TIFFWriter::close()
+{
+	if (file)
+		fclose(file);
+	file = NULL;
+}
+
+///  ------------------------------------------------------------------
+///  Helpers
+///  ------------------------------------------------------------------
+
+ImageWriter *createImageWriter(string filename, int tileSize)
+{
+	auto dot = filename.find_last_of('.');
+	string extension = dot == string::npos ? "" : filename.substr(dot + 1);
+	for (auto &c : extension)
+		c = tolower(c);
+
+	if (extension == "ppm")
+		return new PPMWriter();
+	if (extension == "tif" || extension == "tiff")
+		return new TIFFWriter(tileSize);
+	if (extension == "raw")
+		return new RawWriter();
+	return NULL;
+}
+
+bool writePPM(string filename, int width, int height, const uint8_t *rgb)
+{
+	PPMWriter writer;
+	if (!writer.open(filename, width, height, false))
+		return false;
+	return writer.writeRect(0, 0, width, height, rgb);
+}
+
+// Appends a big endian 32 bit integer.
+static void putInt32BE(std::vector<uint8_t> &buffer, uint32_t value)
+{
+	for (int i = 3; i >= 0; i--)
+		buffer.push_back((uint8_t)(value >> (i * 8)));
+}
+
+static uint32_t crc32(const uint8_t *data, size_t length, uint32_t crc = 0)
+{
+	static uint32_t table[256];
+	static bool tableReady = false;
+	if (!tableReady) {
+		for (uint32_t n = 0; n < 256; n++) {
+			uint32_t c = n;
+			for (int k = 0; k < 8; k++)
+				c = (c & 1) ? 0xEDB88320 ^ (c >> 1) : c >> 1;
+			table[n] = c;
+		}
+		tableReady = true;
+	}
+	crc = ~crc;
+	for (size_t i = 0; i < length; i++)
+		crc = table[(crc ^ data[i]) & 0xff] ^ (crc >> 8);
+	return ~crc;
+}
+
+// Appends a PNG chunk with its length and checksum.
+static void putChunk(std::vector<uint8_t> &png, const char *type, const std::vector<uint8_t> &data)
+{
+	putInt32BE(png, (uint32_t)data.size());
+	size_t start = png.size();
+	png.insert(png.end(), type, type + 4);
+	png.insert(png.end(), data.begin(), data.end());
+	putInt32BE(png, crc32(&png[start], png.size() - start));
+}
+
+// Tiles are small and go over the loopback interface, so the image data is stored rather than
+// deflated.  This keeps encoding far cheaper than solving the tile.
+std::vector<uint8_t> encodePNG(int width, int height, const uint8_t *rgb)
+{
+	// scanlines, each prefixed with filter type 0.
+	std::vector<uint8_t> raw;
+	raw.reserve((size_t)(width * 3 + 1) * height);
+	for (int y = 0; y < height; y++)
+	{
+		raw.push_back(0);
+		raw.insert(raw.end(), rgb + (size_t)y * width * 3, rgb + (size_t)(y + 1) * width * 3);
+	}
+
+	// zlib stream made of stored deflate blocks.
+	std::vector<uint8_t> zlib;
+	zlib.push_back(0x78);
+	zlib.push_back(0x01);
+	size_t position = 0;
+	do
+	{
+		size_t length = raw.size() - position < 65535 ? raw.size() - position : 65535;
+		zlib.push_back(position + length == raw.size() ? 1 : 0);
+		zlib.push_back((uint8_t)length);
+		zlib.push_back((uint8_t)(length >> 8));
+		zlib.push_back((uint8_t)~length);
+		zlib.push_back((uint8_t)(~length >> 8));
+		zlib.insert(zlib.end(), raw.begin() + position, raw.begin() + position + length);
+		position += length;
+	} while (position < raw.size());
+
+	uint32_t a = 1, b = 0;
+	for (auto byte : raw) {
+		a = (a + byte) % 65521;
+		b = (b + a) % 65521;
+	}
+	putInt32BE(zlib, (b << 16) | a);
+
+	std::vector<uint8_t> png = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n' };
+
+	std::vector<uint8_t> header;
+	putInt32BE(header, width);
+	putInt32BE(header, height);
+	header.push_back(8);	// bit depth
+	header.push_back(2);	// RGB
+	header.push_back(0);
+	header.push_back(0);
+	header.push_back(0);
+
+	putChunk(png, "IHDR", header);
+	putChunk(png, "IDAT", zlib);
+	putChunk(png, "IEND", std::vector<uint8_t>());
+	return png;
+}
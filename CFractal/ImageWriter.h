@@ -0,0 +1,96 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <mutex>
+#include <stdint.h>
+
+using std::string;
+
+// Writes an RGB image to disk a rectangle at a time so that images far larger than
+// memory can be produced.  Rectangles may be written in any order and from any thread.
+class ImageWriter
+{
+public:
+	// Creates (or re-opens when resuming) the output file for an image of the given size.
+	// Existing pixel data is kept when resume is true.
+	virtual bool open(string filename, int width, int height, bool resume) = 0;
+
+	// Writes a w x h block of packed RGB pixels at (x, y).
+	virtual bool writeRect(int x, int y, int w, int h, const uint8_t *rgb) = 0;
+
+	// Makes sure everything written so far has reached the disk.
+	virtual void flush() = 0;
+
+	virtual void close() = 0;
+
+	// Required alignment of the rectangles passed to writeRect (1 = no restriction).
+	virtual int getAlignment() { return 1; }
+
+	virtual ~ImageWriter() {}
+};
+
+// Binary PPM (P6).  Has no size limit and is readable by almost everything.
+class PPMWriter : public ImageWriter
+{
+private:
+	FILE *file = NULL;
+	int width = 0;
+	int height = 0;
+	long long headerSize = 0;
+	std::mutex lock;
+public:
+	bool open(string filename, int width, int height, bool resume);
+	bool writeRect(int x, int y, int w, int h, const uint8_t *rgb);
+	void flush();
+	void close();
+	~PPMWriter() { close(); }
+};
+
+// Headerless RGB data written through a memory mapped file.  Each rectangle maps only the
+// rows it touches so the address space used stays small regardless of the image size.
+class RawWriter : public ImageWriter
+{
+private:
+	HANDLE file = INVALID_HANDLE_VALUE;
+	HANDLE mapping = NULL;
+	int width = 0;
+	int height = 0;
+public:
+	bool open(string filename, int width, int height, bool resume);
+	bool writeRect(int x, int y, int w, int h, const uint8_t *rgb);
+	void flush();
+	void close();
+	~RawWriter() { close(); }
+};
+
+// Uncompressed tiled TIFF.  Switches to BigTIFF once the image no longer fits within 4GB.
+class TIFFWriter : public ImageWriter
+{
+private:
+	FILE *file = NULL;
+	int width = 0;
+	int height = 0;
+	int tileSize = 0;
+	int tilesAcross = 0;
+	long long dataStart = 0;
+	std::mutex lock;
+	std::vector<uint8_t> buildHeader(bool bigTiff);
+public:
+	TIFFWriter(int tileSize) { this->tileSize = tileSize; }
+	bool open(string filename, int width, int height, bool resume);
+	bool writeRect(int x, int y, int w, int h, const uint8_t *rgb);
+	void flush();
+	void close();
+	int getAlignment() { return tileSize; }
+	~TIFFWriter() { close(); }
+};
+
+// Returns a writer suitable for the extension of filename (.ppm, .tif / .tiff, .raw), or NULL.
+ImageWriter *createImageWriter(string filename, int tileSize);
+
+// Writes a complete RGB image to a PPM file in one go.
+bool writePPM(string filename, int width, int height, const uint8_t *rgb);
+
+// Encodes an RGB image as an (uncompressed) PNG in memory.
+std::vector<uint8_t> encodePNG(int width, int height, const uint8_t *rgb);
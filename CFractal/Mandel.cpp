@@ -5,12 +5,15 @@
 #include "stdafx.h"
 #include "Mandel.h"
 #include "xmmintrin.h"
+#include <algorithm>
+#include <math.h>
 
 FractalBlock MandelbrotSolver::CreateBlock(double x, double y, double scale)
 	{
 		FractalBlock result;
 		result.width = block_size;
 		result.height = block_size;
+		result.itterations = itterations;
 		result.x_in = new double[block_size*block_size];
 		result.y_in = new double[block_size*block_size];
 		result.values_out = new int[block_size*block_size];
@@ -18,15 +21,172 @@ FractalBlock MandelbrotSolver::CreateBlock(double x, double y, double scale)
 		{
 			for (int ylp = 0; ylp < block_size; ylp++)
 			{
-				result.x_in[xlp + ylp * block_size] = x + (double)xlp * scale;
-				result.y_in[xlp + ylp * block_size] = y + (double)ylp * scale;
+				result.x_in[xlp + ylp * block_size] = x + (xlp + 0.5) * scale;
+				result.y_in[xlp + ylp * block_size] = y + (ylp + 0.5) * scale;
 			}
 		}
 		return result;
 	}
 
+void MandelbrotSolver::ReleaseBlock(FractalBlock block)
+	{
+		delete[] block.x_in;
+		delete[] block.y_in;
+		delete[] block.values_out;
+	}
+
+// Returns the pass of a progressive solve that point (x, y) of a block is solved in.
+static int progressivePass(int x, int y)
+{
+	if ((x & 3) == 0 && (y & 3) == 0)
+		return 0;
+	if ((x & 1) == 0 && (y & 1) == 0)
+		return 1;
+	return 2;
+}
+
+FractalBlock MandelbrotSolver::CreatePass(double x, double y, double scale, int pass)
+	{
+		// pass sizes are 1/16, 3/16 and 12/16 of the block, always a whole number of SIMD lanes.
+		int count = pass == 0 ? block_size * block_size / 16 : (pass == 1 ? block_size * block_size * 3 / 16 : block_size * block_size * 3 / 4);
+		FractalBlock result;
+		result.width = count;
+		result.height = 1;
+		result.itterations = itterations;
+		result.x_in = new double[count];
+		result.y_in = new double[count];
+		result.values_out = new int[count];
+		int index = 0;
+		for (int ylp = 0; ylp < block_size; ylp++)
+		{
+			for (int xlp = 0; xlp < block_size; xlp++)
+			{
+				if (progressivePass(xlp, ylp) != pass)
+					continue;
+				result.x_in[index] = x + (xlp + 0.5) * scale;
+				result.y_in[index] = y + (ylp + 0.5) * scale;
+				index++;
+			}
+		}
+		return result;
+	}
+
+void MandelbrotSolver::MergePass(FractalBlock block, int pass, int *values)
+	{
+		int index = 0;
+		for (int ylp = 0; ylp < block_size; ylp++)
+			for (int xlp = 0; xlp < block_size; xlp++)
+				if (progressivePass(xlp, ylp) == pass)
+					values[xlp + ylp * block_size] = block.values_out[index++];
+
+		// after pass 0 points are solved on a 4 point grid, after pass 1 on a 2 point grid.
+		if (pass >= PROGRESSIVE_PASSES - 1)
+			return;
+		int mask = pass == 0 ? ~3 : ~1;
+		for (int ylp = 0; ylp < block_size; ylp++)
+			for (int xlp = 0; xlp < block_size; xlp++)
+				if (progressivePass(xlp, ylp) > pass)
+					values[xlp + ylp * block_size] = values[(xlp & mask) + (ylp & mask) * block_size];
+	}
+
+TileStats MandelbrotSolver::GetStats(const int *values, int count, int limit)
+	{
+		TileStats stats;
+		int unescaped = 0;
+		stats.minItterations = count > 0 ? values[0] : 0;
+		for (int i = 0; i < count; i++)
+		{
+			int value = values[i];
+			if (value < stats.minItterations)
+				stats.minItterations = value;
+			if (value >= limit)
+				unescaped++;
+			else if (value > stats.maxItterations)
+				stats.maxItterations = value;
+		}
+		stats.unescaped = count > 0 ? (float)unescaped / count : 0;
+		stats.valid = true;
+		return stats;
+	}
+
+SeriesApproximation MandelbrotSolver::Approximate(FractalBlock block)
+	{
+		SeriesApproximation series;
+		int length = block.width * block.height;
+		if (length == 0)
+			return series;
+
+		// the reference orbit goes through the middle of the points' bounding box.
+		double left = block.x_in[0], right = left, top = block.y_in[0], bottom = top;
+		for (int i = 1; i < length; i++)
+		{
+			left = std::min(left, block.x_in[i]);
+			right = std::max(right, block.x_in[i]);
+			top = std::min(top, block.y_in[i]);
+			bottom = std::max(bottom, block.y_in[i]);
+		}
+		series.center = std::complex<double>((left + right) / 2, (top + bottom) / 2);
+		double radius = sqrt((right - left) * (right - left) + (bottom - top) * (bottom - top)) / 2;
+
+		// points are roughly this far apart, the error has to stay small next to the distance
+		// between their orbits.
+		double spacing = 2 * radius / sqrt((double)length);
+
+		// D is the first term the series leaves out, it measures the series' error.
+		std::complex<double> Z, A, B, C, D;
+		for (int n = 0; n < block.itterations; n++)
+		{
+			auto nextZ = Z * Z + series.center;
+			auto nextA = 2.0 * Z * A + 1.0;
+			auto nextB = 2.0 * Z * B + A * A;
+			auto nextC = 2.0 * (Z * C + A * B);
+			auto nextD = 2.0 * (Z * D + A * C) + B * B;
+
+			double r2 = radius * radius;
+			double error = abs(nextD) * r2 * r2;
+			if (error > seriesTolerance * abs(nextA) * spacing)
+				break;
+			// stop before any point could escape.
+			if (abs(nextZ) + abs(nextA) * radius + abs(nextB) * r2 + abs(nextC) * r2 * radius + error > threshold)
+				break;
+
+			Z = nextZ;
+			A = nextA;
+			B = nextB;
+			C = nextC;
+			D = nextD;
+			series.itterations = n + 1;
+		}
+
+		if (series.itterations > 0)
+		{
+			series.Z = Z;
+			series.A = A;
+			series.B = B;
+			series.C = C;
+		}
+		return series;
+	}
+
+void MandelbrotSolver::Solve(FractalBlock block)
+	{
+		SeriesApproximation series;
+		if (seriesApproximation)
+			series = Approximate(block);
+
+		switch (kernel) {
+		case skSIMPLE: simple_solve(block, series);
+			break;
+		case skUNROLLED_32_4: unrolled_solve_32<4>(block, series);
+			break;
+		case skUNROLLED_32_8: unrolled_solve_32<8>(block, series);
+			break;
+		default: intrinsic_solve_32(block, series);
+		}
+	}
+
 /// Simple mandelbrot solver, just written in c++
-void MandelbrotSolver::simple_solve(FractalBlock block)
+void MandelbrotSolver::simple_solve(FractalBlock block, const SeriesApproximation &series)
 	{
 		int length = block.width * block.height;
 
@@ -43,7 +203,14 @@ void MandelbrotSolver::simple_solve(FractalBlock block)
 			double zi = 0;
 
 			int it = 0;
-			for (int j = 0; j < itterations; j++)
+			if (series.itterations > 0)
+			{
+				auto start = series.start(c, ci);
+				z = start.real();
+				zi = start.imag();
+				it = series.itterations;
+			}
+			for (int j = it; j < block.itterations; j++)
 			{
 				it ++;
 				// z = z*z + c
@@ -63,8 +230,19 @@ void MandelbrotSolver::simple_solve(FractalBlock block)
 		}
 	}
 
+// Sets z and zi to where the series puts points index..index + 3 of block, in the lane order
+// the intrinsic kernels use.
+static void seriesStart(const SeriesApproximation &series, FractalBlock block, int index, __m128 &z, __m128 &zi)
+{
+	std::complex<double> start[4];
+	for (int k = 0; k < 4; k++)
+		start[k] = series.start(block.x_in[index + k], block.y_in[index + k]);
+	z = _mm_set_ps((float)start[0].real(), (float)start[1].real(), (float)start[2].real(), (float)start[3].real());
+	zi = _mm_set_ps((float)start[0].imag(), (float)start[1].imag(), (float)start[2].imag(), (float)start[3].imag());
+}
+
 /// SIMD solver, uses SSE.
-void MandelbrotSolver::intrinsic_solve_32(FractalBlock block)
+void MandelbrotSolver::intrinsic_solve_32(FractalBlock block, const SeriesApproximation &series)
 {	
 
 	int length = block.width * block.height;
@@ -91,7 +269,14 @@ void MandelbrotSolver::intrinsic_solve_32(FractalBlock block)
 
 		__m128 limit = _mm_set_ps(thresholdSquared, thresholdSquared, thresholdSquared, thresholdSquared);
 
-		for (int j = 0; j < 1000; j++)
+		// start from where the series puts each point, in double until then.
+		if (series.itterations > 0)
+		{
+			seriesStart(series, block, index, z, zi);
+			counter = _mm_set1_ps((float)series.itterations);
+		}
+
+		for (int j = series.itterations; j < block.itterations; j++)
 		{			
 			__m128 _z2 = _mm_mul_ps(z, z);
 			__m128 _zi2 = _mm_mul_ps(zi, zi);
@@ -118,6 +303,99 @@ void MandelbrotSolver::intrinsic_solve_32(FractalBlock block)
 	}
 }
 
+/// SIMD solver that only tests for escapes every N itterations.  Every step does the same
+/// arithmetic as intrinsic_solve_32, the state before each run of N steps is kept and if a lane
+/// went past the threshold during them they are taken again one at a time from there.  The
+/// counts are exactly those of intrinsic_solve_32.
+template<int N>
+void MandelbrotSolver::unrolled_solve_32(FractalBlock block, const SeriesApproximation &series)
+{
+	int length = block.width * block.height;
+
+	float thresholdSquared = threshold * threshold;
+	__m128 limit = _mm_set1_ps(thresholdSquared);
+	__m128 one = _mm_set1_ps(1.0f);
+	__m128 steps = _mm_set1_ps((float)N);
+
+	// like intrinsic_solve_32, only whole groups of 4 points are solved.
+	for (int index = 0; index < length / 4 * 4; index += 4)
+	{
+		__m128 c = _mm_set_ps(block.x_in[index], block.x_in[index + 1], block.x_in[index + 2], block.x_in[index + 3]);
+		__m128 ci = _mm_set_ps(block.y_in[index], block.y_in[index + 1], block.y_in[index + 2], block.y_in[index + 3]);
+
+		__m128 z = _mm_setzero_ps();
+		__m128 zi = _mm_setzero_ps();
+		__m128 counter = _mm_setzero_ps();
+		// all bits set in lanes that have not escaped yet.
+		__m128 active = _mm_cmpeq_ps(z, z);
+
+		int j = series.itterations;
+		if (j > 0)
+		{
+			seriesStart(series, block, index, z, zi);
+			counter = _mm_set1_ps((float)j);
+		}
+
+		while (j < block.itterations)
+		{
+			if (j + N <= block.itterations)
+			{
+				__m128 checkpointZ = z;
+				__m128 checkpointZi = zi;
+
+				// escaped collects lanes that are past the threshold (or NaN) at any step.
+				__m128 escaped = _mm_setzero_ps();
+				for (int k = 0; k < N; k++)
+				{
+					__m128 _z2 = _mm_mul_ps(z, z);
+					__m128 _zi2 = _mm_mul_ps(zi, zi);
+					__m128 _z = _mm_sub_ps(_z2, _zi2);
+					__m128 _zi = _mm_mul_ps(z, zi);
+					_zi = _mm_add_ps(_zi, _zi);
+					z = _mm_add_ps(_z, c);
+					zi = _mm_add_ps(_zi, ci);
+					escaped = _mm_or_ps(escaped, _mm_cmpnle_ps(_mm_add_ps(_z2, _zi2), limit));
+				}
+
+				if (_mm_movemask_ps(_mm_and_ps(escaped, active)) == 0)
+				{
+					counter = _mm_add_ps(counter, _mm_and_ps(active, steps));
+					j += N;
+					continue;
+				}
+
+				// a lane escaped somewhere in there, go back and find where.
+				z = checkpointZ;
+				zi = checkpointZi;
+			}
+
+			int end = std::min(j + N, block.itterations);
+			for (; j < end; j++)
+			{
+				__m128 _z2 = _mm_mul_ps(z, z);
+				__m128 _zi2 = _mm_mul_ps(zi, zi);
+				__m128 _z = _mm_sub_ps(_z2, _zi2);
+				__m128 _zi = _mm_mul_ps(z, zi);
+				_zi = _mm_add_ps(_zi, _zi);
+				z = _mm_add_ps(_z, c);
+				zi = _mm_add_ps(_zi, ci);
+
+				__m128 mask = _mm_cmple_ps(_mm_add_ps(_z2, _zi2), limit);
+				active = _mm_and_ps(active, mask);
+				counter = _mm_add_ps(counter, _mm_and_ps(active, one));
+			}
+
+			if (_mm_movemask_ps(active) == 0)
+				break;
+		}
+
+		float counts[4];
+		_mm_storeu_ps(counts, counter);
+		for (int k = 0; k < 4; k++)
+			block.values_out[index + k] = (int)counts[3 - k];
+	}
+}
+
 void MandelbrotSolver::SSE_solve(FractalBlock block)
 {
 	int length = block.width * block.height;
@@ -1,14 +1,67 @@
 #pragma once
 
+#include <complex>
+
+// Fractal formulas a solver can produce.
+enum FractalFormula {
+	ffMANDELBROT
+};
+
+// Implementations of the inner loop a solver can use.
+enum SolverKernel {
+	// Plain c++, one point at a time in double precision.
+	skSIMPLE,
+	// SSE intrinsics, four points at a time in single precision.
+	skINTRINSIC_32,
+	// As skINTRINSIC_32 with the same results, but only testing for escapes every 4 or 8
+	// itterations.
+	skUNROLLED_32_4,
+	skUNROLLED_32_8
+};
+
+// Number of SolverKernel values.
+const int SOLVER_KERNELS = 4;
+
 /** Defines a block of fractal points to calculate */
 struct FractalBlock {
 	int width;
 	int height;
+	// Maximum number of itterations a point may take.  CreateBlock sets the solver's limit, it
+	// can be lowered per block (e.g. for quick previews).
+	int itterations;
 	double *x_in;
 	double *y_in;
 	int *values_out;	
 };
 
+// Summary of a solved block's itteration counts.
+struct TileStats {
+	// Lowest count, and highest count of a point that escaped (0 if none did).
+	int minItterations = 0;
+	int maxItterations = 0;
+	// Fraction of points that reached the limit without escaping.
+	float unescaped = 0;
+	// False until the stats have been measured.
+	bool valid = false;
+};
+
+// Orbits of a block's points approximated from one reference orbit through the middle of the
+// block, so the kernels can start every point part way through.  After n itterations a point d
+// away from the center is at Z + A d + B d^2 + C d^3.
+struct SeriesApproximation {
+	// Itterations the series is accurate for, 0 if it is not used.
+	int itterations = 0;
+	std::complex<double> center;
+	std::complex<double> Z, A, B, C;
+
+	// Where the orbit of point (x, y) is after itterations steps.
+	std::complex<double> start(double x, double y) const
+	{
+		auto d = std::complex<double>(x, y) - center;
+		return Z + d * (A + d * (B + d * C));
+	}
+};
+
 /// A block within the fractal that has 4 children blocks (that may or may not be rendered). 
 ///
 class QuadBlock {
@@ -16,6 +69,10 @@ public:
 	QuadBlock *children[2][2];
 };
 
+// Number of interlaced passes a progressive solve takes.  Pass 0 solves every 4th point in each
+// direction (1/16 of the block), pass 1 every 2nd (3/16) and pass 2 the rest.
+const int PROGRESSIVE_PASSES = 3;
+
 /// Produces solutions to the mandelbrot set 
 ///
 class MandelbrotSolver {
@@ -25,16 +82,83 @@ private:
 	int block_size = 64;
 	float threshold = 2.0f;
 	int itterations = 2048;
+	SolverKernel kernel = skINTRINSIC_32;
+
+	// Skip the first itterations of each block with a series approximation.
+	bool seriesApproximation = true;
+	// Largest error allowed in the series, as a fraction of the distance between neighbouring
+	// points' orbits.
+	double seriesTolerance = 1e-6;
 	
 	/// Simple mandelbrot solver, just written in c++
-	void simple_solve(FractalBlock block);	
-	void intrinsic_solve_32(FractalBlock block);	
+	void simple_solve(FractalBlock block, const SeriesApproximation &series);	
+	void intrinsic_solve_32(FractalBlock block, const SeriesApproximation &series);	
+	template<int N> void unrolled_solve_32(FractalBlock block, const SeriesApproximation &series);
 	void SSE_solve(FractalBlock block);
 
 public:
-	// Creates a fractal block with locations to be rendered. 
+	// Creates a fractal block with locations to be rendered.  (x, y) is the top left corner of
+	// the block and points are sampled at pixel centres, so a block mirrored across the real
+	// axis samples exactly the mirrored points.
 	FractalBlock CreateBlock(double x, double y, double scale);
 
-	void Solve(FractalBlock block) { intrinsic_solve_32(block); }
+	// Frees the memory allocated by CreateBlock.
+	void ReleaseBlock(FractalBlock block);
+
+	// Creates a block with only the points of one pass of a progressive solve of the block
+	// CreateBlock(x, y, scale) would make.  Points are in row order.
+	FractalBlock CreatePass(double x, double y, double scale, int pass);
+
+	// Writes the results of a pass into values (a full block), and fills the points no pass has
+	// reached yet from the solved point above and to the left of them.
+	void MergePass(FractalBlock block, int pass, int *values);
+
+	// Measures count values solved with the given itteration limit.
+	static TileStats GetStats(const int *values, int count, int limit);
+
+	// Width and height of the blocks produced by CreateBlock.
+	int getBlockSize() { return block_size; }
+	void setBlockSize(int size) { block_size = size; }
+
+	// Maximum number of itterations a point may take.
+	int getItterations() { return itterations; }
+
+	FractalFormula getFormula() { return ffMANDELBROT; }
+
+	// True if the formula gives the same result for a point and its complex conjugate, so the
+	// half of the plane below the real axis is a mirror image of the half above it.
+	bool isConjugateSymmetric() { return getFormula() == ffMANDELBROT; }
+
+	// Fits a series to the block's orbits and finds how many itterations it holds for.  Every
+	// point must stay within the threshold for all of them, so none escapes in the part skipped.
+	SeriesApproximation Approximate(FractalBlock block);
+
+	void setSeriesApproximation(bool enabled) { seriesApproximation = enabled; }
+	bool getSeriesApproximation() { return seriesApproximation; }
+
+	void setKernel(SolverKernel kernel) { this->kernel = kernel; }
+	SolverKernel getKernel() { return kernel; }
+
+	// Number of points the kernel works on at once.
+	static int getKernelLanes(SolverKernel kernel) { return kernel == skSIMPLE ? 1 : 4; }
+	static const char *getKernelName(SolverKernel kernel)
+	{
+		switch (kernel) {
+		case skSIMPLE: return "simple";
+		case skUNROLLED_32_4: return "unrolled_32_4";
+		case skUNROLLED_32_8: return "unrolled_32_8";
+		default: return "intrinsic_32";
+		}
+	}
+
+	// Identifies the settings that change the counts Solve gives, for telling apart results
+	// solved differently.  Kernels that give the same counts share a value.
+	int getResultSettings()
+	{
+		int precision = kernel == skSIMPLE ? 64 : 32;
+		return precision | (seriesApproximation ? 0x100 : 0);
+	}
+
+	void Solve(FractalBlock block);
 
 };
\ No newline at end of file
@@ -0,0 +1,160 @@
+//
+// Runtime metrics for the render pipeline.
+//
+// Date: 2016/08/02
+//
+
+#include "stdafx.h"
+#include "Metrics.h"
+#include "helper.h"
+#include <chrono>
+
+Metrics metrics;
+
+///  ------------------------------------------------------------------
+///  Histogram
+///  ------------------------------------------------------------------
+
+Histogram::Histogram()
+{
+	for (int i = 0; i < BUCKETS; i++)
+		buckets[i] = 0;
+}
+
+void Histogram::record(long long value)
+{
+	int bucket = 0;
+	while (bucket < BUCKETS - 1 && (1LL << bucket) <= value)
+		bucket++;
+	buckets[bucket].fetch_add(1, std::memory_order_relaxed);
+}
+
+long long Histogram::count()
+{
+	long long total = 0;
+	for (int i = 0; i < BUCKETS; i++)
+		total += buckets[i];
+	return total;
+}
+
+long long Histogram::percentile(double fraction)
+{
+	long long total = count();
+	if (total == 0)
+		return 0;
+
+	long long running = 0;
+	for (int i = 0; i < BUCKETS; i++)
+	{
+		running += buckets[i];
+		if (running >= total * fraction)
+			return 1LL << i;
+	}
+	return 1LL << (BUCKETS - 1);
+}
+
+///  ------------------------------------------------------------------
+///  MetricsSnapshot
+///  ------------------------------------------------------------------
+
+string MetricsSnapshot::toJSON()
+{
+	char buffer[1024];
+	sprintf_s(buffer, "{\"time\": %.3f, \"tilesSolved\": %lld, \"iterations\": %lld, \"cacheHits\": %lld, \"cacheMisses\": %lld, "
+		"\"prefetchQueued\": %lld, \"prefetchCancelled\": %lld, \"tilesMirrored\": %lld, \"queueDepth\": %lld, \"inFlight\": %lld, \"uploadBacklog\": %lld, \"residentTiles\": %lld, \"residentBytes\": %lld, "
+		"\"tilesPerSecond\": %.1f, \"iterationsPerSecond\": %.1f, \"solveTimeMs\": {\"p50\": %.3f, \"p99\": %.3f}, \"queueWaitMs\": {\"p50\": %.3f, \"p99\": %.3f}}",
+		time, tilesSolved, itterations, cacheHits, cacheMisses, prefetchQueued, prefetchCancelled, tilesMirrored,
+		queueDepth, inFlight, uploadBacklog, residentTiles, residentBytes,
+		tilesPerSecond, itterationsPerSecond, solveTime50, solveTime99, queueWait50, queueWait99);
+	return buffer;
+}
+
+string MetricsSnapshot::toString()
+{
+	char buffer[1024];
+	sprintf_s(buffer, "tiles/s %.0f   Mitterations/s %.1f\n"
+		"queued %lld   in flight %lld   upload backlog %lld\n"
+		"resident %lld tiles, %.1f MB\n"
+		"solve p50 %.2fms p99 %.2fms   wait p50 %.2fms p99 %.2fms\n"
+		"cache hits %lld misses %lld   prefetched %lld cancelled %lld   mirrored %lld",
+		tilesPerSecond, itterationsPerSecond / 1e6,
+		queueDepth, inFlight, uploadBacklog,
+		residentTiles, residentBytes / (1024.0 * 1024.0),
+		solveTime50, solveTime99, queueWait50, queueWait99,
+		cacheHits, cacheMisses, prefetchQueued, prefetchCancelled, tilesMirrored);
+	return buffer;
+}
+
+///  ------------------------------------------------------------------
+///  Metrics
+///  ------------------------------------------------------------------
+
+MetricsSnapshot Metrics::snapshot(const MetricsSnapshot *previous)
+{
+	MetricsSnapshot result;
+	result.time = wallTime();
+	result.tilesSolved = tilesSolved;
+	result.itterations = itterations;
+	result.cacheHits = cacheHits;
+	result.cacheMisses = cacheMisses;
+	result.prefetchQueued = prefetchQueued;
+	result.prefetchCancelled = prefetchCancelled;
+	result.tilesMirrored = tilesMirrored;
+	result.queueDepth = queueDepth;
+	result.inFlight = inFlight;
+	result.uploadBacklog = uploadBacklog;
+	result.residentTiles = residentTiles;
+	result.residentBytes = residentBytes;
+	result.solveTime50 = solveTime.percentile(0.5) / 1000.0;
+	result.solveTime99 = solveTime.percentile(0.99) / 1000.0;
+	result.queueWait50 = queueWait.percentile(0.5) / 1000.0;
+	result.queueWait99 = queueWait.percentile(0.99) / 1000.0;
+
+	if (previous && previous->time > 0 && result.time > previous->time) {
+		double elapsed = result.time - previous->time;
+		result.tilesPerSecond = (result.tilesSolved - previous->tilesSolved) / elapsed;
+		result.itterationsPerSecond = (result.itterations - previous->itterations) / elapsed;
+	}
+	return result;
+}
+
+bool Metrics::startDump(string filename, double interval)
+{
+	stopDump();
+	if (fopen_s(&dumpFile, filename.c_str(), "a") != 0) {
+		TRACE("Could not write metrics to " + filename);
+		dumpFile = NULL;
+		return false;
+	}
+	dumping = true;
+	dumpThread = std::thread(&Metrics::dumpLoop, this, interval);
+	return true;
+}
+
+void Metrics::stopDump()
+{
+	if (!dumpFile)
+		return;
+	{
+		std::lock_guard<std::mutex> guard(dumpLock);
+		dumping = false;
+	}
+	dumpWake.notify_all();
+	dumpThread.join();
+	fclose(dumpFile);
+	dumpFile = NULL;
+}
+
+void Metrics::dumpLoop(double interval)
+{
+	std::unique_lock<std::mutex> guard(dumpLock);
+	MetricsSnapshot previous = snapshot();
+	while (dumping)
+	{
+		dumpWake.wait_for(guard, std::chrono::milliseconds((long long)(interval * 1000)));
+		auto current = snapshot(&previous);
+		fprintf(dumpFile, "%s\n", current.toJSON().c_str());
+		fflush(dumpFile);
+		previous = current;
+	}
+}
@@ -0,0 +1,111 @@
+#pragma once
+
+#include <string>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+using std::string;
+
+// Counts of values in power of two buckets, bucket i holds values below 2^i.
+// Recording is a single atomic increment.
+class Histogram
+{
+private:
+	static const int BUCKETS = 40;
+	std::atomic<long long> buckets[BUCKETS];
+
+public:
+	Histogram();
+
+	void record(long long value);
+
+	// Returns the upper bound of the bucket containing the given fraction of the values.
+	long long percentile(double fraction);
+	long long count();
+};
+
+// Point in time copy of the metrics.  Rates are measured since the snapshot it was taken against.
+struct MetricsSnapshot
+{
+	double time = 0;
+
+	long long tilesSolved = 0;
+	long long itterations = 0;
+	long long cacheHits = 0;
+	long long cacheMisses = 0;
+	long long prefetchQueued = 0;
+	long long prefetchCancelled = 0;
+	long long tilesMirrored = 0;
+
+	long long queueDepth = 0;
+	long long inFlight = 0;
+	long long uploadBacklog = 0;
+	long long residentTiles = 0;
+	long long residentBytes = 0;
+
+	double tilesPerSecond = 0;
+	double itterationsPerSecond = 0;
+
+	// In milliseconds.
+	double solveTime50 = 0;
+	double solveTime99 = 0;
+	double queueWait50 = 0;
+	double queueWait99 = 0;
+
+	string toJSON();
+
+	// Short multi line summary for the on screen overlay.
+	string toString();
+};
+
+// Process wide counters for the render pipeline.  Updating a metric is a single atomic
+// operation so they can be kept up to date on the hot paths; reading them is done through
+// snapshot().
+class Metrics
+{
+private:
+	FILE *dumpFile = NULL;
+	std::thread dumpThread;
+	std::mutex dumpLock;
+	std::condition_variable dumpWake;
+	bool dumping = false;
+
+	void dumpLoop(double interval);
+
+public:
+	// Totals.
+	std::atomic<long long> tilesSolved{ 0 };
+	std::atomic<long long> itterations{ 0 };
+	std::atomic<long long> cacheHits{ 0 };
+	std::atomic<long long> cacheMisses{ 0 };
+	// Speculative jobs added by RenderGrid's prefetch, and those taken back out before being solved.
+	std::atomic<long long> prefetchQueued{ 0 };
+	std::atomic<long long> prefetchCancelled{ 0 };
+	// Tiles copied from their mirror image across the real axis instead of being solved.
+	std::atomic<long long> tilesMirrored{ 0 };
+
+	// Current levels.
+	std::atomic<long long> queueDepth{ 0 };
+	std::atomic<long long> inFlight{ 0 };
+	std::atomic<long long> uploadBacklog{ 0 };
+	std::atomic<long long> residentTiles{ 0 };
+	std::atomic<long long> residentBytes{ 0 };
+
+	// In microseconds.
+	Histogram solveTime;
+	Histogram queueWait;
+
+	// Returns the metrics as they are now, with rates measured since previous.  Each reader keeps
+	// its own previous snapshot so they do not shorten each other's measuring window.
+	MetricsSnapshot snapshot(const MetricsSnapshot *previous = NULL);
+
+	// Appends a snapshot to filename as a line of JSON every interval seconds.
+	bool startDump(string filename, double interval);
+	void stopDump();
+
+	~Metrics() { stopDump(); }
+};
+
+extern Metrics metrics;
@@ -0,0 +1,186 @@
+//
+// Compact storage for solved tiles.
+//
+// Date: 2016/07/26
+//
+
+#include "stdafx.h"
+#include "PackedTile.h"
+#include "Metrics.h"
+#include <emmintrin.h>
+
+// Longest run a single (value, length) pair can describe.
+const int MAX_RUN = 0xffff;
+
+void PackedTile::pack(const int *values, int count)
+{
+	clear();
+	this->count = count;
+	metrics.residentTiles++;
+
+	// work out how large each encoding would be.
+	int maxValue = 0;
+	int runs = 0;
+	size_t deltaSize = 2;
+	for (int i = 0; i < count; i++)
+	{
+		if (values[i] > maxValue) maxValue = values[i];
+		if (i == 0 || values[i] != values[i - 1] || (i % MAX_RUN) == 0) runs++;
+		if (i > 0) {
+			int delta = values[i] - values[i - 1];
+			deltaSize += (delta >= -127 && delta <= 127) ? 1 : 3;
+		}
+	}
+
+	if (maxValue > 0xffff) {
+		encoding = teRAW32;
+		data.resize(count * sizeof(int));
+		memcpy(data.data(), values, data.size());
+		metrics.residentBytes += data.capacity();
+		return;
+	}
+
+	size_t runsSize = runs * 4;
+	size_t rawSize = count * 2;
+
+	if (runsSize <= deltaSize && runsSize <= rawSize)
+		packRuns(values, count);
+	else if (deltaSize < rawSize)
+		packDelta(values, count);
+	else {
+		encoding = teRAW16;
+		data.resize(rawSize);
+		auto output = (uint16_t*)data.data();
+		for (int i = 0; i < count; i++)
+			output[i] = (uint16_t)values[i];
+	}
+
+	data.shrink_to_fit();
+	metrics.residentBytes += data.capacity();
+}
+
+void PackedTile::packRuns(const int *values, int count)
+{
+	encoding = teRUNS;
+	int i = 0;
+	while (i < count)
+	{
+		int run = 1;
+		while (i + run < count && run < MAX_RUN && values[i + run] == values[i])
+			run++;
+		uint16_t pair[2] = { (uint16_t)values[i], (uint16_t)run };
+		data.insert(data.end(), (uint8_t*)pair, (uint8_t*)(pair + 2));
+		i += run;
+	}
+}
+
+void PackedTile::packDelta(const int *values, int count)
+{
+	encoding = teDELTA;
+	data.push_back((uint8_t)values[0]);
+	data.push_back((uint8_t)(values[0] >> 8));
+	for (int i = 1; i < count; i++)
+	{
+		int delta = values[i] - values[i - 1];
+		if (delta >= -127 && delta <= 127)
+			data.push_back((uint8_t)(int8_t)delta);
+		else {
+			data.push_back(0x80);
+			data.push_back((uint8_t)values[i]);
+			data.push_back((uint8_t)(values[i] >> 8));
+		}
+	}
+}
+
+// Runs are filled four values at a time.
+void PackedTile::unpackRuns(int *values)
+{
+	auto pairs = (const uint16_t*)data.data();
+	size_t pairCount = data.size() / 4;
+	int *output = values;
+	for (size_t i = 0; i < pairCount; i++)
+	{
+		int value = pairs[i * 2];
+		int run = pairs[i * 2 + 1];
+		__m128i fill = _mm_set1_epi32(value);
+		int j = 0;
+		for (; j + 4 <= run; j += 4)
+			_mm_storeu_si128((__m128i*)(output + j), fill);
+		for (; j < run; j++)
+			output[j] = value;
+		output += run;
+	}
+}
+
+void PackedTile::unpackDelta(int *values)
+{
+	const uint8_t *input = data.data();
+	int value = input[0] | (input[1] << 8);
+	values[0] = value;
+	input += 2;
+	for (int i = 1; i < count; i++)
+	{
+		int8_t delta = (int8_t)*input++;
+		if (delta == -128) {
+			value = input[0] | (input[1] << 8);
+			input += 2;
+		}
+		else
+			value += delta;
+		values[i] = value;
+	}
+}
+
+// Widens eight 16 bit values at a time.
+void PackedTile::unpackRaw16(int *values)
+{
+	auto input = (const uint16_t*)data.data();
+	__m128i zero = _mm_setzero_si128();
+	int i = 0;
+	for (; i + 8 <= count; i += 8)
+	{
+		__m128i packed = _mm_loadu_si128((const __m128i*)(input + i));
+		_mm_storeu_si128((__m128i*)(values + i), _mm_unpacklo_epi16(packed, zero));
+		_mm_storeu_si128((__m128i*)(values + i + 4), _mm_unpackhi_epi16(packed, zero));
+	}
+	for (; i < count; i++)
+		values[i] = input[i];
+}
+
+void PackedTile::unpack(int *values)
+{
+	switch (encoding) {
+	case teRUNS: unpackRuns(values);
+		break;
+	case teDELTA: unpackDelta(values);
+		break;
+	case teRAW16: unpackRaw16(values);
+		break;
+	case teRAW32: memcpy(values, data.data(), count * sizeof(int));
+		break;
+	default: memset(values, 0, count * sizeof(int));
+	}
+}
+
+bool PackedTile::isUniform()
+{
+	if (encoding != teRUNS)
+		return false;
+	auto pairs = (const uint16_t*)data.data();
+	for (size_t i = 1; i < data.size() / 4; i++)
+		if (pairs[i * 2] != pairs[0])
+			return false;
+	return true;
+}
+
+void PackedTile::clear()
+{
+	if (encoding != teEMPTY) {
+		metrics.residentTiles--;
+		metrics.residentBytes -= data.capacity();
+	}
+	encoding = teEMPTY;
+	count = 0;
+	data.clear();
+	data.shrink_to_fit();
+}
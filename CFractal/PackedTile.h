@@ -0,0 +1,54 @@
+#pragma once
+
+#include <vector>
+#include <stdint.h>
+
+// Ways a tile's itteration counts can be stored.
+enum TileEncoding {
+	// No data.
+	teEMPTY,
+	// (value, length) pairs of 16 bit integers.  Best for flat regions inside and outside the set.
+	teRUNS,
+	// First value followed by signed 8 bit differences, 0x80 escapes a full 16 bit value.
+	teDELTA,
+	// Plain 16 bit counts, used when the itteration limit allows.
+	teRAW16,
+	// Plain 32 bit counts.
+	teRAW32
+};
+
+// Itteration counts for a tile held in whichever encoding is smallest.  Tiles are packed once
+// when they are solved and unpacked whenever they are colored or resampled.
+class PackedTile
+{
+private:
+	std::vector<uint8_t> data;
+
+	void packRuns(const int *values, int count);
+	void packDelta(const int *values, int count);
+	void unpackRuns(int *values);
+	void unpackDelta(int *values);
+	void unpackRaw16(int *values);
+
+public:
+	TileEncoding encoding = teEMPTY;
+
+	// Number of values in the tile.
+	int count = 0;
+
+	// Stores count values, choosing the most compact encoding for them.
+	void pack(const int *values, int count);
+
+	// Writes all count values to values.
+	void unpack(int *values);
+
+	// True if every value in the tile is the same.
+	bool isUniform();
+
+	void clear();
+
+	// Bytes of memory used by this tile's data.
+	size_t memoryUsed() { return sizeof(PackedTile) + data.capacity(); }
+
+	~PackedTile() { clear(); }
+};
@@ -0,0 +1,154 @@
+//
+// Thread scaling benchmark for the render queue.
+//
+// Date: 2016/07/30
+//
+
+#include "stdafx.h"
+#include "PipelineBenchmark.h"
+#include <algorithm>
+#include <math.h>
+
+static const PipelineWorkload workloads[] = {
+	// cheap tiles, the time is dominated by queueing and dispatch.
+	{ "exterior", 1.0, 1.0, 2.0, 5 },
+	// the whole set, tile costs vary a lot.
+	{ "mixed", -0.75, 0.0, 3.0, 5 },
+	// every point runs to the itteration limit, the time is dominated by solving.
+	{ "interior", -0.15, 0.0, 0.3, 7 }
+};
+
+string PipelineResult::toJSON()
+{
+	char buffer[512];
+	sprintf_s(buffer, "{\"workload\": \"%s\", \"threads\": %d, \"tiles\": %d, \"seconds\": %.6f, \"tilesPerSecond\": %.1f, \"efficiency\": %.3f, "
+		"\"queueLatencyMs\": {\"p50\": %.3f, \"p95\": %.3f, \"p99\": %.3f}, \"completionMs\": {\"p50\": %.3f, \"p99\": %.3f}}",
+		workload.c_str(), threads, tiles, seconds, tilesPerSecond, efficiency,
+		queueLatency50, queueLatency95, queueLatency99, completion50, completion99);
+	return buffer;
+}
+
+// Returns the value below which the given fraction of the (sorted) samples fall.
+static double percentile(const std::vector<double> &sorted, double fraction)
+{
+	if (sorted.empty())
+		return 0;
+	size_t index = (size_t)(fraction * (sorted.size() - 1) + 0.5);
+	return sorted[index];
+}
+
+std::vector<RenderBlock*> PipelineBenchmark::createTiles(const PipelineWorkload &workload)
+{
+	int tileCount = 1 << workload.depth;
+	double size = 8.0 / tileCount;
+
+	int x1 = std::max(0, (int)floor((workload.x - workload.width / 2 + 4.0) / size));
+	int y1 = std::max(0, (int)floor((workload.y - workload.width / 2 + 4.0) / size));
+	int x2 = std::min(tileCount - 1, (int)ceil((workload.x + workload.width / 2 + 4.0) / size) - 1);
+	int y2 = std::min(tileCount - 1, (int)ceil((workload.y + workload.width / 2 + 4.0) / size) - 1);
+
+	std::vector<RenderBlock*> tiles;
+	for (int y = y1; y <= y2; y++)
+		for (int x = x1; x <= x2; x++)
+		{
+			auto block = new RenderBlock(Vector2d(x * size - 4.0, y * size - 4.0), 1.0 / size);
+			block->depth = workload.depth;
+			block->tileX = x;
+			block->tileY = y;
+			tiles.push_back(block);
+		}
+	return tiles;
+}
+
+PipelineResult PipelineBenchmark::runWorkload(const PipelineWorkload &workload, int threads)
+{
+	RenderQueue queue(threads);
+	queue.headless = true;
+	queue.solver.setKernel(kernel);
+	queue.solver.setBlockSize(tileSize);
+
+	auto tiles = createTiles(workload);
+
+	PipelineResult result;
+	result.workload = workload.name;
+	result.threads = threads;
+	result.tiles = (int)tiles.size();
+
+	for (int run = 0; run < repeats; run++)
+	{
+		for (auto block : tiles)
+		{
+			block->values.clear();
+			block->status = rsEMPTY;
+		}
+
+		double startTime = wallTime();
+		for (auto block : tiles)
+			queue.addJob(block);
+		for (auto block : tiles)
+			queue.waitFor(block);
+		double elapsed = wallTime() - startTime;
+
+		if (run > 0 && elapsed >= result.seconds)
+			continue;
+
+		std::vector<double> queueLatency;
+		std::vector<double> completion;
+		for (auto block : tiles)
+		{
+			queueLatency.push_back((block->startedAt - block->queuedAt) * 1000);
+			completion.push_back((block->finishedAt - block->queuedAt) * 1000);
+		}
+		std::sort(queueLatency.begin(), queueLatency.end());
+		std::sort(completion.begin(), completion.end());
+
+		result.seconds = elapsed;
+		result.queueLatency50 = percentile(queueLatency, 0.5);
+		result.queueLatency95 = percentile(queueLatency, 0.95);
+		result.queueLatency99 = percentile(queueLatency, 0.99);
+		result.completion50 = percentile(completion, 0.5);
+		result.completion99 = percentile(completion, 0.99);
+	}
+
+	result.tilesPerSecond = result.tiles / result.seconds;
+
+	for (auto block : tiles)
+		delete block;
+	return result;
+}
+
+std::vector<PipelineResult> PipelineBenchmark::run()
+{
+	results.clear();
+	for (auto &workload : workloads)
+	{
+		double singleThreadRate = 0;
+		for (int threads = 1; threads <= maxThreads; threads++)
+		{
+			auto result = runWorkload(workload, threads);
+			if (threads == 1)
+				singleThreadRate = result.tilesPerSecond;
+			result.efficiency = result.tilesPerSecond / (singleThreadRate * threads);
+
+			TRACE(result.workload + " x" + intToStr(threads) + ": " + floatToStr(result.tilesPerSecond) + " tiles/s, efficiency " +
+				floatToStr(result.efficiency * 100) + "%, queue latency p50 " + floatToStr(result.queueLatency50) + "ms p99 " + floatToStr(result.queueLatency99) + "ms");
+			results.push_back(result);
+		}
+	}
+	return results;
+}
+
+bool PipelineBenchmark::save(string filename)
+{
+	FILE *file;
+	if (fopen_s(&file, filename.c_str(), "w") != 0) {
+		TRACE("Could not write " + filename);
+		return false;
+	}
+	fprintf(file, "[\n");
+	for (size_t i = 0; i < results.size(); i++)
+		fprintf(file, "  %s%s\n", results[i].toJSON().c_str(), i + 1 < results.size() ? "," : "");
+	fprintf(file, "]\n");
+	fclose(file);
+	return true;
+}
@@ -0,0 +1,65 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include "helper.h"
+#include "RenderQueue.h"
+
+using std::string;
+
+// A fixed set of tiles fed to the queue in one burst.  All tiles at the given depth that overlap
+// the square of the given width around (x, y) are used, a square on tile edges is covered exactly.
+struct PipelineWorkload
+{
+	const char *name;
+	double x;
+	double y;
+	double width;
+	int depth;
+};
+
+struct PipelineResult
+{
+	string workload;
+	int threads = 0;
+	int tiles = 0;
+	double seconds = 0;
+	double tilesPerSecond = 0;
+	// Throughput per thread relative to the single thread run of the same workload.
+	double efficiency = 0;
+	// Time from addJob until a worker picked the tile up, in milliseconds.
+	double queueLatency50 = 0;
+	double queueLatency95 = 0;
+	double queueLatency99 = 0;
+	// Time from addJob until the tile was solved, in milliseconds.
+	double completion50 = 0;
+	double completion99 = 0;
+
+	string toJSON();
+};
+
+// Drives a headless RenderQueue with synthetic workloads at 1..maxThreads worker threads to
+// show how the whole pipeline (queue, dispatch, solve) scales, as opposed to the kernel alone.
+class PipelineBenchmark
+{
+private:
+	std::vector<PipelineResult> results;
+
+	std::vector<RenderBlock*> createTiles(const PipelineWorkload &workload);
+
+public:
+	int maxThreads = 4;
+
+	// Kernel and tile size the queue's solver uses.
+	SolverKernel kernel = skINTRINSIC_32;
+	int tileSize = 64;
+
+	// Each workload is run this many times per thread count and the fastest run is kept.
+	int repeats = 3;
+
+	// Runs a single workload with the given number of threads (efficiency is not filled in).
+	PipelineResult runWorkload(const PipelineWorkload &workload, int threads);
+
+	std::vector<PipelineResult> run();
+	bool save(string filename);
+};
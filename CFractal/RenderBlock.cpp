@@ -10,11 +10,51 @@ RenderBlock::RenderBlock(Vector2d position, double scale)
 {
 	this->offset = position;
 	this->scale = scale;
+	texture.id = 0;
 	status = rsEMPTY;
 }
 
 RenderBlock::RenderBlock()
 {
+	texture.id = 0;
+	status = rsEMPTY;
+}
+
+void RenderBlock::release()
+{
+	if (texture.id != 0)
+		deleteTexture(texture);
+	texture.id = 0;
+	texels.clear();
+	texels.shrink_to_fit();
+	passesSolved = 0;
+	passesUploaded = 0;
+	itterations = 0;
+	nextItterations = 0;
+	targetItterations = 0;
+	stats = TileStats();
+	histogram.clear();
+	histogram.shrink_to_fit();
+	valuesVersion++;
+	paletteVersion = 0;
+	mirrorSource = NULL;
+	values.clear();
+	isTrivial = false;
+	queuedAt = startedAt = finishedAt = 0;
+	loaded = false;
+	priority = 0;
+	speculative = false;
+	deepening = false;
+	status = rsEMPTY;
+}
+
+void RenderBlock::reset(Vector2d position, double scale)
+{
+	release();
+	depth = 0;
+	tileX = tileY = 0;
+	this->offset = position;
+	this->scale = scale;
 }
 
 RenderBlock::~RenderBlock()
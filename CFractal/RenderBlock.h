@@ -3,6 +3,9 @@
 #include "helper.h"
 #include "glHelper.h"
 #include "Mandel.h"
+#include "PackedTile.h"
+#include "ColorMap.h"
+#include <atomic>
 
 enum RenderBlockStatus {
 	// No rendered fractal data, page will be null.
@@ -27,18 +30,80 @@ public:
 	Vector2d offset;
 	double scale;
 
+	// Position of the block in the grid, tiles are numbered from the top left of the root node.
+	int depth = 0;
+	long long tileX = 0;
+	long long tileY = 0;
+
 	// If block contains all the same color then this will be true.
 	bool isTrivial = false;
 
-	FractalBlock data;
+	// Solved itteration counts, kept in compact form once the block is rendered.
+	PackedTile values;
 
 	Texture texture;
+	// Colors of the block as Compositor texels, kept instead of texture when the queue draws in
+	// software.
+	std::vector<uint8_t> texels;
+
+	std::atomic<RenderBlockStatus> status;
+
+	// Passes of a progressive solve that are in values, and that are in the texture.  Partial
+	// results are shown while the rest of the block is solved.
+	std::atomic<int> passesSolved{ 0 };
+	int passesUploaded = 0;
+
+	// Itteration limit values was solved with, 0 while there is no data.  Quick previews are
+	// solved with a low limit and solved again with a higher one once the view is idle.
+	int itterations = 0;
+	// Itteration limit for the solve the block is queued for.
+	int nextItterations = 0;
+	// Limit the block is worked up to, 0 for the solver's.  Set by the grid from the statistics
+	// of the block's parent.
+	int targetItterations = 0;
+
+	// Measured whenever values changes.
+	TileStats stats;
+	// Counts of the escaped points in values, only kept if the queue is asked to.
+	std::vector<HistogramEntry> histogram;
+	// Bumped whenever values is replaced with a finished result.
+	int valuesVersion = 0;
+	// Version of the HistogramPalette the texture was colored with, 0 for the linear ramp.
+	int paletteVersion = 0;
+
+	// Block this one is waiting on to be copied from, its mirror image across the real axis.
+	RenderBlock *mirrorSource = NULL;
+
+	// Wall times (see wallTime) the block was queued, picked up by a worker and solved.
+	double queuedAt = 0;
+	double startedAt = 0;
+	double finishedAt = 0;
+	// The block's values were read from the tile cache rather than solved.
+	bool loaded = false;
 
-	RenderBlockStatus status;
 	int priority;
+
+	// Queued ahead of being visible.  Speculative jobs are only solved when there is nothing
+	// visible waiting, and can be taken back out of the queue.
+	bool speculative = false;
+
+	// Queued by RenderGrid::deepen to be solved again at a higher limit.  These go after every
+	// other job, and are taken back out of the queue along with speculative ones.
+	bool deepening = false;
+
 	RenderBlockStatus getStatus();
+
+	// True if texture (or texels) holds the block, or at least a partial or preview result of it.
+	bool hasTexture() { return texture.id != 0 || !texels.empty(); }
 	RenderBlock(Vector2d position, double scale);
 
+	// Drops the block's data and texture but keeps its place in the grid, so it is solved again
+	// the next time it is needed.
+	void release();
+
+	// Returns the block to the empty state for a new position, releasing its data and texture.
+	void reset(Vector2d position, double scale);
+
 	RenderBlock();
 	~RenderBlock();
 
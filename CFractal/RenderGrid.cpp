@@ -1,47 +1,62 @@
 #include "stdafx.h"
 #include "RenderGrid.h"
 #include <math.h>
+#include <algorithm>
+#include <limits.h>
 #include "helper.h"
 #include "glHelper.h"
+#include "Metrics.h"
 
 
 ///  ------------------------------------------------------------------
 ///  RenderNode
 ///  ------------------------------------------------------------------
 
-// Construct the render node.
-RenderNode::RenderNode(RenderGrid *parentGrid, RenderNode *parentNode, Vector2d location, int depth)
+RenderNode::RenderNode()
+{
+	parentGrid = NULL;
+	renderBlock = NULL;
+	index = parent = firstChild = NO_NODE;
+}
+
+// Sets up the node at given index of the grid's pool, with a fresh empty block.
+void RenderNode::init(RenderGrid *parentGrid, NodeIndex parent, NodeIndex index, Vector2d location, int depth)
 {
 	this->parentGrid = parentGrid;
-	this->parentNode = parentNode;
+	this->parent = parent;
+	this->index = index;
+	firstChild = NO_NODE;
 	lastTapped = 0;
 	oldestTap = 0;
 	center = location;
 	this->depth = depth;
-	renderBlock = new RenderBlock(getTopLeft(), 1.0 / getSize());
+	renderBlock = &parentGrid->nodes->block(index);
+	renderBlock->reset(getTopLeft(), 1.0 / getSize());
+	renderBlock->depth = depth;
+	renderBlock->tileX = (long long)floor((center.x + 4.0) / getSize());
+	renderBlock->tileY = (long long)floor((center.y + 4.0) / getSize());
+
+	// new nodes count as tapped, so one made outside the view is kept for a while.
+	tap();
 }
 
-// Destroy the render node and any children recursively.
-RenderNode::~RenderNode()
+RenderGrid* RenderNode::getParentGrid()
 {
-	// Release any allocated textures
-	/*
-	if (renderBlock != NULL && renderBlock.texture) 
-		renderBlock->texture->deallocateTexture(true)
-	*/
-	delete renderBlock;
-	delete quad[0][0];
-	delete quad[1][0];
-	delete quad[0][1];
-	delete quad[1][1];
-
-	quad[0][0] = NULL;
+	return parentGrid;
 }
 
+RenderNode *RenderNode::child(int u, int v)
+{
+	if (firstChild == NO_NODE)
+		return NULL;
+	return &parentGrid->nodes->node(firstChild + u + v * 2);
+}
 
-RenderGrid* RenderNode::getParentGrid()
+RenderNode *RenderNode::getParent()
 {
-	return parentGrid;
+	if (parent == NO_NODE)
+		return NULL;
+	return &parentGrid->nodes->node(parent);
 }
 
 // Marks block as tapped with current timestep. Used for garbage collection.
@@ -51,41 +66,43 @@ void RenderNode::tap()
 	lastTapped = parentGrid->tickTime;
 	if ((oldestTap == 0) || (lastTapped < oldestTap))
 		oldestTap = lastTapped;
-	if (parentNode)
-		parentNode->tap();
+	// once a parent has been tapped this tick so have all of its parents.
+	if (parent != NO_NODE && getParent()->lastTapped != lastTapped)
+		getParent()->tap();
 }
 
-// Recursively removes and nodes that have not been tapped for given number of seconds.
+// Recursively removes and nodes that have not been tapped for given number of seconds.  Taps
+// go up the tree, so once all four children are stale everything below them is too and the
+// whole group can go back to the pool in one step.
 void RenderNode::garbageCollect(double ageThreshold)
 {
-	//TRACE("Collecting garbage.");
+	double threshold = parentGrid->tickTime - ageThreshold;
 
 	// no need to garabage collect if we are all within the time threshold.
-	if (oldestTap > parentGrid->tickTime - ageThreshold)
+	if (oldestTap > threshold || firstChild == NO_NODE)
 		return;
 
-	// otherwise need will need to check if this block needs to be cleaned up
-	if (lastTapped < parentGrid->tickTime - ageThreshold) {
-
-		if (parentNode) {
-			parentNode->oldestTap = 0;
-
-			// update parents oldest tap by finding smallest non zero oldest tap of siblings
-			for (int u = 0; u < 1; u++)
-				for (int v = 0; v < 1; v++)
-					if ((parentNode->quad[u][v]->oldestTap != 0) && ((parentNode->quad[u][v]->oldestTap < parentNode->oldestTap) || (parentNode->oldestTap == 0)))
-						parentNode->oldestTap = parentNode->quad[u][v]->oldestTap;
-
-			// now we can clear the children nodes.
-			// todo: this needs to be cleaned up with the proper destory system.
-			delete renderBlock;
-			for (int u = 0; u < 1; u++)
-				for (int v = 0; v < 1; v++)
-				{
-					delete quad[u][v];
-					quad[u][v] = NULL;
-				}
-		}
+	auto pool = parentGrid->nodes;
+	bool stale = true;
+	for (int i = 0; i < 4; i++)
+		if (pool->node(firstChild + i).lastTapped >= threshold)
+			stale = false;
+
+	if (stale) {
+		pool->releaseGroup(firstChild);
+		firstChild = NO_NODE;
+		oldestTap = lastTapped;
+		return;
+	}
+
+	// otherwise collect below each child and update our oldest tap from what is left.
+	oldestTap = lastTapped;
+	for (int i = 0; i < 4; i++)
+	{
+		auto &child = pool->node(firstChild + i);
+		child.garbageCollect(ageThreshold);
+		if ((child.oldestTap != 0) && ((child.oldestTap < oldestTap) || (oldestTap == 0)))
+			oldestTap = child.oldestTap;
 	}
 }
 
@@ -111,15 +128,19 @@ std::string RenderNode::toString()
 
 void RenderNode::split()
 {
-	delete quad[0][0];
-	delete quad[1][0];
-	delete quad[0][1];
-	delete quad[1][1];
+	auto pool = parentGrid->nodes;
+	if (firstChild != NO_NODE)
+		pool->releaseGroup(firstChild);
+
+	// the pool may grow here, but nodes never move so this is still valid afterwards.
+	firstChild = pool->allocateGroup();
 	double quarterSize = getSize() / 4;
-	quad[0][0] = new RenderNode(parentGrid, this, Vector2d(center.x - quarterSize, center.y - quarterSize), depth + 1);
-	quad[1][0] = new RenderNode(parentGrid, this, Vector2d(center.x + quarterSize, center.y - quarterSize), depth + 1);
-	quad[0][1] = new RenderNode(parentGrid, this, Vector2d(center.x - quarterSize, center.y + quarterSize), depth + 1);
-	quad[1][1] = new RenderNode(parentGrid, this, Vector2d(center.x + quarterSize, center.y + quarterSize), depth + 1);
+	for (int v = 0; v < 2; v++)
+		for (int u = 0; u < 2; u++)
+		{
+			NodeIndex childIndex = firstChild + u + v * 2;
+			pool->node(childIndex).init(parentGrid, index, childIndex, Vector2d(center.x + (u ? quarterSize : -quarterSize), center.y + (v ? quarterSize : -quarterSize)), depth + 1);
+		}
 }
 
 
@@ -132,65 +153,30 @@ void RenderNode::addToRenderQue(int priority = 0)
 		return;
 
 	// recurse to parent nodes.
-	if (parentNode)
-		parentNode->addToRenderQue(priority * 2);
+	if (parent != NO_NODE)
+		getParent()->addToRenderQue(priority * 2);
 
 	renderBlock->priority = priority;
-	parentGrid->renderQueue->addJob(renderBlock);
+	renderBlock->speculative = false;
+	renderBlock->deepening = false;
+	parentGrid->queueBlock(this);
 }
 
-// Returns if any part of this node is in view or not.
+// Returns if any part of this node is in view or not.  This is the same test as
+// RenderGrid::visibleRange uses, so everything that is drawn has been prepared.
 // Todo: this relates to drawing and probably shouldn't be here.
 bool RenderNode::isInView()
-{		
-	// Old circle method... quiet fast but not always 100 % correct.
-	double viewRadius = 512.0;
-	double halfSize = getSize() / 2;
-	double blockRadius = sqrt(2.0 * halfSize * halfSize) * parentGrid->viewport->scale * 16;
-	double dst = distanceFromCenterOfScreen();
-	dst -= blockRadius;
-	if (dst < 0)
-		dst = 0;	
-	return dst < (viewRadius);
-	
-}
-
-// Prepairs block for drawing.  I.e. adds unrendered blocks to render que, adds un-uploaded blocks to upload cue. 
-void RenderNode::recursivePrep(int requiredDepth)
 {
-	// cull any non visible blocks
-	if (!isInView())
-		return;
-
-	// If we are a trivial block then there is no need to prep our children blocks
-	/*
-	if (renderBlock.isTrivial)
-		return;
-	*/
-
-	// Stop and required depth
-	if (depth == requiredDepth) 
-	{
-		prep();
-		return;
-	} else {
-		// Otherwise process this block and all its children.
-
-		prep();
-
-		// Split block if required
-		if (!(quad[0][0]))
-			split();
-
-		// Prep each child
-		if (quad[0][0]) quad[0][0]->recursivePrep(requiredDepth);
-		if (quad[1][0]) quad[1][0]->recursivePrep(requiredDepth);
-		if (quad[0][1]) quad[0][1]->recursivePrep(requiredDepth);
-		if (quad[1][1]) quad[1][1]->recursivePrep(requiredDepth);
-	}
+	auto viewport = parentGrid->viewport;
+	auto topLeft = viewport->toViewport(Vector2d(0, 0));
+	auto bottomRight = viewport->toViewport(viewport->size);
+	double halfSize = getSize() / 2;
+	return (center.x + halfSize) * 16 >= topLeft.x && (center.x - halfSize) * 16 <= bottomRight.x &&
+		(center.y + halfSize) * 16 >= topLeft.y && (center.y - halfSize) * 16 <= bottomRight.y;
 }
 
-// Prepaires node by enquing it to be rendered if needed.
+// Prepaires node by enquing it to be rendered if needed.  The worker that picks it up reads it
+// from the tile cache instead of solving it if it can.
 void RenderNode::prep()
 {
 	Assert(renderBlock, "Render block not allocated.");
@@ -205,21 +191,33 @@ void RenderNode::prep()
 ///  RenderGrid
 ///  ------------------------------------------------------------------
 
-RenderGrid::RenderGrid(Viewport *viewport)
+RenderGrid::RenderGrid(Viewport *viewport, int threads, int tileSize)
 {
-	TRACE("Creating render grid (using block size of 64)");
-	blockSize = 64;
-	root = new RenderNode(this, NULL, Vector2d(0, 0), 0);
+	TRACE("Creating render grid (using block size of " + intToStr(tileSize) + ")");
+	blockSize = tileSize;
 	//pageManager = ...
-	renderQueue = new RenderQueue();
+	renderQueue = new RenderQueue(threads);
+	renderQueue->solver.setBlockSize(blockSize);
 	this->viewport = viewport;
+
+	tickTime = wallTime();
+
+	// the root gets a group to itself, the other three nodes are never used.
+	nodes = new NodePool(renderQueue);
+	NodeIndex rootIndex = nodes->allocateGroup();
+	root = &nodes->node(rootIndex);
+	root->init(this, NO_NODE, rootIndex, Vector2d(0, 0), 0);
+
+	histogram = new ViewHistogram(std::max(maxItterations, renderQueue->solver.getItterations()));
 }
 
 
 RenderGrid::~RenderGrid()
 {
-	delete root;	
+	// stop the workers first, they may still be solving blocks that belong to the tree.
 	delete renderQueue;
+	delete nodes;
+	delete histogram;
 }
 
 // Returns node at given location.
@@ -238,17 +236,18 @@ RenderNode* RenderGrid::getNode(Vector2d location, int depth)
 		// dig down another level
 		int u = (location.x < currentNode->center.x) ? 0 : 1;
 		int v = (location.y < currentNode->center.y) ? 0 : 1;
-		if (!(currentNode->quad[u][v]))
+		if (currentNode->firstChild == NO_NODE)
 			return NULL;
-		currentNode = currentNode->quad[u][v];
+		currentNode = currentNode->child(u, v);
 	}
 	return currentNode;
 
 }
 
 // Draws this node and all its children to the current viewport until required depth is reached.
-// Blocks not within the viewport are pruned out.
-void RenderNode::recursiveDraw()
+// Blocks not within the viewport are pruned out.  Draws into compositor's draw list if one is
+// given, otherwise with GL.
+void RenderNode::recursiveDraw(Compositor *compositor)
 {	
 	// Cull non visibile blocks.
 	if (!isInView())
@@ -256,13 +255,15 @@ void RenderNode::recursiveDraw()
 	
 	// Draw target depth.
 	if (depth == parentGrid->targetDepth) {
-		draw();
+		draw(compositor);
 	}
 	else {
 		// draw children instead
-		for (int u = 0; u < 2; u++)
-			for (int v = 0; v < 2; v++)
-				if (quad[u][v]) quad[u][v]->recursiveDraw();
+		if (firstChild != NO_NODE) {
+			auto pool = parentGrid->nodes;
+			for (int i = 0; i < 4; i++)
+				pool->node(firstChild + i).recursiveDraw(compositor);
+		}
 	}
 }
 
@@ -273,70 +274,80 @@ void RenderNode::drawDebugBlock(int atX, int atY, double scale, COLORREF color)
 		return;
 
 	auto destination = parentGrid->viewport->target;
-	auto block = renderBlock->data;
 
-	int scaledSize = (int)(64 * scale);
+	int scaledSize = (int)(parentGrid->blockSize * scale);
 
 	drawRect(destination, Vector2d(atX, atY), Vector2d(atX + scaledSize, atY + scaledSize), color);
 }
 
-void RenderNode::draw()
+// Returns the node whose block is drawn in this node's place, this node if it has something to
+// show, otherwise the nearest ancestor that is finished.  uv1 and uv2 are set to the part of its
+// block that covers this node.  Returns NULL if there is nothing to draw.  With fromValues, blocks
+// that are solved but have no texture count as well (they are colored when drawn).
+RenderNode *RenderNode::drawSource(bool fromValues, Vector2d &uv1, Vector2d &uv2)
+{
+	uv1 = Vector2d(0, 0);
+	uv2 = Vector2d(1, 1);
+
+	// A partly solved block is still better than its parent.
+	RenderBlockStatus status = renderBlock->status;
+	if (renderBlock->hasTexture() || (fromValues && (status == rsRENDERED || status == rsUPLOADED)))
+		return this;
+
+	// look up in the chain for a rendered block
+	auto node = this;
+	for (int level = 0; level < 10 && node->parent != NO_NODE; level++)
+	{
+		node = node->getParent();
+		status = node->renderBlock->status;
+		if (status == rsUPLOADED || (fromValues && status == rsRENDERED)) {
+			double size = node->getSize();
+			auto sourceTopLeft = node->getTopLeft();
+			auto topLeft = getTopLeft();
+			uv1 = Vector2d((topLeft.x - sourceTopLeft.x) / size, (topLeft.y - sourceTopLeft.y) / size);
+			uv2 = Vector2d(uv1.x + getSize() / size, uv1.y + getSize() / size);
+			return node;
+		}
+	}
+	return NULL;
+}
+
+void RenderNode::draw(Compositor *compositor)
 {
 	auto fractal_topLeft = Vector2d(center.x - getSize() / 2, center.y - getSize() / 2);
 	fractal_topLeft.x *= 16;
 	fractal_topLeft.y *= 16;
 
-	double size = getSize();
-	double target_size = 64.0 / parentGrid->viewport->scale;
+	// on screen size of the node, this does not depend on the block size.
+	double target_size = 16.0 * getSize() * parentGrid->viewport->scale;
 
 	auto target_topLeft = parentGrid->viewport->toScreen(fractal_topLeft);	
-	auto target_bottomRight = Vector2d(target_topLeft.x + 64.0 * 16.0 * size / target_size, target_topLeft.y + 64.0 * 16.0 * size / target_size);
+	auto target_bottomRight = Vector2d(target_topLeft.x + target_size, target_topLeft.y + target_size);
 
+	Vector2d uv1, uv2;
+	auto source = drawSource(compositor != NULL, uv1, uv2);
 
-	// for the moment just draw this node, and don't worry about scanning upwards for parent nodes.
-	if (renderBlock->status == rsUPLOADED)
-	{	
-		drawTexture(target_topLeft, target_bottomRight, renderBlock->texture);
+	if (!source) {
+		// nothing for the moment... draw a colored block to indicate loading in the future.
+		if (compositor)
+			compositor->addRect(target_topLeft, target_bottomRight, Color(255, 255, 0));
+		else
+			drawRect(target_topLeft, target_bottomRight, Color(255, 255, 0));
+		return;
 	}
-	else {
-
-		// look up in the chain for a rendered block
-		int blocksUpToCheck = 10;
-		auto node = this;
-		RenderNode *foundNode = NULL;
-		while (blocksUpToCheck > 0 && node->parentNode)
-		{
-			node = node->parentNode;
-			if (node->renderBlock && node->renderBlock->status == rsUPLOADED) {
-				foundNode = node;
-				break;
-			}
-		}
-
-		if (foundNode) {
-			// use this parent node instead.
-			double sectionWidth = this->getSize() / foundNode->getSize();
-			double sectionHeight = this->getSize() / foundNode->getSize();
-			double sectionX = (foundNode->center.x - this->center.x) / foundNode->getSize() - (sectionWidth / 2);
-			double sectionY = (foundNode->center.y - this->center.y) / foundNode->getSize() - (sectionHeight / 2);
-			//auto uv1 = Vector2d(foundNode->getTopLeft().x - this->getTopLeft().x / foundNode->getSize(), foundNode->getTopLeft().y - this->getTopLeft().y / foundNode->getSize());
-			//auto uv2 = Vector2d(foundNode->getTopLeft().x - this->getBottomRight().x / foundNode->getSize(), foundNode->getTopLeft().y - this->getBottomRight().y / foundNode->getSize());
 
-			//TRACE(uv1.toString());
-
-			while (sectionX < 0) sectionX += 1;
-			while (sectionY < 0) sectionY += 1;
-			while (sectionX > 1) sectionX -= 1;
-			while (sectionY > 1) sectionY -= 1;			
-
-			drawTexture(target_topLeft, target_bottomRight, Vector2d(sectionX,sectionY), Vector2d(sectionX + sectionWidth, sectionY + sectionHeight), foundNode->renderBlock->texture);
-			//drawTexture(target_topLeft, target_bottomRight, uv1, uv2, foundNode->renderBlock->texture);
-		}
-		else {
-			// nothing for the moment... draw a colored block to indicate loading in the future.
-			drawRect(target_topLeft, target_bottomRight, Color(255, 255, 0));
-		}
+	if (compositor) {
+		CompositeTile tile;
+		tile.texels = parentGrid->getTexels(source->renderBlock);
+		tile.size = parentGrid->blockSize;
+		tile.topLeft = target_topLeft;
+		tile.bottomRight = target_bottomRight;
+		tile.uv1 = uv1;
+		tile.uv2 = uv2;
+		compositor->add(tile);
 	}
+	else
+		drawTexture(target_topLeft, target_bottomRight, uv1, uv2, source->renderBlock->texture);
 }
 
 // Returns distance of block from center of screen.
@@ -349,11 +360,22 @@ double RenderNode::distanceFromCenterOfScreen()
 }
 
 
-// Removes nodes until the cache usage level reaches below cacheSizeMB (in megabytes)
+// Gives nodes that have not been near the view for maxAge seconds back to the pool, along with
+// their data.  Called every frame, but only collects every collectInterval seconds.  The tiles
+// prepared for the view are tapped first, taps go up the tree so what is drawn in their place
+// is kept as well.
 void RenderGrid::garbageCollect()
 {
-	// NIY:
-	return;
+	tickTime = wallTime();
+	if (tickTime - collectedAt < collectInterval)
+		return;
+	collectedAt = tickTime;
+
+	for (auto node : preparedNodes)
+		node->tap();
+
+	root->garbageCollect(maxAge);
+	nodes->reclaim();
 }
 
 // Returns render block at given location and depth, or NULL if none exists.
@@ -386,17 +408,498 @@ void RenderGrid::createBlock(Vector2d location, int depth)
 	// then split this block until we get to the desired level.
 	while (currentDepth <= depth - 1)
 	{
-		getNode(location, depth)->split();
+		getNode(location, currentDepth)->split();
 		currentDepth++;
 	}
 
 }
 
-// Prepairs all visibile blocks according to current viewport.
+// Returns the node for tile (tileX, tileY) at given depth, where tiles are numbered from the
+// top left of the root node.  Parent nodes are created as required.
+RenderNode* RenderGrid::getTile(long long tileX, long long tileY, int depth)
+{
+	double size = root->getSize() / std::pow(2, depth);
+	auto topLeft = root->getTopLeft();
+	auto location = Vector2d(topLeft.x + (tileX + 0.5) * size, topLeft.y + (tileY + 0.5) * size);
+	createBlock(location, depth);
+	return getNode(location, depth);
+}
+
+RenderNode* RenderGrid::findTile(long long tileX, long long tileY, int depth)
+{
+	double size = root->getSize() / std::pow(2, depth);
+	auto topLeft = root->getTopLeft();
+	auto node = getNode(Vector2d(topLeft.x + (tileX + 0.5) * size, topLeft.y + (tileY + 0.5) * size), depth);
+	return node && node->depth == depth ? node : NULL;
+}
+
+// Works out the itteration limit for node from the nearest ancestor that has been solved.  Escape
+// counts rise towards the boundary, and each level down sees more of it, so the limit grows with
+// the distance to that ancestor.  An ancestor where every point escaped has seen all there is,
+// its descendants need little more than its slowest point.
+int RenderGrid::tileLimit(RenderNode *node)
+{
+	if (!adaptiveItterations)
+		return 0;
+
+	int levels = 0;
+	RenderBlock *ancestor = NULL;
+	for (auto parent = node->getParent(); parent; parent = parent->getParent())
+	{
+		levels++;
+		auto status = parent->renderBlock->getStatus();
+		if ((status == rsRENDERED || status == rsUPLOADED) && parent->renderBlock->stats.valid) {
+			ancestor = parent->renderBlock;
+			break;
+		}
+	}
+
+	double limit = renderQueue->solver.getItterations();
+	if (ancestor) {
+		double growth = ancestor->stats.unescaped > 0 ? 4.0 : 1.5;
+		limit = std::max(ancestor->stats.maxItterations, minItterations) * std::pow(growth, levels);
+	}
+	limit = std::max((double)minItterations, std::min((double)maxItterations, limit * quality));
+
+	// powers of two only, so a tile keeps the same limit (and cache key) for small changes in
+	// its ancestor's statistics.
+	int result = minItterations;
+	while (result < limit && result < maxItterations)
+		result *= 2;
+	return std::min(result, maxItterations);
+}
+
+void RenderGrid::queueBlock(RenderNode *node)
+{
+	auto block = node->renderBlock;
+	block->targetItterations = tileLimit(node);
+
+	// the real axis runs along the middle of the root, so tile rows y and 2^depth - 1 - y are
+	// mirror images of each other below it.
+	if (block->depth > 0 && renderQueue->solver.isConjugateSymmetric())
+	{
+		long long mirrorY = (1LL << block->depth) - 1 - block->tileY;
+		auto mirror = findTile(block->tileX, mirrorY, block->depth);
+		if (mirror && renderQueue->addMirror(block, mirror->renderBlock))
+			return;
+	}
+	renderQueue->addJob(block);
+}
+
+TileRange RenderGrid::visibleRange(int depth)
+{
+	return visibleRange(*viewport, depth);
+}
+
+TileRange RenderGrid::visibleRange(Viewport &view, int depth)
+{
+	auto topLeft = view.toViewport(Vector2d(0, 0));
+	auto bottomRight = view.toViewport(view.size);
+	double size = root->getSize() / std::pow(2, depth);
+	auto origin = root->getTopLeft();
+	long long tileCount = 1LL << depth;
+
+	TileRange range;
+	range.depth = depth;
+	range.x1 = std::max(0LL, (long long)floor((topLeft.x / 16.0 - origin.x) / size));
+	range.y1 = std::max(0LL, (long long)floor((topLeft.y / 16.0 - origin.y) / size));
+	range.x2 = std::min(tileCount - 1, (long long)floor((bottomRight.x / 16.0 - origin.x) / size));
+	range.y2 = std::min(tileCount - 1, (long long)floor((bottomRight.y / 16.0 - origin.y) / size));
+	return range;
+}
+
+// Prepares a tile that just came into view along with all of its parents, so there is always
+// something to draw in its place.  Returns the tile's node.
+RenderNode *RenderGrid::prepareTile(long long tileX, long long tileY, int depth)
+{
+	auto tile = getTile(tileX, tileY, depth);
+	for (auto node = tile; node; node = node->getParent())
+		node->prep();
+	return tile;
+}
+
 void RenderGrid::prepare(int depth)
 {
 	if (depth < 1) depth = 1;
-	root->recursivePrep(depth);
+
+	// nothing to do if the view has not changed.
+	if (depth == prepared.depth && viewport->scale == preparedScale &&
+		viewport->offset.x == preparedOffset.x && viewport->offset.y == preparedOffset.y &&
+		viewport->size.x == preparedSize.x && viewport->size.y == preparedSize.y)
+		return;
+
+	updateVelocity();
+	renderQueue->colorLimit = adaptiveItterations ? std::max(maxItterations, renderQueue->solver.getItterations()) : 0;
+
+	// speculative jobs from last time are no longer wanted, any that are now visible get queued
+	// again below as normal jobs.
+	renderQueue->cancelSpeculative();
+
+	// only tiles that were not visible last time need preparing, the nodes of the others are
+	// taken from the last list.  Tiles that left the view are just dropped from the set,
+	// anything they queued is left to finish.
+	auto range = visibleRange(depth);
+	bool sameDepth = depth == prepared.depth;
+	long long preparedWidth = prepared.x2 - prepared.x1 + 1;
+	std::vector<RenderNode*> tiles;
+	for (long long y = range.y1; y <= range.y2; y++)
+		for (long long x = range.x1; x <= range.x2; x++)
+		{
+			if (sameDepth && prepared.contains(x, y))
+				tiles.push_back(preparedNodes[(size_t)((y - prepared.y1) * preparedWidth + x - prepared.x1)]);
+			else
+				tiles.push_back(prepareTile(x, y, depth));
+		}
+
+	prepared = range;
+	preparedNodes.swap(tiles);
+	deepened = false;
+	colorsCurrent = false;
+	preparedOffset = viewport->offset;
+	preparedSize = viewport->size;
+	preparedScale = viewport->scale;
+
+	prefetch(depth);
+}
+
+// Estimates pan and zoom speed from how far the view moved since the last prepare.  Keyboard
+// movement comes in steps, so the speed is averaged over the last few of them.
+void RenderGrid::updateVelocity()
+{
+	double now = wallTime();
+	double elapsed = now - preparedAt;
+	preparedAt = now;
+
+	// a long pause means the view started moving again, nothing is known about its speed yet.
+	if (preparedScale == 0 || elapsed <= 0 || elapsed > 0.5) {
+		panVelocity = Vector2d(0, 0);
+		zoomVelocity = 0;
+		return;
+	}
+
+	auto pan = Vector2d((viewport->offset.x - preparedOffset.x) / elapsed, (viewport->offset.y - preparedOffset.y) / elapsed);
+	double zoom = log2(viewport->scale / preparedScale) / elapsed;
+	panVelocity = Vector2d(panVelocity.x * 0.5 + pan.x * 0.5, panVelocity.y * 0.5 + pan.y * 0.5);
+	zoomVelocity = zoomVelocity * 0.5 + zoom * 0.5;
+}
+
+// Queues tiles that the view is heading towards as speculative jobs, closest to where the view
+// is expected to be first.  When zooming in this looks at the next depth down.
+void RenderGrid::prefetch(int depth)
+{
+	if (prefetchSeconds <= 0 || maxPrefetch <= 0)
+		return;
+	if (panVelocity.x == 0 && panVelocity.y == 0 && zoomVelocity == 0)
+		return;
+
+	Viewport ahead = *viewport;
+	ahead.offset = Vector2d(viewport->offset.x + panVelocity.x * prefetchSeconds, viewport->offset.y + panVelocity.y * prefetchSeconds);
+	ahead.scale = viewport->scale * std::pow(2.0, zoomVelocity * prefetchSeconds);
+
+	int aheadDepth = layerForScale(ahead.scale);
+	aheadDepth = std::max(depth - 1, std::min(depth + 1, std::max(1, aheadDepth)));
+
+	// the tiles that will be needed that are not visible now.
+	auto range = visibleRange(ahead, aheadDepth);
+	double size = root->getSize() / std::pow(2, aheadDepth);
+	auto origin = root->getTopLeft();
+	auto centre = Vector2d(ahead.offset.x / 16.0, ahead.offset.y / 16.0);
+	struct Candidate
+	{
+		double distance;
+		long long x;
+		long long y;
+	};
+	std::vector<Candidate> candidates;
+	for (long long y = range.y1; y <= range.y2; y++)
+		for (long long x = range.x1; x <= range.x2; x++)
+		{
+			if (aheadDepth == depth && prepared.contains(x, y))
+				continue;
+			double dx = origin.x + (x + 0.5) * size - centre.x;
+			double dy = origin.y + (y + 0.5) * size - centre.y;
+			candidates.push_back({ dx * dx + dy * dy, x, y });
+		}
+	std::sort(candidates.begin(), candidates.end(), [](const Candidate &a, const Candidate &b) { return a.distance < b.distance; });
+
+	// nodes are only created for the tiles that are actually queued.
+	int queued = 0;
+	for (auto &candidate : candidates)
+	{
+		if (queued >= maxPrefetch)
+			break;
+		auto node = getTile(candidate.x, candidate.y, aheadDepth);
+		auto block = node->renderBlock;
+		if (block->getStatus() != rsEMPTY)
+			continue;
+		// nearer tiles get the higher priority.
+		block->priority = maxPrefetch - queued;
+		block->speculative = true;
+		queueBlock(node);
+		queued++;
+	}
+	metrics.prefetchQueued += queued;
+}
+
+void RenderGrid::deepen()
+{
+	if (prepared.depth < 0 || wallTime() - preparedAt < deepenDelay)
+		return;
+	if (!renderQueue->isIdle()) {
+		deepened = false;
+		return;
+	}
+
+	// once a look over the view has found nothing to do, there is nothing until something
+	// changes.
+	if (deepened && deepenedQuality == quality)
+		return;
+
+	// only the lowest limit on screen is worked on, so the whole view sharpens together.  Limits
+	// are worked out again as parents may have been solved since the blocks were queued.
+	int lowest = INT_MAX;
+	std::vector<RenderNode*> nodes;
+	for (auto node : preparedNodes)
+	{
+		auto block = node->renderBlock;
+		if (block->getStatus() != rsUPLOADED)
+			continue;
+		block->targetItterations = tileLimit(node);
+
+		// blocks where every point escaped are final at any limit.
+		if (block->itterations >= renderQueue->targetLimit(block) || block->stats.unescaped == 0)
+			continue;
+		if (block->itterations < lowest) {
+			lowest = block->itterations;
+			nodes.clear();
+		}
+		if (block->itterations == lowest)
+			nodes.push_back(node);
+	}
+	deepened = nodes.empty();
+	deepenedQuality = quality;
+
+	// a batch at a time, the queue has to go idle again before the next one.
+	int count = std::min((int)nodes.size(), renderQueue->getThreadCount());
+	for (int i = 0; i < count; i++)
+	{
+		nodes[i]->renderBlock->priority = 0;
+		nodes[i]->renderBlock->deepening = true;
+		queueBlock(nodes[i]);
+	}
+}
+
+void RenderGrid::updateColors()
+{
+	if (prepared.depth < 0)
+		return;
+
+	// nothing has changed since the colors were last brought up to date.
+	int uploads = renderQueue->uploads;
+	if (colorsCurrent && uploads == colorsUploads && colorMode == colorsMode)
+		return;
+
+	if (colorMode == cmHISTOGRAM) {
+		updateHistogram();
+		renderQueue->palette = &palette;
+	}
+	else {
+		for (auto &member : histogramMembers)
+			histogram->remove(member.second.entries);
+		histogramMembers.clear();
+		renderQueue->palette = NULL;
+	}
+
+	int version = renderQueue->paletteVersion();
+	int recolored = 0;
+	bool pending = false;
+	for (auto node : preparedNodes)
+	{
+		auto block = node->renderBlock;
+		if (block->getStatus() == rsUPLOADED && block->paletteVersion != version) {
+			if (recolored == maxRecolors) {
+				pending = true;
+				break;
+			}
+			renderQueue->recolor(block);
+			recolored++;
+		}
+	}
+
+	// a histogram palette waiting to be built again counts as a change still to come.
+	if (colorMode == cmHISTOGRAM && histogram->changes != paletteChanges)
+		pending = true;
+	colorsCurrent = !pending;
+	colorsUploads = uploads;
+	colorsMode = colorMode;
+}
+
+// Brings the histogram in line with the tiles in view, and builds the palette again if it has
+// changed enough.  Only tiles that arrived, changed or left since the last frame are touched.
+void RenderGrid::updateHistogram()
+{
+	colorFrame++;
+	for (auto node : preparedNodes)
+	{
+		auto block = node->renderBlock;
+
+		// a block being solved again keeps its old counts until the new ones are in.
+		bool ready = block->getStatus() == rsUPLOADED;
+		auto found = histogramMembers.find(block);
+		if (found == histogramMembers.end()) {
+			if (!ready)
+				continue;
+			found = histogramMembers.insert({ block, HistogramMember() }).first;
+			found->second.entries = block->histogram;
+			found->second.valuesVersion = block->valuesVersion;
+			histogram->add(found->second.entries);
+		}
+		else if (ready && found->second.valuesVersion != block->valuesVersion) {
+			histogram->remove(found->second.entries);
+			found->second.entries = block->histogram;
+			found->second.valuesVersion = block->valuesVersion;
+			histogram->add(found->second.entries);
+		}
+		found->second.frame = colorFrame;
+	}
+
+	// tiles that left the view.
+	for (auto it = histogramMembers.begin(); it != histogramMembers.end();)
+	{
+		if (it->second.frame != colorFrame) {
+			histogram->remove(it->second.entries);
+			it = histogramMembers.erase(it);
+		}
+		else
+			++it;
+	}
+
+	// every change recolors the whole view, so small ones wait a little in case more follow.
+	long long total = histogram->total;
+	if (histogram->changes == paletteChanges || total == 0)
+		return;
+	bool large = std::abs(total - paletteTotal) * 50 > paletteTotal;
+	if (large || wallTime() - paletteBuiltAt > 0.25) {
+		palette.build(*histogram);
+		paletteChanges = histogram->changes;
+		paletteTotal = total;
+		paletteBuiltAt = wallTime();
+	}
+}
+
+const uint8_t *RenderGrid::getTexels(RenderBlock *block)
+{
+	if (!block->texels.empty())
+		return block->texels.data();
+	auto &texels = composeTexels[block];
+	texels.resize(blockSize * blockSize * TEXEL_BYTES);
+	return texels.data();
+}
+
+void RenderGrid::compose(Compositor &compositor)
+{
+	root->recursiveDraw(&compositor);
+
+	// blocks that only have values (or a GL texture) were given somewhere to put their colors
+	// as the tiles were added, they are colored now.
+	std::vector<RenderBlock*> blocks;
+	for (auto &entry : composeTexels)
+		blocks.push_back(entry.first);
+	parallelFor((int)blocks.size(), compositor.threads, [&](int i) {
+		int count = blockSize * blockSize;
+		auto colors = new uint8_t[count * 3];
+		renderQueue->colorBlock(blocks[i], colors);
+		Compositor::toTexels(colors, count, composeTexels.find(blocks[i])->second.data());
+		delete[] colors;
+	});
+
+	compositor.compose();
+	composeTexels.clear();
+}
+
+int RenderGrid::layerForScale(double scale)
+{
+	return (int)log2(scale * 64.0 / blockSize);
+}
+
+///  ------------------------------------------------------------------
+///  NodePool
+///  ------------------------------------------------------------------
+
+NodePool::NodePool(RenderQueue *queue)
+{
+	this->queue = queue;
+}
+
+NodePool::~NodePool()
+{
+	for (auto chunk : nodeChunks)
+		delete[] chunk;
+	for (auto chunk : blockChunks)
+		delete[] chunk;
+}
+
+NodeIndex NodePool::allocateGroup()
+{
+	// reuse a released group if we can.
+	if (freeGroups == NO_NODE)
+		reclaim();
+	if (freeGroups != NO_NODE) {
+		NodeIndex first = freeGroups;
+		freeGroups = node(first).parent;
+		return first;
+	}
+
+	// otherwise take the next group of fresh nodes, chunks are a multiple of four so a group
+	// never spans two of them.
+	if (top + 4 > capacity()) {
+		nodeChunks.push_back(new RenderNode[CHUNK_SIZE]);
+		blockChunks.push_back(new RenderBlock[CHUNK_SIZE]);
+	}
+	NodeIndex first = top;
+	top += 4;
+	return first;
+}
+
+void NodePool::releaseGroup(NodeIndex first)
+{
+	released.push_back(first);
+}
+
+bool NodePool::isGroupBusy(NodeIndex first)
+{
+	for (int i = 0; i < 4; i++)
+		if (queue->isBusy(&block(first + i)))
+			return true;
+	return false;
+}
+
+void NodePool::reclaim()
+{
+	std::vector<NodeIndex> busy;
+	while (!released.empty())
+	{
+		NodeIndex first = released.back();
+		released.pop_back();
+		if (isGroupBusy(first)) {
+			busy.push_back(first);
+			continue;
+		}
+
+		for (int i = 0; i < 4; i++)
+		{
+			auto &freed = node(first + i);
+			if (freed.firstChild != NO_NODE)
+				released.push_back(freed.firstChild);
+			freed.firstChild = NO_NODE;
+
+			auto &data = block(first + i);
+			data.reset(data.offset, data.scale);
+		}
+		node(first).parent = freeGroups;
+		freeGroups = first;
+	}
+	released = busy;
 }
 
 ///  ------------------------------------------------------------------
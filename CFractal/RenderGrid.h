@@ -5,17 +5,25 @@
 #include "helper.h"
 #include "glHelper.h"
 #include "RenderQueue.h"
+#include "Compositor.h"
+#include <vector>
+#include <unordered_map>
+#include <stdint.h>
 
 class RenderGrid;
 class Viewport;
 
-// Node of a quad tree.
+// Nodes are referred to by their index in the grid's NodePool.
+typedef uint32_t NodeIndex;
+const NodeIndex NO_NODE = 0xFFFFFFFF;
+
+// Node of a quad tree.  Nodes live in a NodePool and are created by their parent's split(), the
+// four children of a node are always next to each other in the pool.
 class RenderNode
 {
 private:
 	RenderGrid *parentGrid;
-	RenderNode *parentNode;	
-	
+
 	// Timestamp of the last time this node was tapped (used for GC)
 	double lastTapped;
 
@@ -26,14 +34,9 @@ private:
 	
 public:
 
-	void recursivePrep(int requiredDepth);
-
-	// Data for the node.
+	// Data for the node, owned by the pool.
 	RenderBlock *renderBlock;
 
-	// Children nodes (if any).
-	RenderNode *quad[2][2];
-
 	RenderGrid* getParentGrid();
 
 	// Location of nodes center.
@@ -42,6 +45,17 @@ public:
 	// Depth of node, 0 = top.
 	int depth;
 
+	// Index of this node, its parent and its first child (the other three follow it).
+	NodeIndex index;
+	NodeIndex parent;
+	NodeIndex firstChild;
+
+	// Returns the child in quadrant (u, v), or NULL if the node has not been split.
+	RenderNode *child(int u, int v);
+
+	// Returns the parent node, or NULL for the root.
+	RenderNode *getParent();
+
 	void tap();
 
 	void garbageCollect(double ageThreshold);
@@ -66,32 +80,176 @@ public:
 	// Prepaires node by enquing it to be rendered if needed.
 	void prep();
 
-	void recursiveDraw();
+	void recursiveDraw(Compositor *compositor = NULL);
 
 	void drawDebugBlock(int atX, int atY, double scale, COLORREF color);
 
 	void drawBlockFast(int atX, int atY, double scale, bool debug);
 
-	void draw();
+	RenderNode *drawSource(bool fromValues, Vector2d &uv1, Vector2d &uv2);
+
+	void draw(Compositor *compositor = NULL);
 
 	double distanceFromCenterOfScreen();	
 
-	RenderNode(RenderGrid *parentGrid, RenderNode *parentNode, Vector2d location, int depth);
-	~RenderNode();
+	// Sets up a freshly allocated node, along with its block.
+	void init(RenderGrid *parentGrid, NodeIndex parent, NodeIndex index, Vector2d location, int depth);
+
+	RenderNode();
+};
+
+// Slab storage for the nodes of a grid and their blocks.  Nodes are handed out in groups of four
+// siblings so that a split is a single allocation and a traversal of the children walks
+// contiguous memory.  Nodes and blocks are kept in separate arrays with the same index so the
+// tree can be walked without touching the (much larger) blocks.  Memory is allocated in fixed
+// size chunks, so nodes and blocks never move once allocated.
+class NodePool
+{
+private:
+	static const int CHUNK_SIZE = 4096;
+
+	std::vector<RenderNode*> nodeChunks;
+	std::vector<RenderBlock*> blockChunks;
+
+	// Next index that has never been handed out.
+	NodeIndex top = 0;
 
+	// Groups ready to be reused, linked through the parent index of each group's first node.
+	NodeIndex freeGroups = NO_NODE;
+
+	// Groups that have been released but still hold their data.
+	std::vector<NodeIndex> released;
+
+	RenderQueue *queue;
+
+	bool isGroupBusy(NodeIndex first);
+
+public:
+	RenderNode &node(NodeIndex index) { return nodeChunks[index / CHUNK_SIZE][index % CHUNK_SIZE]; }
+	RenderBlock &block(NodeIndex index) { return blockChunks[index / CHUNK_SIZE][index % CHUNK_SIZE]; }
+
+	// Returns the index of the first of four consecutive uninitialised nodes.
+	NodeIndex allocateGroup();
+
+	// Gives a group and everything below it back to the pool.  This is O(1), the memory is
+	// freed by the next reclaim.
+	void releaseGroup(NodeIndex first);
+
+	// Frees the data and textures of released groups and everything below them, and makes the
+	// groups available to allocateGroup.  Groups the queue is still working on are left for
+	// the next call.  Textures are deleted, so this has to be called on the main thread.
+	void reclaim();
+
+	// Number of nodes the pool has memory for.
+	size_t capacity() { return nodeChunks.size() * CHUNK_SIZE; }
+
+	// Blocks still referenced by queue are never reclaimed.
+	NodePool(RenderQueue *queue);
+	~NodePool();
+};
+
+// Inclusive range of tiles at one depth, tiles are numbered from the top left of the root node.
+struct TileRange
+{
+	int depth = -1;
+	long long x1 = 0;
+	long long y1 = 0;
+	long long x2 = -1;
+	long long y2 = -1;
+
+	bool contains(long long x, long long y) { return x >= x1 && x <= x2 && y >= y1 && y <= y2; }
 };
 
 class RenderGrid
 {
 private:
+	// Tiles made ready by the last prepare, their nodes in row order, and the view they were
+	// worked out for.
+	TileRange prepared;
+	std::vector<RenderNode*> preparedNodes;
+	Vector2d preparedOffset;
+	Vector2d preparedSize;
+	double preparedScale = 0;
+	double preparedAt = 0;
+
+	// Set once deepen or updateColors have found nothing left to do for the prepared tiles, they
+	// skip the tiles until the view, the queue or the settings they depend on change.
+	bool deepened = false;
+	double deepenedQuality = 0;
+	bool colorsCurrent = false;
+	int colorsUploads = 0;
+	ColorMode colorsMode = cmLINEAR;
+
+	// When garbageCollect last collected.
+	double collectedAt = 0;
+
+	// Pan speed in viewport units per second and zoom speed in doublings per second, measured
+	// over recent prepares.
+	Vector2d panVelocity;
+	double zoomVelocity = 0;
+
+	// Histograms of the tiles in view that are counted in histogram, as they were added.
+	struct HistogramMember
+	{
+		std::vector<HistogramEntry> entries;
+		int valuesVersion;
+		int frame;
+	};
+	std::unordered_map<RenderBlock*, HistogramMember> histogramMembers;
+	int colorFrame = 0;
+	int paletteChanges = -1;
+	long long paletteTotal = 0;
+	double paletteBuiltAt = 0;
+
+	void updateHistogram();
+
+	// Colors of the blocks drawn by compose that have no texels of their own.
+	std::unordered_map<RenderBlock*, std::vector<uint8_t>> composeTexels;
+
+	RenderNode *prepareTile(long long tileX, long long tileY, int depth);
+	void updateVelocity();
+	void prefetch(int depth);
+	TileRange visibleRange(Viewport &view, int depth);
+	int tileLimit(RenderNode *node);
 
 public:
-	RenderGrid(Viewport *viewport);
+	// tileSize is the width and height in pixels of the grid's blocks, a power of two from 32 to 512.
+	RenderGrid(Viewport *viewport, int threads = 4, int tileSize = 64);
 	~RenderGrid();
 
+	// Time of the current frame, set by garbageCollect.  Nodes are tapped with it.
 	double tickTime;
-	// default block size, normally 64.
+	// Seconds a node can go without being near the view before it is collected, and how often
+	// garbageCollect looks for them.
+	double maxAge = 30;
+	double collectInterval = 5;
+	// width and height of each block in pixels, normally 64.
 	int blockSize;
+
+	// How far ahead in seconds prepare looks along the current pan and zoom for tiles to queue
+	// speculatively, 0 turns this off.
+	double prefetchSeconds = 0.5;
+	// Most speculative jobs queued at any one time.
+	int maxPrefetch = 32;
+	// Seconds the view has to stay still before preview blocks are solved again at a higher limit.
+	double deepenDelay = 0.25;
+
+	// Give each tile its own itteration limit, worked out from its parent's statistics (see
+	// tileLimit) rather than using the solver's everywhere.
+	bool adaptiveItterations = false;
+	// Scales the adaptive limits, higher is slower but finds more detail near the boundary.
+	double quality = 1.0;
+	// Range the adaptive limits are kept in.
+	int minItterations = 256;
+	int maxItterations = 1 << 16;
+
+	// How the grid's textures are colored.
+	ColorMode colorMode = cmLINEAR;
+	// Counts of the tiles in view and the palette built from them, for cmHISTOGRAM.
+	ViewHistogram *histogram;
+	HistogramPalette palette;
+	// Textures colored again per frame when the palette changes.
+	int maxRecolors = 16;
 	// the target depth to draw blocks at
 	double targetDepth;
 	
@@ -102,13 +260,55 @@ public:
 
 	RenderQueue *renderQueue;
 
+	// Storage for all nodes of the tree.
+	NodePool *nodes;
+
 	// Root node of our quad tree.
 	RenderNode* root;
 
+	// Frees subtrees that have been out of view for maxAge seconds, called every frame.
 	void garbageCollect();
 	RenderBlock* getBlock(Vector2d location, int depth);
 	void createBlock(Vector2d location, int depth);	
-	void prepare(int depth);	
+	RenderNode* getTile(long long tileX, long long tileY, int depth);
+	// Like getTile but returns NULL rather than creating the node if it does not exist.
+	RenderNode* findTile(long long tileX, long long tileY, int depth);
+
+	// Queues node's block to be solved.  Where the formula allows, a block whose mirror image
+	// across the real axis is solved or on its way is copied from that instead.
+	void queueBlock(RenderNode *node);
+
+	// Returns the tiles at given depth that touch the viewport.
+	TileRange visibleRange(int depth);
+
+	// Queues any visible tiles (and their parents) that have no data.  Only tiles that came into
+	// view since the last call are looked at, so this is free while the view stays still.  While
+	// the view is moving, tiles it is heading towards are queued speculatively.
+	void prepare(int depth);
+
+	// Once the view has settled and the queue is idle, queues visible blocks that were solved
+	// below the full itteration limit to be solved again, lowest limit first.  These go in as
+	// deepening jobs, which run after everything else and are taken back out when the view
+	// moves.  Called every frame.
+	void deepen();
+
+	// Keeps the coloring of the tiles in view up to date, called every frame.  In histogram mode
+	// the histograms of tiles coming into view are added and those leaving taken out, and the
+	// palette is built again once they have changed enough.  Textures colored with an older
+	// palette are colored again a few per frame.
+	void updateColors();
+
+	// Draws what recursiveDraw would at targetDepth into compositor's frame, which should be the
+	// size of the viewport.  Blocks without texels are colored from their values.
+	void compose(Compositor &compositor);
+
+	// Texels of block for drawing with the Compositor.  Blocks that have none get a buffer that
+	// compose colors them into.
+	const uint8_t *getTexels(RenderBlock *block);
+
+	// Returns the depth drawn at the given viewport scale.  Larger tiles are drawn a level
+	// higher so that the on screen resolution is the same for any tile size.
+	int layerForScale(double scale);
 };
 
 // Used for mapping between a translated and scaled viewport to screen co-ords.
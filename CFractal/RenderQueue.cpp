@@ -1,30 +1,31 @@
 #include "stdafx.h"
 #include "RenderQueue.h"
 #include "helper.h"
+#include "ColorMap.h"
+#include "StageTrace.h"
+#include "Metrics.h"
 #include <chrono>
+#include <algorithm>
 
 
-// our render pipes.
-RenderPipe pipe[4] = {};
-
 // Returns point to free pipe, or null if no free pipes.
-RenderPipe *getFreePipe()
+RenderPipe *RenderQueue::getFreePipe()
 {
-	for (int i = 0; i < 4; i++)
+	for (int i = 0; i < threadCount; i++)
 	{
-		if (pipe[i].job == NULL)
+		if (pipes[i].job == NULL)
 		{
-			return &pipe[i];
+			return &pipes[i];
 		}
 	}
 	return NULL;
 }
 
-void threaded_processJob(RenderPipe *sourcePipe, MandelbrotSolver *solver)
+void threaded_processJob(RenderPipe *sourcePipe, RenderQueue *queue)
 {
 	TRACE("Worker thread "+intToStr(sourcePipe->id)+" starting ");
 
-	while (true)	
+	while (!queue->stopping)	
 	{
 
 		//TRACE(" -tick " + intToStr(sourcePipe->id));
@@ -36,12 +37,23 @@ void threaded_processJob(RenderPipe *sourcePipe, MandelbrotSolver *solver)
 			continue;
 		}
 
-		auto _block = solver->CreateBlock(block->offset.x, block->offset.y, (1.0 / block->scale) / 64.0);
-		solver->Solve(_block);
+		block->startedAt = wallTime();
+		STAGE_SPAN_AT("queue wait", block, block->queuedAt, block->startedAt);
+		metrics.queueWait.record((long long)((block->startedAt - block->queuedAt) * 1e6));
 
-		block->data = _block;
+		// blocks that have never been solved may be in the tile cache, reading them is much
+		// quicker than solving them.
+		if (block->itterations > 0 || !queue->loadBlock(block))
+			queue->solveBlock(block);
+		metrics.inFlight--;
 
-		block->status = rsRENDERED;
+		// there is nothing to upload so the pipe can go straight back to work.
+		if (queue->headless) {
+			sourcePipe->job = NULL;
+			queue->notifyFinished();
+		}
+		else
+			metrics.uploadBacklog++;
 
 		//TRACE("Finished block" + sourcePipe->job->toString());
 	}
@@ -53,73 +65,530 @@ void processJobList(RenderQueue *queue)
 {	
 	TRACE("Job distrubution thread started");
 
-	while (true)
+	while (!queue->stopping)
 	{
-		// get lock
-		// todo: we need to get a lock on the queue as does the addJob function.
-		// check for jobs
+		// hand out jobs to any free pipes.
+		std::unique_lock<std::mutex> guard(queue->queueLock);
 
-		if (queue->jobQueue.size() >= 1) 
+		RenderPipe *selectedPipe;
+		RenderBlock *job;
+		while ((selectedPipe = queue->getFreePipe()) && (job = queue->takeJob()))
 		{
-			auto selectedPipe = getFreePipe();
-			if ((!selectedPipe))
-				continue;
-
-			TRACE("Processing job.");
-			
-			selectedPipe->job = queue->jobQueue.back();						
-
-			queue->jobQueue.pop_back();
+			selectedPipe->job = job;
+			metrics.queueDepth--;
+			metrics.inFlight++;
 		}
+
+		guard.unlock();
 		
 
 		std::this_thread::sleep_for(std::chrono::milliseconds(1));
 	}
 }
 
+void RenderQueue::colorBlock(RenderBlock *block, uint8_t *colors)
+{
+	int size = solver.getBlockSize();
+	auto values = new int[size * size];
+	int limit;
+	{
+		std::lock_guard<std::mutex> guard(partialLock);
+		block->values.unpack(values);
+		limit = block->itterations;
+	}
+
+	if (paletteVersion() > 0)
+		palette->apply(values, size * size, limit, colors);
+	else {
+		// every block is colored against the same limit whatever limit it was solved with.
+		// Points that did not escape are colored as if they reached it, so a preview only
+		// changes where they do escape once the block is solved again.
+		int paletteLimit = rampLimit();
+		for (int i = 0; i < size * size; i++)
+			if (values[i] >= limit)
+				values[i] = paletteLimit;
+		mapColors(values, size * size, paletteLimit, colors);
+	}
+	delete[] values;
+}
+
 /*
- * Handles texture uploads for the render queue.  Looks like this has to be done in the main thread. 
+ * Colors a block's values and uploads them as its texture, replacing any partial one.
  */
-void RenderQueue::update()
+void RenderQueue::updateTexture(RenderBlock *block)
 {
-	for (int i = 0; i < 4; i++)
+	int size = solver.getBlockSize();
+
+	// Map colors
+	auto colors = new uint8_t[size * size * 3];
 	{
-		if (pipe[i].job && pipe[i].job->status == rsRENDERED) 
-		{
-			RenderBlock *block = pipe[i].job;
+		STAGE_SPAN("colour", block);
+		colorBlock(block, colors);
+		block->paletteVersion = paletteVersion();
+	}
 
-			// Map colors
-			auto colors = new uint8_t[64 * 64 * 3];
-			for (int i = 0; i < 64 * 64 * 3; i++)
-			{
-				colors[i] = 255 - block->data.values_out[i / 3] * 256.0 / 2048.0;
-			}
+	// Upload
+	{
+		STAGE_SPAN("upload", block);
+		if (software) {
+			block->texels.resize(size * size * TEXEL_BYTES);
+			Compositor::toTexels(colors, size * size, block->texels.data());
+		}
+		else {
+			if (block->texture.id != 0)
+				deleteTexture(block->texture);
+			block->texture = createTexture(size, size, colors);
+		}
+	}
 
-			// Upload
-			TRACE("Upload " + block->toString());
-			block->texture = createTexture(64, 64, colors);
+	delete[] colors;
+}
+
+/*
+ * Colors a rendered block and uploads it as a texture.
+ */
+void RenderQueue::uploadBlock(RenderBlock *block)
+{
+	updateTexture(block);
+	block->status = rsUPLOADED;
+	uploads++;
+	metrics.uploadBacklog--;
+	resolveMirrors(block);
+}
+
+/*
+ * Shows the passes of a progressive solve that have finished so far.
+ */
+void RenderQueue::uploadPartial(RenderBlock *block)
+{
+	int passes = block->passesSolved;
+	updateTexture(block);
+	block->passesUploaded = passes;
+}
+
+/*
+ * Handles texture uploads for the render queue.  Looks like this has to be done in the main thread. 
+ */
+void RenderQueue::update()
+{
+	// blocks copied from their mirror arrive in bursts and are cheap, so allow a few of these.
+	for (int i = 0; i < 8 && loadedBlocks.size(); i++)
+	{
+		uploadBlock(loadedBlocks.back());
+		loadedBlocks.pop_back();
+	}
 
-			delete colors;
+	// partial results are small and are what makes a new tile show up quickly, so all of these go.
+	for (int i = 0; i < threadCount; i++)
+	{
+		RenderBlock *block = pipes[i].job;
+		if (block && block->status == rsRENDERING && block->passesSolved > block->passesUploaded)
+			uploadPartial(block);
+	}
 
-			block->status = rsUPLOADED;
+	// the same goes for blocks read from the cache.
+	int loads = 0;
+	for (int i = 0; i < threadCount; i++)
+	{
+		RenderBlock *block = pipes[i].job;
+		if (block && block->status == rsRENDERED && (!block->loaded || loads < 8))
+		{
+			uploadBlock(block);
 
 			// clear pipe for another job.
-			pipe[i].job = NULL;
+			pipes[i].job = NULL;
 
 			// limit to 1 upload per frame so that we just halt the program too long.
-			return;
+			if (!block->loaded)
+				return;
+			loads++;
 		}
 
 	}
 }
 
+/*
+ * Fills block from the tile cache.  Returns false if there is no cache or the block is not in it.
+ * Workers try this before solving a block, so loaded blocks are uploaded by update() just like
+ * solved ones.
+ */
+bool RenderQueue::loadBlock(RenderBlock *block)
+{
+	if (!cache)
+		return false;
+
+	int size = solver.getBlockSize();
+	auto values = new int[size * size];
+	bool found = cache->load(getTileKey(block), values, size * size);
+	if (found)
+		finishValues(block, values, targetLimit(block));
+	delete[] values;
+	if (!found) {
+		metrics.cacheMisses++;
+		return false;
+	}
+
+	metrics.cacheHits++;
+	block->loaded = true;
+	block->finishedAt = wallTime();
+	block->status = rsRENDERED;
+	if (headless)
+		resolveMirrors(block);
+	return true;
+}
+
+// Replaces block's values with a finished result solved with the given limit, along with
+// everything that is worked out from them.  Only the packed counts are kept.
+void RenderQueue::finishValues(RenderBlock *block, const int *values, int limit)
+{
+	int count = solver.getBlockSize() * solver.getBlockSize();
+	auto stats = MandelbrotSolver::GetStats(values, count, limit);
+	std::vector<HistogramEntry> histogram;
+	if (histograms)
+		buildHistogram(values, count, limit, histogram);
+
+	{
+		std::lock_guard<std::mutex> guard(partialLock);
+		block->values.pack(values, count);
+		block->itterations = limit;
+		block->stats = stats;
+		block->histogram.swap(histogram);
+		block->valuesVersion++;
+	}
+	block->isTrivial = block->values.isUniform();
+}
+
+// Returns the key used to store block in the tile cache.
+TileKey RenderQueue::getTileKey(RenderBlock *block)
+{
+	TileKey key;
+	key.formula = solver.getFormula();
+	key.itterations = targetLimit(block);
+	key.tileSize = solver.getBlockSize();
+	key.solverSettings = solver.getResultSettings();
+	key.depth = block->depth;
+	key.tileX = block->tileX;
+	key.tileY = block->tileY;
+	return key;
+}
+
+int RenderQueue::targetLimit(RenderBlock *block)
+{
+	return block->targetItterations > 0 ? block->targetItterations : solver.getItterations();
+}
+
+// Returns the itteration limit block would be solved with next.  Blocks without data get a quick
+// preview first, blocks with data a few times the limit they had, up to the full limit.
+int RenderQueue::nextLimit(RenderBlock *block)
+{
+	int fullLimit = targetLimit(block);
+	if (block->itterations == 0)
+		return previewItterations > 0 && previewItterations < fullLimit ? previewItterations : fullLimit;
+	return std::min(fullLimit, block->itterations * 4);
+}
+
 void RenderQueue::addJob(RenderBlock *block)
 {	
+	block->nextItterations = nextLimit(block);
 	block->status = rsINQUE;
+	block->queuedAt = wallTime();
 
-	//todo: need to get lock here.
+	std::lock_guard<std::mutex> guard(queueLock);
 	jobQueue.push_back(block);
-	TRACE("Job enqued, total jobs " + intToStr(jobQueue.size()));
+	metrics.queueDepth++;
+}
+
+bool RenderQueue::addMirror(RenderBlock *block, RenderBlock *source)
+{
+	int limit = nextLimit(block);
+
+	std::unique_lock<std::mutex> guard(queueLock);
+	auto status = source->getStatus();
+
+	// source is finished, copy it now.
+	bool finished = status == rsUPLOADED || (status == rsRENDERED && headless);
+	if (finished && source->itterations >= limit) {
+		guard.unlock();
+		copyMirror(block, source);
+		finishMirror(block);
+		return true;
+	}
+
+	// source is on its way, wait for it unless it is coming at a lower limit than block needs.
+	int coming = status == rsRENDERED ? source->itterations : source->nextItterations;
+	bool pending = status == rsINQUE || status == rsRENDERING || status == rsRENDERED;
+	if (!pending || coming < limit || source->mirrorSource)
+		return false;
+
+	block->nextItterations = limit;
+	block->mirrorSource = source;
+	block->queuedAt = wallTime();
+	block->status = rsINQUE;
+	mirrorWaiting.push_back(block);
+
+	// a visible block waiting on a speculative or deepening one makes it visible too.
+	if (!block->speculative && !block->deepening) {
+		source->speculative = false;
+		source->deepening = false;
+	}
+	source->priority = std::max(source->priority, block->priority);
+	return true;
+}
+
+void RenderQueue::copyMirror(RenderBlock *block, RenderBlock *source)
+{
+	int size = solver.getBlockSize();
+	auto values = new int[size * size];
+	source->values.unpack(values);
+	for (int y = 0; y < size / 2; y++)
+		std::swap_ranges(values + y * size, values + (y + 1) * size, values + (size - 1 - y) * size);
+	finishValues(block, values, source->itterations);
+	delete[] values;
+}
+
+// Marks a block filled by copyMirror as done, it is uploaded just like a block from the cache.
+void RenderQueue::finishMirror(RenderBlock *block)
+{
+	metrics.tilesMirrored++;
+	block->mirrorSource = NULL;
+	block->speculative = false;
+	block->deepening = false;
+	block->finishedAt = wallTime();
+	block->status = rsRENDERED;
+	if (headless)
+		notifyFinished();
+	else {
+		loadedBlocks.push_back(block);
+		metrics.uploadBacklog++;
+	}
+}
+
+// Copies source into every block waiting on it.  Called once source is finished, from the
+// worker for headless queues and after the upload otherwise.
+void RenderQueue::resolveMirrors(RenderBlock *source)
+{
+	std::vector<RenderBlock*> ready;
+	{
+		std::lock_guard<std::mutex> guard(queueLock);
+		auto waiting = std::remove_if(mirrorWaiting.begin(), mirrorWaiting.end(), [&](RenderBlock *block) {
+			if (block->mirrorSource != source)
+				return false;
+			ready.push_back(block);
+			return true;
+		});
+		mirrorWaiting.erase(waiting, mirrorWaiting.end());
+	}
+
+	for (auto block : ready)
+	{
+		copyMirror(block, source);
+		finishMirror(block);
+	}
+}
+
+RenderBlock *RenderQueue::takeJob()
+{
+	// visible jobs go before speculative ones, and those before deepening ones, then highest
+	// priority first.  Newest wins a tie.  So a speculative job is only started when there is
+	// no visible one waiting.
+	auto rank = [](RenderBlock *job) { return job->deepening ? 2 : job->speculative ? 1 : 0; };
+	int best = -1;
+	for (int i = (int)jobQueue.size() - 1; i >= 0; i--)
+	{
+		auto job = jobQueue[i];
+		if (job->priority < 0)
+			continue;
+		if (best < 0) {
+			best = i;
+			continue;
+		}
+		auto current = jobQueue[best];
+		bool better;
+		if (rank(job) != rank(current))
+			better = rank(job) < rank(current);
+		else
+			better = job->priority > current->priority;
+		if (better)
+			best = i;
+	}
+	if (best < 0)
+		return NULL;
+
+	auto job = jobQueue[best];
+	jobQueue.erase(jobQueue.begin() + best);
+	return job;
+}
+
+int RenderQueue::cancelSpeculative()
+{
+	std::lock_guard<std::mutex> guard(queueLock);
+
+	// only cancelled prefetches count towards prefetchCancelled, deepening just starts over.
+	int prefetched = 0;
+	auto cancelled = std::remove_if(jobQueue.begin(), jobQueue.end(), [&prefetched](RenderBlock *block) {
+		if (!block->speculative && !block->deepening)
+			return false;
+		if (block->speculative)
+			prefetched++;
+		block->speculative = false;
+		block->deepening = false;
+		block->status = block->itterations > 0 ? rsUPLOADED : rsEMPTY;
+		return true;
+	});
+	int count = (int)(jobQueue.end() - cancelled);
+	jobQueue.erase(cancelled, jobQueue.end());
+	metrics.queueDepth -= count;
+	metrics.prefetchCancelled += prefetched;
+
+	// speculative blocks waiting on a mirror go back too.  Sources with a visible block waiting
+	// on them were made visible, so are never cancelled from under one.
+	auto dropped = std::remove_if(mirrorWaiting.begin(), mirrorWaiting.end(), [](RenderBlock *block) {
+		if (!block->speculative && !block->deepening)
+			return false;
+		block->speculative = false;
+		block->deepening = false;
+		block->mirrorSource = NULL;
+		block->status = block->itterations > 0 ? rsUPLOADED : rsEMPTY;
+		return true;
+	});
+	mirrorWaiting.erase(dropped, mirrorWaiting.end());
+	return count;
+}
+
+bool RenderQueue::isBusy(RenderBlock *block)
+{
+	auto status = block->getStatus();
+	if (status == rsINQUE || status == rsRENDERING || status == rsUPLOADING)
+		return true;
+
+	// workers still read a block after marking it rendered, they are done with it once they
+	// have let go of it.
+	for (int i = 0; i < threadCount; i++)
+		if (pipes[i].job == block)
+			return true;
+	return status == rsRENDERED && !headless;
+}
+
+bool RenderQueue::isIdle()
+{
+	std::lock_guard<std::mutex> guard(queueLock);
+	if (!jobQueue.empty() || !loadedBlocks.empty() || !mirrorWaiting.empty())
+		return false;
+	for (int i = 0; i < threadCount; i++)
+		if (pipes[i].job != NULL)
+			return false;
+	return true;
+}
+
+// Waits until block has been solved (or loaded).  Only meaningful for headless queues.
+void RenderQueue::waitFor(RenderBlock *block)
+{
+	std::unique_lock<std::mutex> guard(finishedLock);
+	finished.wait(guard, [&]() { return block->status == rsRENDERED || stopping; });
+}
+
+void RenderQueue::notifyFinished()
+{
+	std::lock_guard<std::mutex> guard(finishedLock);
+	finished.notify_all();
+}
+
+/*
+ * Solves a block on the calling thread.  Used by headless renderers that want the
+ * fractal data but have no need for a texture.
+ */
+void RenderQueue::solveBlock(RenderBlock *block)
+{
+	block->status = rsRENDERING;
+
+	int size = solver.getBlockSize();
+	double pixelSize = (1.0 / block->scale) / size;
+	int limit = block->nextItterations > 0 ? block->nextItterations : targetLimit(block);
+	auto values = new int[size * size];
+
+	// the root is the only block that straddles the real axis, its lower half is a mirror of
+	// its upper half.
+	bool mirrorHalf = block->depth == 0 && solver.isConjugateSymmetric();
+
+	// a block being solved again keeps showing its old data, so there is nothing to gain from
+	// doing it in passes.
+	if (progressive && !headless && block->itterations == 0 && !mirrorHalf)
+	{
+		// each pass only solves new points, and is published as soon as it is done.
+		double solveTime = 0;
+		for (int pass = 0; pass < PROGRESSIVE_PASSES; pass++)
+		{
+			FractalBlock _block;
+			{
+				STAGE_SPAN("create block", block);
+				_block = solver.CreatePass(block->offset.x, block->offset.y, pixelSize, pass);
+				_block.itterations = limit;
+			}
+			{
+				STAGE_SPAN("solve", block);
+				double solveStart = wallTime();
+				solver.Solve(_block);
+				solveTime += wallTime() - solveStart;
+			}
+			solver.MergePass(_block, pass, values);
+			solver.ReleaseBlock(_block);
+
+			if (pass < PROGRESSIVE_PASSES - 1) {
+				std::lock_guard<std::mutex> guard(partialLock);
+				block->values.pack(values, size * size);
+				block->itterations = limit;
+				block->passesSolved = pass + 1;
+			}
+		}
+		metrics.solveTime.record((long long)(solveTime * 1e6));
+	}
+	else
+	{
+		FractalBlock _block;
+		{
+			STAGE_SPAN("create block", block);
+			_block = solver.CreateBlock(block->offset.x, block->offset.y, pixelSize);
+			_block.itterations = limit;
+			// rows are stored top down, so this solves just the upper rows.
+			if (mirrorHalf)
+				_block.height = size / 2;
+		}
+		{
+			STAGE_SPAN("solve", block);
+			double solveStart = wallTime();
+			solver.Solve(_block);
+			metrics.solveTime.record((long long)((wallTime() - solveStart) * 1e6));
+		}
+		memcpy(values, _block.values_out, _block.width * _block.height * sizeof(int));
+		for (int y = _block.height; y < size; y++)
+			memcpy(values + y * size, values + (size - 1 - y) * size, size * sizeof(int));
+		solver.ReleaseBlock(_block);
+	}
+
+	long long total = 0;
+	for (int i = 0; i < size * size; i++)
+		total += values[i];
+	metrics.itterations += total;
+	metrics.tilesSolved++;
+
+	// escaped points have the same count at any limit, so if nothing reached the limit the
+	// result is already final.
+	bool saturated = std::any_of(values, values + size * size, [&](int value) { return value >= limit; });
+	if (!saturated)
+		limit = std::max(limit, targetLimit(block));
+
+	STAGE_SPAN("store", block);
+	if (cache && limit == targetLimit(block))
+		cache->store(getTileKey(block), values, size * size);
+
+	finishValues(block, values, limit);
+	delete[] values;
+
+	block->loaded = false;
+	block->finishedAt = wallTime();
+	block->status = rsRENDERED;
+	if (headless)
+		resolveMirrors(block);
 }
 
 /*
@@ -128,45 +597,48 @@ void RenderQueue::addJob(RenderBlock *block)
 void RenderQueue::processJob(RenderBlock *block)
 {
 	// OK, so just for new we will render on the spot :)	
-	auto _block = solver.CreateBlock(block->offset.x, block->offset.y, (1.0 / block->scale) / 64.0);
-	solver.Solve(_block);
+	solveBlock(block);
 
-	block->data = _block;
-
-	block->status = rsRENDERED;
+	int size = solver.getBlockSize();
 
 	// Map colors
-	auto colors = new uint8_t[64 * 64 * 3];
-	for (int i = 0; i < 64 * 64 * 3; i++)
-	{
-		colors[i] = 255 - block->data.values_out[i / 3] / 4;
-	}
+	auto colors = new uint8_t[size * size * 3];
+	colorBlock(block, colors);
+	block->paletteVersion = paletteVersion();
 
 	// Upload
-	TRACE("Upload " + block->toString());
-	block->texture = createTexture(64, 64, colors);
+	block->texture = createTexture(size, size, colors);
 
-	delete colors;
+	delete[] colors;
 
 	block->status = rsUPLOADED;
 }
 
-// Create a render que.
-RenderQueue::RenderQueue()
+// Create a render que with the given number of worker threads.
+RenderQueue::RenderQueue(int threads)
 {
 	solver = MandelbrotSolver();
 	jobQueue = std::vector<RenderBlock*>();
-	workThread = std::thread(processJobList, this);			
+	threadCount = threads;
+	pipes = new RenderPipe[threadCount];
 
 	// start the threads.
-	for (int i = 0; i < 4; i++)
+	for (int i = 0; i < threadCount; i++)
 	{
-		pipe[i].id = i + 1;
-		pipe[i].thread = std::thread(threaded_processJob, &pipe[i], &solver);
+		pipes[i].id = i + 1;
+		pipes[i].job = NULL;
+		pipes[i].thread = std::thread(threaded_processJob, &pipes[i], this);
 	}
+
+	workThread = std::thread(processJobList, this);
 }
 
 RenderQueue::~RenderQueue()
 {
+	stopping = true;
+	notifyFinished();
 	workThread.join();	
+	for (int i = 0; i < threadCount; i++)
+		pipes[i].thread.join();
+	delete[] pipes;
 }
\ No newline at end of file
@@ -2,13 +2,18 @@
 
 #include "Mandel.h"
 #include "RenderBlock.h"
+#include "TileCache.h"
+#include "Compositor.h"
 #include <vector>
 #include <thread>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
 
 struct RenderPipe
 {
 	int id;
-	RenderBlock *job;
+	std::atomic<RenderBlock*> job;
 	std::thread thread;
 };
 
@@ -18,17 +23,121 @@ private:
 	
 	std::thread workThread;
 
+	// One pipe per worker thread.
+	RenderPipe *pipes;
+	int threadCount;
+
+	// Blocks filled from their mirror that are waiting to be uploaded.
+	std::vector<RenderBlock*> loadedBlocks;
+
+	void uploadBlock(RenderBlock *block);
+	void uploadPartial(RenderBlock *block);
+	void updateTexture(RenderBlock *block);
+	void finishValues(RenderBlock *block, const int *values, int limit);
+
+	// Guards the values of blocks that are being solved progressively.
+	std::mutex partialLock;
+
+	// Blocks waiting for their mirror source to be solved, guarded by queueLock.
+	std::vector<RenderBlock*> mirrorWaiting;
+
+	int nextLimit(RenderBlock *block);
+	void finishMirror(RenderBlock *block);
+	void resolveMirrors(RenderBlock *source);
+
+	// Signalled whenever a headless job finishes.
+	std::mutex finishedLock;
+	std::condition_variable finished;
+
 public:
 	// how do I make these private and have a seperate thread excute?
 	MandelbrotSolver solver;
+	// Set when the queue is being destroyed, worker threads exit once they see it.
+	std::atomic<bool> stopping{ false };
 	std::vector<RenderBlock*> jobQueue;
+	// Guards jobQueue, which is filled by addJob and drained by the distribution thread.
+	std::mutex queueLock;
+	// Headless queues have no texture uploads, blocks are finished as soon as they are solved.
+	bool headless = false;
+	// Solve blocks in interlaced passes and show each pass as it finishes (not for headless queues).
+	bool progressive = false;
+	// Keep block colors in memory as texels for the Compositor rather than uploading them as
+	// GL textures, for displays without a GPU.
+	bool software = false;
+	// Blocks uploaded so far, for noticing that new results have arrived.  Only used on the main
+	// thread.
+	int uploads = 0;
+	// Build a histogram of each block's values for histogram equalised coloring.
+	bool histograms = false;
+	// Colors textures when set and built, otherwise the linear ramp is used.  Only used on the
+	// main thread.
+	HistogramPalette *palette = NULL;
+	// Itteration limit for a block's first solve, 0 to always use the solver's.  Blocks solved
+	// with a lower limit are worked up to the full one by RenderGrid::deepen.
+	int previewItterations = 0;
+	// Itteration count the linear ramp runs up to, 0 for the solver's limit.  Grids with
+	// adaptive limits set this to the top of their range so deeper counts still get a shade.
+	int colorLimit = 0;
+	// Optional persistent cache, solved blocks are written to it and looked up before solving.
+	TileCache *cache = NULL;
 	void processJob(RenderBlock *block);
 
+	// Solves block on the calling thread without creating a texture.
+	void solveBlock(RenderBlock *block);
+
+	// Fills block from the tile cache on the calling thread.  Workers try this before solving.
+	bool loadBlock(RenderBlock *block);
+	TileKey getTileKey(RenderBlock *block);
+
+	// Blocks until a headless job has been solved.
+	void waitFor(RenderBlock *block);
+	void notifyFinished();
+
 	void process();
 
 	void update();
 
 	void addJob(RenderBlock *job);
-	RenderQueue();
+
+	// Fills block from source, its mirror image across the real axis, instead of solving it.  If
+	// source is still being solved block waits for it.  Returns false if source has nothing
+	// block can use, the block should be queued as normal then.
+	bool addMirror(RenderBlock *block, RenderBlock *source);
+
+	// Writes source's values into block flipped top to bottom.
+	void copyMirror(RenderBlock *block, RenderBlock *source);
+
+	// Removes the job with the highest priority from jobQueue, or returns NULL if there is none
+	// that may be started.  Must be called with queueLock held.
+	RenderBlock *takeJob();
+
+	// Takes all speculative and deepening jobs that have not been started out of the queue, they
+	// go back to what they had before being queued.  Returns the number removed.
+	int cancelSpeculative();
+
+	// True while the queue holds on to block, i.e. it is queued, being solved or waiting for upload.
+	bool isBusy(RenderBlock *block);
+
+	// Colors block's values with the current palette, 3 bytes per point.
+	void colorBlock(RenderBlock *block, uint8_t *colors);
+
+	// Colors block's texture again with the current palette.
+	void recolor(RenderBlock *block) { updateTexture(block); }
+	// Version of the palette textures are colored with now, 0 for the linear ramp.
+	int paletteVersion() { return palette ? palette->version : 0; }
+
+	// Itteration limit block is worked up to.
+	int targetLimit(RenderBlock *block);
+	// Itteration count the linear ramp is scaled to, see colorLimit.
+	int rampLimit() { return colorLimit > 0 ? colorLimit : solver.getItterations(); }
+
+	// True if there are no jobs queued, being solved or waiting for upload.
+	bool isIdle();
+
+	// Returns a pipe that has no job, or NULL if all are busy.
+	RenderPipe *getFreePipe();
+	int getThreadCount() { return threadCount; }
+
+	RenderQueue(int threads = 4);
 	~RenderQueue();
 };
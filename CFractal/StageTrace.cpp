@@ -0,0 +1,125 @@
+//
+// Per thread stage tracing, exported as Chrome trace JSON.
+//
+// Date: 2016/08/01
+//
+
+#include "stdafx.h"
+#include "StageTrace.h"
+#include "RenderBlock.h"
+#include <vector>
+#include <mutex>
+#include <thread>
+
+namespace StageTrace
+{
+	// Events kept per thread, once full the oldest are overwritten.
+	const size_t BUFFER_EVENTS = 1 << 14;
+
+	struct ThreadBuffer
+	{
+		int threadId;
+		// Total events ever written, only the owning thread changes this.
+		std::atomic<size_t> written{ 0 };
+		// Set by the owning thread while it writes an event, so save can wait for it.
+		std::atomic<bool> writing{ false };
+		Event events[BUFFER_EVENTS];
+	};
+
+	std::atomic<bool> recording{ false };
+
+	// Every buffer ever created.  Buffers are never freed so events from threads that have
+	// finished are still saved.  The lock is only taken when a thread records its first event.
+	static std::vector<ThreadBuffer*> buffers;
+	static std::mutex buffersLock;
+
+	static thread_local ThreadBuffer *threadBuffer = NULL;
+
+	static ThreadBuffer *getThreadBuffer()
+	{
+		if (!threadBuffer) {
+			threadBuffer = new ThreadBuffer();
+			std::lock_guard<std::mutex> guard(buffersLock);
+			threadBuffer->threadId = (int)buffers.size() + 1;
+			buffers.push_back(threadBuffer);
+		}
+		return threadBuffer;
+	}
+
+	void start()
+	{
+		recording = true;
+	}
+
+	void stop()
+	{
+		recording = false;
+	}
+
+	void addSpan(const char *name, RenderBlock *block, double startTime, double endTime)
+	{
+		auto buffer = getThreadBuffer();
+
+		// recording is checked again after writing is set, either save sees writing and waits
+		// for the event or this sees recording is off.
+		buffer->writing = true;
+		if (!recording) {
+			buffer->writing = false;
+			return;
+		}
+		size_t index = buffer->written.load(std::memory_order_relaxed);
+		auto &event = buffer->events[index % BUFFER_EVENTS];
+		event.name = name;
+		event.start = startTime * 1e6;
+		event.duration = (endTime - startTime) * 1e6;
+		event.depth = block ? block->depth : -1;
+		event.tileX = block ? block->tileX : 0;
+		event.tileY = block ? block->tileY : 0;
+		buffer->written.store(index + 1, std::memory_order_release);
+		buffer->writing.store(false, std::memory_order_release);
+	}
+
+	bool save(string filename)
+	{
+		stop();
+
+		FILE *file;
+		if (fopen_s(&file, filename.c_str(), "w") != 0) {
+			TRACE("Could not write trace " + filename);
+			return false;
+		}
+
+		fprintf(file, "{\"traceEvents\": [\n");
+		bool first = true;
+		int count = 0;
+
+		std::lock_guard<std::mutex> guard(buffersLock);
+		for (auto buffer : buffers)
+		{
+			// no new events are started once recording is off, only one already being written
+			// can still change the buffer.
+			while (buffer->writing.load(std::memory_order_acquire))
+				std::this_thread::yield();
+
+			size_t written = buffer->written.load(std::memory_order_acquire);
+			size_t begin = written > BUFFER_EVENTS ? written - BUFFER_EVENTS : 0;
+			for (size_t i = begin; i < written; i++)
+			{
+				auto &event = buffer->events[i % BUFFER_EVENTS];
+				fprintf(file, "%s{\"name\": \"%s\", \"ph\": \"X\", \"pid\": 1, \"tid\": %d, \"ts\": %.3f, \"dur\": %.3f",
+					first ? "" : ",\n", event.name, buffer->threadId, event.start, event.duration);
+				if (event.depth >= 0)
+					fprintf(file, ", \"args\": {\"tile\": \"%d/%lld/%lld\"}", event.depth, event.tileX, event.tileY);
+				fprintf(file, "}");
+				first = false;
+				count++;
+			}
+		}
+
+		fprintf(file, "\n], \"displayTimeUnit\": \"ms\"}\n");
+		fclose(file);
+
+		TRACE("Wrote " + intToStr(count) + " trace events to " + filename);
+		return true;
+	}
+}
@@ -0,0 +1,75 @@
+#pragma once
+
+#include <string>
+#include <atomic>
+#include "helper.h"
+
+using std::string;
+
+class RenderBlock;
+
+// Timing of the render pipeline stages (queue wait, solve, colour, upload, draw) in Chrome's
+// trace event format, so a session can be inspected in chrome://tracing or Perfetto.
+//
+// Each thread writes to its own ring buffer so recording needs no locks.  Spans are attached
+// to the tile they worked on.  Building without STAGE_TRACING removes all instrumentation.
+namespace StageTrace
+{
+	struct Event
+	{
+		// Must be a string literal, only the pointer is kept.
+		const char *name;
+		// Microseconds (see wallTime).
+		double start;
+		double duration;
+		// Tile the work was for, depth is -1 if there is none.
+		int depth;
+		long long tileX;
+		long long tileY;
+	};
+
+	extern std::atomic<bool> recording;
+
+	void start();
+	void stop();
+
+	// Stops recording, waits for any span being written to finish and writes everything
+	// recorded so far.
+	bool save(string filename);
+
+	// Records a span between two wallTime() values.
+	void addSpan(const char *name, RenderBlock *block, double startTime, double endTime);
+
+	// Records the time from construction until destruction.
+	class Span
+	{
+	private:
+		const char *name;
+		RenderBlock *block;
+		double startTime;
+	public:
+		Span(const char *name, RenderBlock *block)
+		{
+			this->name = name;
+			this->block = block;
+			startTime = recording ? wallTime() : 0;
+		}
+		~Span()
+		{
+			if (startTime != 0 && recording)
+				addSpan(name, block, startTime, wallTime());
+		}
+	};
+}
+
+#ifdef STAGE_TRACING
+#define STAGE_CONCAT2(a, b) a##b
+#define STAGE_CONCAT(a, b) STAGE_CONCAT2(a, b)
+// Times the rest of the enclosing scope as stage name, for the given block (or NULL).
+#define STAGE_SPAN(name, block) StageTrace::Span STAGE_CONCAT(_stageSpan, __LINE__)(name, block)
+// Records a span whose start and end were measured elsewhere.
+#define STAGE_SPAN_AT(name, block, startTime, endTime) do { if (StageTrace::recording) StageTrace::addSpan(name, block, startTime, endTime); } while (0)
+#else
+#define STAGE_SPAN(name, block)
+#define STAGE_SPAN_AT(name, block, startTime, endTime) do { } while (0)
+#endif
@@ -0,0 +1,326 @@
+//
+// Persistent on disk cache of solved tiles.
+//
+// Date: 2016/07/25
+//
+
+#include "stdafx.h"
+#include "TileCache.h"
+#include "helper.h"
+
+const uint32_t INDEX_MAGIC = 0x58444943;	// "CIDX"
+const uint32_t INDEX_VERSION = 4;	// 3: points are sampled at pixel centres, 4: keys hold the solver settings.
+const uint32_t RECORD_MAGIC = 0x454C4954;	// "TILE"
+const uint64_t INITIAL_CAPACITY = 1 << 16;
+
+// Header written in front of every tile in a segment, so segments can be read without the index.
+struct TileRecordHeader
+{
+	uint32_t magic;
+	uint32_t count;
+	uint32_t length;
+	uint32_t reserved;
+	TileKey key;
+};
+
+// Hashes a tile key (FNV-1a over each field).
+static uint64_t hashKey(TileKey key)
+{
+	uint64_t hash = 14695981039346656037ULL;
+	long long fields[7] = { key.formula, key.itterations, key.depth, key.tileSize, key.solverSettings, key.tileX, key.tileY };
+	for (int i = 0; i < 7; i++)
+		for (int b = 0; b < 8; b++)
+		{
+			hash ^= (fields[i] >> (b * 8)) & 0xff;
+			hash *= 1099511628211ULL;
+		}
+	return hash;
+}
+
+///  ------------------------------------------------------------------
+///  Run length encoding
+///  ------------------------------------------------------------------
+
+static void putVarint(std::vector<uint8_t> &buffer, uint32_t value)
+{
+	while (value >= 0x80)
+	{
+		buffer.push_back((uint8_t)(value | 0x80));
+		value >>= 7;
+	}
+	buffer.push_back((uint8_t)value);
+}
+
+static bool getVarint(const uint8_t *&data, const uint8_t *end, uint32_t &value)
+{
+	value = 0;
+	for (int shift = 0; data < end && shift < 35; shift += 7)
+	{
+		uint8_t byte = *data++;
+		value |= (uint32_t)(byte & 0x7f) << shift;
+		if (!(byte & 0x80))
+			return true;
+	}
+	return false;
+}
+
+// Encodes values as (value, run length) pairs.  Large areas inside and well outside the set
+// are a single value so this works very well on typical tiles.
+static std::vector<uint8_t> encodeRuns(const int *values, int count)
+{
+	std::vector<uint8_t> buffer;
+	int i = 0;
+	while (i < count)
+	{
+		int run = 1;
+		while (i + run < count && values[i + run] == values[i])
+			run++;
+		putVarint(buffer, values[i]);
+		putVarint(buffer, run);
+		i += run;
+	}
+	return buffer;
+}
+
+static bool decodeRuns(const uint8_t *data, int length, int *values, int count)
+{
+	const uint8_t *end = data + length;
+	int i = 0;
+	while (data < end)
+	{
+		uint32_t value, run;
+		if (!getVarint(data, end, value) || !getVarint(data, end, run) || i + (int)run > count)
+			return false;
+		for (uint32_t j = 0; j < run; j++)
+			values[i++] = value;
+	}
+	return i == count;
+}
+
+///  ------------------------------------------------------------------
+///  TileCache
+///  ------------------------------------------------------------------
+
+string TileCache::segmentName(int segment)
+{
+	char buffer[32];
+	sprintf_s(buffer, "/segment%04d.dat", segment);
+	return directory + buffer;
+}
+
+// Maps the index file, creating an empty index with the given capacity if the file is missing
+// or not a valid index.
+bool TileCache::mapIndex(string filename, uint64_t capacity)
+{
+	indexFile = CreateFileA(filename.c_str(), GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ, NULL, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (indexFile == INVALID_HANDLE_VALUE)
+		return false;
+
+	// use the existing index if it looks valid.
+	LARGE_INTEGER size;
+	GetFileSizeEx(indexFile, &size);
+	bool existing = false;
+	if (size.QuadPart >= (long long)sizeof(TileIndexHeader))
+	{
+		TileIndexHeader existingHeader;
+		DWORD read = 0;
+		ReadFile(indexFile, &existingHeader, sizeof(existingHeader), &read, NULL);
+		if (read == sizeof(existingHeader) && existingHeader.magic == INDEX_MAGIC && existingHeader.version == INDEX_VERSION &&
+			size.QuadPart == (long long)(sizeof(TileIndexHeader) + existingHeader.capacity * sizeof(TileIndexEntry))) {
+			capacity = existingHeader.capacity;
+			existing = true;
+		}
+	}
+
+	LARGE_INTEGER mappedSize;
+	mappedSize.QuadPart = sizeof(TileIndexHeader) + capacity * sizeof(TileIndexEntry);
+	indexMapping = CreateFileMappingA(indexFile, NULL, PAGE_READWRITE, mappedSize.HighPart, mappedSize.LowPart, NULL);
+	if (!indexMapping)
+		return false;
+
+	header = (TileIndexHeader*)MapViewOfFile(indexMapping, FILE_MAP_ALL_ACCESS, 0, 0, (size_t)mappedSize.QuadPart);
+	if (!header)
+		return false;
+	entries = (TileIndexEntry*)(header + 1);
+
+	if (!existing)
+	{
+		memset(header, 0, (size_t)mappedSize.QuadPart);
+		header->magic = INDEX_MAGIC;
+		header->version = INDEX_VERSION;
+		header->capacity = capacity;
+	}
+	return true;
+}
+
+void TileCache::unmapIndex()
+{
+	if (header) {
+		FlushViewOfFile(header, 0);
+		UnmapViewOfFile(header);
+	}
+	if (indexMapping)
+		CloseHandle(indexMapping);
+	if (indexFile != INVALID_HANDLE_VALUE)
+		CloseHandle(indexFile);
+	header = NULL;
+	entries = NULL;
+	indexMapping = NULL;
+	indexFile = INVALID_HANDLE_VALUE;
+}
+
+// Doubles the size of the index.  The new index is built alongside the old one and then
+// swapped in, so the cache is never left without a valid index.
+bool TileCache::growIndex()
+{
+	string filename = directory + "/index.dat";
+	string tempFilename = directory + "/index.tmp";
+
+	auto oldHeader = header;
+	auto oldEntries = entries;
+	auto oldFile = indexFile;
+	auto oldMapping = indexMapping;
+
+	DeleteFileA(tempFilename.c_str());
+	if (!mapIndex(tempFilename, oldHeader->capacity * 2)) {
+		TRACE("Could not grow tile cache index.");
+		unmapIndex();
+		header = oldHeader; entries = oldEntries; indexFile = oldFile; indexMapping = oldMapping;
+		return false;
+	}
+
+	for (uint64_t i = 0; i < oldHeader->capacity; i++)
+		if (oldEntries[i].used) {
+			*findSlot(oldEntries[i].key) = oldEntries[i];
+			header->count++;
+		}
+	unmapIndex();
+
+	header = oldHeader; entries = oldEntries; indexFile = oldFile; indexMapping = oldMapping;
+	unmapIndex();
+
+	MoveFileExA(tempFilename.c_str(), filename.c_str(), MOVEFILE_REPLACE_EXISTING);
+	return mapIndex(filename, INITIAL_CAPACITY);
+}
+
+// Returns the slot holding key, or the empty slot it would be placed in.
+TileIndexEntry *TileCache::findSlot(TileKey key)
+{
+	uint64_t mask = header->capacity - 1;
+	uint64_t slot = hashKey(key) & mask;
+	while (entries[slot].used && !(entries[slot].key == key))
+		slot = (slot + 1) & mask;
+	return &entries[slot];
+}
+
+bool TileCache::open(string directory)
+{
+	std::lock_guard<std::mutex> guard(lock);
+
+	this->directory = directory;
+	CreateDirectoryA(directory.c_str(), NULL);
+
+	if (!mapIndex(directory + "/index.dat", INITIAL_CAPACITY)) {
+		TRACE("Could not open tile cache index in " + directory);
+		unmapIndex();
+		return false;
+	}
+
+	// open every existing segment, new tiles are appended to the last one.
+	FILE *segment = NULL;
+	while (fopen_s(&segment, segmentName((int)segments.size()).c_str(), "rb") == 0 && segment)
+	{
+		fclose(segment);
+		segment = NULL;
+		if (fopen_s(&segment, segmentName((int)segments.size()).c_str(), "a+b") != 0 || !segment)
+			break;
+		segments.push_back(segment);
+		segment = NULL;
+	}
+
+	TRACE("Tile cache opened with " + intToStr((int)header->count) + " tiles in " + intToStr((int)segments.size()) + " segments.");
+	return true;
+}
+
+void TileCache::close()
+{
+	std::lock_guard<std::mutex> guard(lock);
+	unmapIndex();
+	for (auto segment : segments)
+		fclose(segment);
+	segments.clear();
+}
+
+bool TileCache::load(TileKey key, int *values, int count)
+{
+	std::lock_guard<std::mutex> guard(lock);
+	if (!header)
+		return false;
+
+	auto slot = findSlot(key);
+	if (!slot->used || slot->count != (uint32_t)count || slot->segment >= segments.size()) {
+		misses++;
+		return false;
+	}
+
+	std::vector<uint8_t> buffer(slot->length);
+	FILE *segment = segments[slot->segment];
+	if (_fseeki64(segment, slot->offset, SEEK_SET) != 0 || fread(buffer.data(), 1, buffer.size(), segment) != buffer.size() ||
+		!decodeRuns(buffer.data(), (int)buffer.size(), values, count)) {
+		TRACE("Tile cache entry is damaged, it will be solved again.");
+		misses++;
+		return false;
+	}
+
+	hits++;
+	return true;
+}
+
+void TileCache::store(TileKey key, const int *values, int count)
+{
+	std::lock_guard<std::mutex> guard(lock);
+	if (!header)
+		return;
+
+	auto slot = findSlot(key);
+	if (slot->used)
+		return;
+
+	auto data = encodeRuns(values, count);
+
+	// move on to a new segment once the current one is full.
+	FILE *segment = segments.size() ? segments.back() : NULL;
+	if (segment) _fseeki64(segment, 0, SEEK_END);
+	if (!segment || _ftelli64(segment) >= segmentSize)
+	{
+		segment = NULL;
+		if (fopen_s(&segment, segmentName((int)segments.size()).c_str(), "a+b") != 0 || !segment)
+			return;
+		segments.push_back(segment);
+	}
+
+	TileRecordHeader record = {};
+	record.magic = RECORD_MAGIC;
+	record.count = count;
+	record.length = (uint32_t)data.size();
+	record.key = key;
+
+	_fseeki64(segment, 0, SEEK_END);
+	fwrite(&record, sizeof(record), 1, segment);
+	uint64_t offset = _ftelli64(segment);
+	if (fwrite(data.data(), 1, data.size(), segment) != data.size())
+		return;
+	fflush(segment);
+
+	// only publish the tile once its data is written.
+	slot->key = key;
+	slot->segment = (uint32_t)segments.size() - 1;
+	slot->offset = offset;
+	slot->length = (uint32_t)data.size();
+	slot->count = count;
+	slot->used = 1;
+	header->count++;
+
+	if (header->count * 10 > header->capacity * 7)
+		growIndex();
+}
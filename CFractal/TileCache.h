@@ -0,0 +1,94 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <mutex>
+#include <stdint.h>
+
+using std::string;
+
+// Identifies a solved tile.  Tiles are numbered from the top left of the grid's root node.
+struct TileKey
+{
+	int formula;
+	int itterations;
+	int depth;
+	// Width and height of the tile in pixels.
+	int tileSize;
+	// Solver settings that change the counts, see MandelbrotSolver::getResultSettings.
+	int solverSettings;
+	long long tileX;
+	long long tileY;
+
+	bool operator==(const TileKey &other) const {
+		return formula == other.formula && itterations == other.itterations && depth == other.depth && tileSize == other.tileSize &&
+			solverSettings == other.solverSettings && tileX == other.tileX && tileY == other.tileY;
+	}
+};
+
+// Slot in the on disk hash index.
+struct TileIndexEntry
+{
+	TileKey key;
+	// 0 = empty slot
+	uint32_t used;
+	uint32_t segment;
+	uint64_t offset;
+	uint32_t length;
+	uint32_t count;
+};
+
+// Header at the start of the index file.
+struct TileIndexHeader
+{
+	uint32_t magic;
+	uint32_t version;
+	uint64_t capacity;
+	uint64_t count;
+};
+
+// Persistent cache of solved tiles.
+//
+// Tile data is run length encoded and appended to segment files, which are never rewritten.
+// Tiles are found through an open addressing hash table kept in a memory mapped index file,
+// so opening the cache costs nothing and a lookup is a couple of page touches and one read.
+// The cache is safe to use from any thread.
+class TileCache
+{
+private:
+	string directory;
+	std::mutex lock;
+
+	HANDLE indexFile = INVALID_HANDLE_VALUE;
+	HANDLE indexMapping = NULL;
+	TileIndexHeader *header = NULL;
+	TileIndexEntry *entries = NULL;
+
+	// Open segment files, the last one is appended to.
+	std::vector<FILE*> segments;
+
+	bool mapIndex(string filename, uint64_t capacity);
+	void unmapIndex();
+	bool growIndex();
+	TileIndexEntry *findSlot(TileKey key);
+	string segmentName(int segment);
+
+public:
+	// Segments are closed and a new one started once they reach this size.
+	long long segmentSize = 256 * 1024 * 1024;
+
+	int hits = 0;
+	int misses = 0;
+
+	// Opens (creating if needed) the cache stored in the given directory.
+	bool open(string directory);
+	void close();
+
+	// Reads a tile into values (which must hold count entries).  Returns false if the tile is not cached.
+	bool load(TileKey key, int *values, int count);
+
+	// Adds a tile to the cache.  Tiles already present are left alone.
+	void store(TileKey key, const int *values, int count);
+
+	~TileCache() { close(); }
+};
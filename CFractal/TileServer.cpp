@@ -0,0 +1,356 @@
+//
+// Local XYZ tile server.
+//
+// Date: 2016/07/28
+//
+
+#include "stdafx.h"
+#include "TileServer.h"
+#include "ColorMap.h"
+#include "ImageWriter.h"
+#include <chrono>
+#include <iterator>
+
+#pragma comment(lib, "Ws2_32.lib")
+
+TileServer::TileServer(RenderGrid *grid)
+{
+	this->grid = grid;
+	for (int i = 0; i < LATENCY_BUCKETS; i++)
+		latency[i] = 0;
+}
+
+TileServer::~TileServer()
+{
+	stop();
+}
+
+bool TileServer::start(int port)
+{
+	WSADATA wsaData;
+	if (WSAStartup(MAKEWORD(2, 2), &wsaData) != 0) {
+		TRACE("Could not start winsock.");
+		return false;
+	}
+
+	listener = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+	if (listener == INVALID_SOCKET)
+		return false;
+
+	sockaddr_in address = {};
+	address.sin_family = AF_INET;
+	address.sin_port = htons(port);
+	address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+	if (bind(listener, (sockaddr*)&address, sizeof(address)) == SOCKET_ERROR || listen(listener, SOMAXCONN) == SOCKET_ERROR) {
+		TRACE("Could not listen on port " + intToStr(port));
+		closesocket(listener);
+		listener = INVALID_SOCKET;
+		return false;
+	}
+
+	stopping = false;
+	acceptThread = std::thread(&TileServer::acceptLoop, this);
+	TRACE("Tile server listening on http://127.0.0.1:" + intToStr(port) + "/");
+	return true;
+}
+
+void TileServer::stop()
+{
+	if (listener == INVALID_SOCKET)
+		return;
+
+	stopping = true;
+	closesocket(listener);
+	listener = INVALID_SOCKET;
+	acceptThread.join();
+
+	// kick out any clients and wait for their threads to finish.
+	{
+		std::lock_guard<std::mutex> guard(clientsLock);
+		for (auto client : clients)
+			shutdown(client, SD_BOTH);
+	}
+	while (activeConnections > 0)
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+
+	WSACleanup();
+}
+
+void TileServer::acceptLoop()
+{
+	while (!stopping)
+	{
+		SOCKET client = accept(listener, NULL, NULL);
+		if (client == INVALID_SOCKET)
+			continue;
+
+		{
+			std::lock_guard<std::mutex> guard(clientsLock);
+			clients.insert(client);
+		}
+		activeConnections++;
+		std::thread(&TileServer::handleConnection, this, client).detach();
+	}
+}
+
+// Reads requests from a (keep alive) connection until the client goes away.
+void TileServer::handleConnection(SOCKET client)
+{
+	string buffer;
+	char data[4096];
+	bool open = true;
+
+	while (open && !stopping)
+	{
+		size_t end;
+		while ((end = buffer.find("\r\n\r\n")) == string::npos)
+		{
+			int received = recv(client, data, sizeof(data), 0);
+			if (received <= 0 || buffer.size() > 65536) {
+				open = false;
+				break;
+			}
+			buffer.append(data, received);
+		}
+		if (!open)
+			break;
+
+		string request = buffer.substr(0, end);
+		buffer.erase(0, end + 4);
+
+		// GET <path> HTTP/1.1
+		size_t pathStart = request.find(' ');
+		size_t pathEnd = request.find(' ', pathStart + 1);
+		if (request.compare(0, 4, "GET ") != 0 || pathEnd == string::npos) {
+			sendResponse(client, 400, "text/plain", (const uint8_t*)"Bad request", 11);
+			break;
+		}
+
+		open = handleRequest(client, request.substr(pathStart + 1, pathEnd - pathStart - 1));
+		if (request.find("Connection: close") != string::npos)
+			open = false;
+	}
+
+	{
+		std::lock_guard<std::mutex> guard(clientsLock);
+		clients.erase(client);
+	}
+	closesocket(client);
+	activeConnections--;
+}
+
+// Answers a single request.  Returns false if the connection should be closed.
+bool TileServer::handleRequest(SOCKET client, string path)
+{
+	auto startTime = std::chrono::steady_clock::now();
+
+	if (path == "/stats") {
+		string stats = getStats();
+		return sendResponse(client, 200, "application/json", (const uint8_t*)stats.c_str(), stats.size());
+	}
+
+	int z, x, y;
+	char extension[8] = {};
+	if (sscanf_s(path.c_str(), "/%d/%d/%d.%3s", &z, &x, &y, extension, (unsigned)sizeof(extension)) != 4 || string(extension) != "png") {
+		errors++;
+		return sendResponse(client, 404, "text/plain", (const uint8_t*)"Not found", 9);
+	}
+
+	requests++;
+	std::vector<uint8_t> png;
+	if (!getTile(z, x, y, png)) {
+		errors++;
+		return sendResponse(client, 404, "text/plain", (const uint8_t*)"No such tile", 12);
+	}
+
+	bool result = sendResponse(client, 200, "image/png", png.data(), png.size());
+
+	auto microseconds = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - startTime).count();
+	int bucket = 0;
+	while (bucket < LATENCY_BUCKETS - 1 && (1LL << bucket) <= microseconds)
+		bucket++;
+	latency[bucket]++;
+
+	return result;
+}
+
+// Moves node to the front of the resident tiles, adding it if it is new.  Must be called with
+// gridLock held.
+TileServer::ResidentTile &TileServer::touch(RenderNode *node)
+{
+	auto found = residentIndex.find(node);
+	if (found != residentIndex.end())
+		resident.splice(resident.begin(), resident, found->second);
+	else {
+		resident.push_front({ node, 0 });
+		residentIndex[node] = resident.begin();
+	}
+	return resident.front();
+}
+
+// Drops the data of the least recently requested tiles until at most maxResidentTiles are left.
+// Tiles that are still being solved or waited on are skipped.  Must be called with gridLock held.
+void TileServer::evict()
+{
+	size_t checked = 0;
+	while (resident.size() > maxResidentTiles && checked < resident.size())
+	{
+		auto &tile = resident.back();
+		checked++;
+
+		auto block = tile.node->renderBlock;
+		if (tile.waiting > 0 || grid->renderQueue->isBusy(block)) {
+			resident.splice(resident.begin(), resident, std::prev(resident.end()));
+			continue;
+		}
+
+		block->release();
+		residentIndex.erase(tile.node);
+		resident.pop_back();
+		evicted++;
+	}
+}
+
+// Frees the nodes that evicted tiles left behind once the grid's garbage collection finds them
+// old enough.  Resident tiles are tapped first so they are always kept.  Must be called with
+// gridLock held.
+void TileServer::collect()
+{
+	grid->tickTime = wallTime();
+	if (grid->tickTime - collectedAt < grid->collectInterval)
+		return;
+	collectedAt = grid->tickTime;
+	for (auto &tile : resident)
+		tile.node->tap();
+	grid->garbageCollect();
+}
+
+// Finds, loads or solves a tile and encodes it as a PNG.  Returns false for tiles outside the grid.
+bool TileServer::getTile(int z, int x, int y, std::vector<uint8_t> &png)
+{
+	if (z < 0 || z > maxDepth || x < 0 || y < 0 || x >= (1 << z) || y >= (1 << z))
+		return false;
+
+	RenderQueue *queue = grid->renderQueue;
+	int blockSize = grid->blockSize;
+	std::vector<int> values(blockSize * blockSize);
+	RenderNode *node;
+	bool ready = false;
+	bool queued = false;
+	{
+		std::lock_guard<std::mutex> guard(gridLock);
+
+		collect();
+		node = grid->getTile(x, y, z);
+		touch(node).waiting++;
+		auto block = node->renderBlock;
+
+		switch (block->status) {
+		case rsEMPTY:
+			// first request for this tile, the worker checks the disk before solving it.
+			grid->queueBlock(node);
+			queued = true;
+			break;
+		case rsINQUE:
+		case rsRENDERING:
+			// someone else has already asked for this tile, share their result.
+			shared++;
+			break;
+		default:
+			memoryHits++;
+		}
+
+		if (block->status == rsRENDERED) {
+			block->values.unpack(values.data());
+			ready = true;
+		}
+		evict();
+	}
+
+	if (!ready) {
+		queue->waitFor(node->renderBlock);
+		std::lock_guard<std::mutex> guard(gridLock);
+		ready = node->renderBlock->status == rsRENDERED;
+		if (ready)
+			node->renderBlock->values.unpack(values.data());
+		if (ready && queued) {
+			if (node->renderBlock->loaded)
+				diskHits++;
+			else
+				solved++;
+		}
+	}
+
+	{
+		std::lock_guard<std::mutex> guard(gridLock);
+		residentIndex[node]->waiting--;
+	}
+	if (!ready)
+		return false;
+
+	auto colors = new uint8_t[blockSize * blockSize * 3];
+	mapColors(values.data(), blockSize * blockSize, queue->rampLimit(), colors);
+	png = encodePNG(blockSize, blockSize, colors);
+	delete[] colors;
+	return true;
+}
+
+bool TileServer::sendResponse(SOCKET client, int status, string contentType, const uint8_t *data, size_t length)
+{
+	char header[256];
+	sprintf_s(header, "HTTP/1.1 %d %s\r\nContent-Type: %s\r\nContent-Length: %d\r\nAccess-Control-Allow-Origin: *\r\n\r\n",
+		status, status == 200 ? "OK" : (status == 404 ? "Not Found" : "Bad Request"), contentType.c_str(), (int)length);
+
+	string response = header;
+	response.append((const char*)data, length);
+
+	size_t sent = 0;
+	while (sent < response.size())
+	{
+		int result = send(client, response.c_str() + sent, (int)(response.size() - sent), 0);
+		if (result <= 0)
+			return false;
+		sent += result;
+	}
+	return true;
+}
+
+// Returns the latency in milliseconds below which the given fraction of requests completed.
+// Resolution is limited to the power of two histogram buckets.
+double TileServer::latencyPercentile(double fraction)
+{
+	long long total = 0;
+	for (int i = 0; i < LATENCY_BUCKETS; i++)
+		total += latency[i];
+	if (total == 0)
+		return 0;
+
+	long long count = 0;
+	for (int i = 0; i < LATENCY_BUCKETS; i++)
+	{
+		count += latency[i];
+		if (count >= total * fraction)
+			return (1LL << i) / 1000.0;
+	}
+	return (1LL << (LATENCY_BUCKETS - 1)) / 1000.0;
+}
+
+string TileServer::getStats()
+{
+	long long hits = memoryHits + diskHits + shared;
+	double hitRate = requests > 0 ? (double)hits / requests : 0;
+
+	size_t residentTiles;
+	{
+		std::lock_guard<std::mutex> guard(gridLock);
+		residentTiles = resident.size();
+	}
+
+	char buffer[512];
+	sprintf_s(buffer, "{\"requests\": %lld, \"memoryHits\": %lld, \"diskHits\": %lld, \"shared\": %lld, \"solved\": %lld, \"errors\": %lld, "
+		"\"residentTiles\": %lld, \"evicted\": %lld, \"hitRate\": %.4f, \"latencyMs\": {\"p50\": %.3f, \"p95\": %.3f, \"p99\": %.3f}}\n",
+		(long long)requests, (long long)memoryHits, (long long)diskHits, (long long)shared, (long long)solved, (long long)errors,
+		(long long)residentTiles, (long long)evicted, hitRate, latencyPercentile(0.5), latencyPercentile(0.95), latencyPercentile(0.99));
+	return buffer;
+}
@@ -0,0 +1,92 @@
+#pragma once
+
+#include <winsock2.h>
+#include <string>
+#include <vector>
+#include <set>
+#include <list>
+#include <unordered_map>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include "RenderGrid.h"
+
+using std::string;
+
+// Serves grid tiles over HTTP as /z/x/y.png so the fractal can be browsed with a slippy map
+// viewer (tiles are blockSize pixels square, z is the grid depth).
+//
+// The server only listens on the loopback interface.  Requests for the same tile share a single
+// solve, tiles already in the grid or the tile cache are served without solving.  Cache reads and
+// solves both happen on the render queue's worker threads.  Counters are available from /stats as JSON.
+//
+// Memory is bounded: the data of the least recently requested tiles is dropped once more than
+// maxResidentTiles are held, and the grid's garbage collection frees the nodes they leave behind.
+class TileServer
+{
+private:
+	RenderGrid *grid;
+
+	SOCKET listener = INVALID_SOCKET;
+	std::thread acceptThread;
+	std::atomic<bool> stopping{ false };
+
+	// Open client connections, so they can be closed when the server stops.
+	std::set<SOCKET> clients;
+	std::mutex clientsLock;
+	std::atomic<int> activeConnections{ 0 };
+
+	// The grid is not thread safe, all access to the tree goes through this lock.
+	std::mutex gridLock;
+
+	std::atomic<long long> requests{ 0 };
+	std::atomic<long long> memoryHits{ 0 };
+	std::atomic<long long> diskHits{ 0 };
+	std::atomic<long long> solved{ 0 };
+	std::atomic<long long> shared{ 0 };
+	std::atomic<long long> errors{ 0 };
+	std::atomic<long long> evicted{ 0 };
+
+	// Tiles that hold data, most recently requested first.  Tiles that requests are waiting on
+	// are never evicted.  Guarded by gridLock.
+	struct ResidentTile
+	{
+		RenderNode *node;
+		int waiting;
+	};
+	std::list<ResidentTile> resident;
+	std::unordered_map<RenderNode*, std::list<ResidentTile>::iterator> residentIndex;
+
+	double collectedAt = 0;
+
+	ResidentTile &touch(RenderNode *node);
+	void evict();
+	void collect();
+
+	// Latency histogram, bucket i counts requests that took less than 2^i microseconds.
+	static const int LATENCY_BUCKETS = 32;
+	std::atomic<long long> latency[LATENCY_BUCKETS];
+
+	void acceptLoop();
+	void handleConnection(SOCKET client);
+	bool handleRequest(SOCKET client, string path);
+	bool getTile(int z, int x, int y, std::vector<uint8_t> &png);
+	bool sendResponse(SOCKET client, int status, string contentType, const uint8_t *data, size_t length);
+	double latencyPercentile(double fraction);
+
+public:
+	// Deepest z served, requests below it are answered with a 404.
+	int maxDepth = 24;
+	// Most tiles kept in memory.
+	size_t maxResidentTiles = 4096;
+
+	TileServer(RenderGrid *grid);
+	~TileServer();
+
+	// Starts listening on 127.0.0.1:port.  Returns false if the port could not be opened.
+	bool start(int port);
+	void stop();
+
+	// Returns the server counters as a JSON object.
+	string getStats();
+};
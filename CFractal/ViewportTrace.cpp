@@ -0,0 +1,278 @@
+//
+// Recording and headless replay of viewport movement.
+//
+// Date: 2016/07/31
+//
+
+#include "stdafx.h"
+#include "ViewportTrace.h"
+#include "Metrics.h"
+#include <algorithm>
+#include <thread>
+#include <chrono>
+#include <math.h>
+
+///  ------------------------------------------------------------------
+///  ViewportTrace
+///  ------------------------------------------------------------------
+
+bool ViewportTrace::load(string filename)
+{
+	FILE *file;
+	if (fopen_s(&file, filename.c_str(), "r") != 0) {
+		TRACE("Could not open trace " + filename);
+		return false;
+	}
+
+	samples.clear();
+	double width, height;
+	if (fscanf_s(file, "size %lf %lf", &width, &height) == 2)
+		size = Vector2d(width, height);
+
+	Sample sample;
+	while (fscanf_s(file, "%lf %lf %lf %lf", &sample.time, &sample.offset.x, &sample.offset.y, &sample.scale) == 4)
+		samples.push_back(sample);
+
+	fclose(file);
+
+	if (samples.empty()) {
+		TRACE("Trace " + filename + " is empty.");
+		return false;
+	}
+	return true;
+}
+
+bool ViewportTrace::startRecording(string filename, Vector2d size)
+{
+	if (fopen_s(&recordFile, filename.c_str(), "w") != 0) {
+		TRACE("Could not write trace " + filename);
+		recordFile = NULL;
+		return false;
+	}
+	this->size = size;
+	fprintf(recordFile, "size %d %d\n", (int)size.x, (int)size.y);
+	recordStart = wallTime();
+	lastScale = 0;
+	return true;
+}
+
+void ViewportTrace::record(Viewport *viewport)
+{
+	if (!recordFile)
+		return;
+	if (viewport->offset.x == lastOffset.x && viewport->offset.y == lastOffset.y && viewport->scale == lastScale)
+		return;
+
+	lastOffset = viewport->offset;
+	lastScale = viewport->scale;
+	fprintf(recordFile, "%.4f %.17g %.17g %.17g\n", wallTime() - recordStart, lastOffset.x, lastOffset.y, lastScale);
+
+	// the viewer is normally closed by killing the window, so don't leave anything buffered.
+	fflush(recordFile);
+}
+
+void ViewportTrace::stopRecording()
+{
+	if (recordFile)
+		fclose(recordFile);
+	recordFile = NULL;
+}
+
+const ViewportTrace::Sample &ViewportTrace::sampleAt(double time)
+{
+	size_t i = 0;
+	while (i + 1 < samples.size() && samples[i + 1].time <= time)
+		i++;
+	return samples[i];
+}
+
+///  ------------------------------------------------------------------
+///  TraceReplay
+///  ------------------------------------------------------------------
+
+TraceReplay::TraceReplay(int tileSize)
+{
+	grid = new RenderGrid(&viewport, 4, tileSize);
+	grid->renderQueue->headless = true;
+}
+
+TraceReplay::~TraceReplay()
+{
+	delete grid;
+}
+
+static bool hasData(RenderBlock *block)
+{
+	return block && (block->status == rsRENDERED || block->status == rsUPLOADED);
+}
+
+// Works out how much of the screen would be drawn at full detail, from a parent tile or not
+// at all if the grid were drawn at the given depth.
+FrameCoverage TraceReplay::measureFrame(int depth)
+{
+	FrameCoverage coverage;
+
+	// visible area in fractal space, limited to the area covered by the grid.
+	auto topLeft = viewport.toViewport(Vector2d(0, 0));
+	auto bottomRight = viewport.toViewport(viewport.size);
+	double left = std::max(topLeft.x / 16.0, -4.0);
+	double top = std::max(topLeft.y / 16.0, -4.0);
+	double right = std::min(bottomRight.x / 16.0, 4.0);
+	double bottom = std::min(bottomRight.y / 16.0, 4.0);
+	if (left >= right || top >= bottom)
+		return coverage;
+
+	double size = 8.0 / pow(2, depth);
+	int x1 = (int)floor((left + 4.0) / size);
+	int y1 = (int)floor((top + 4.0) / size);
+	int x2 = (int)ceil((right + 4.0) / size);
+	int y2 = (int)ceil((bottom + 4.0) / size);
+
+	double total = 0;
+	for (int y = y1; y < y2; y++)
+		for (int x = x1; x < x2; x++)
+		{
+			double tileLeft = x * size - 4.0;
+			double tileTop = y * size - 4.0;
+			double area = (std::min(tileLeft + size, right) - std::max(tileLeft, left)) * (std::min(tileTop + size, bottom) - std::max(tileTop, top));
+			auto center = Vector2d(tileLeft + size / 2, tileTop + size / 2);
+
+			// find the tile, remembering the deepest ancestor that could stand in for it.
+			RenderNode *node = grid->root;
+			RenderNode *best = NULL;
+			while (true)
+			{
+				if (hasData(node->renderBlock))
+					best = node;
+				if (node->depth == depth)
+					break;
+				auto child = node->child(center.x < node->center.x ? 0 : 1, center.y < node->center.y ? 0 : 1);
+				if (!child)
+					break;
+				node = child;
+			}
+
+			if (best && best->depth == depth)
+				coverage.detail += area;
+			else if (best)
+				coverage.fallback += area;
+			else
+				coverage.missing += area;
+			if (best)
+				shown.insert(best->renderBlock);
+			total += area;
+		}
+
+	coverage.detail /= total;
+	coverage.fallback /= total;
+	coverage.missing /= total;
+	return coverage;
+}
+
+// Counts the solved blocks under node, and those that were never on screen after being solved.
+void TraceReplay::countSolved(RenderNode *node, int &solved, int &wasted)
+{
+	if (!node)
+		return;
+	if (node->renderBlock->finishedAt > 0) {
+		solved++;
+		if (!shown.count(node->renderBlock))
+			wasted++;
+	}
+	for (int u = 0; u < 2; u++)
+		for (int v = 0; v < 2; v++)
+			countSolved(node->child(u, v), solved, wasted);
+}
+
+void TraceReplay::run(ViewportTrace &trace)
+{
+	viewport.size = trace.size;
+	double endTime = trace.samples.back().time;
+
+	int frames = 0;
+	double fallbackTotal = 0;
+	double missingTotal = 0;
+	double fallbackWorst = 0;
+
+	// time to full detail after each viewport change.
+	std::vector<double> settleTimes;
+	int neverSettled = 0;
+	bool settling = false;
+	double lastChange = 0;
+	const ViewportTrace::Sample *current = NULL;
+
+	FILE *log = NULL;
+	if (!frameLog.empty()) {
+		if (fopen_s(&log, frameLog.c_str(), "w") == 0)
+			fprintf(log, "time,detail,fallback,missing\n");
+		else
+			log = NULL;
+	}
+
+	long long cancelledBefore = metrics.prefetchCancelled;
+	double startTime = wallTime();
+	double t = 0;
+	while (t <= endTime || (settling && t < endTime + settleTimeout))
+	{
+		auto &sample = trace.sampleAt(t);
+		if (&sample != current) {
+			current = &sample;
+			viewport.offset = sample.offset;
+			viewport.scale = sample.scale;
+			if (settling)
+				neverSettled++;
+			settling = true;
+			lastChange = t;
+		}
+
+		// same steps as drawFractalGrid, without the drawing.
+		int layer = grid->layerForScale(viewport.scale);
+		grid->prepare(layer);
+		auto coverage = measureFrame(layer < 1 ? 1 : layer);
+
+		frames++;
+		fallbackTotal += coverage.fallback;
+		missingTotal += coverage.missing;
+		fallbackWorst = std::max(fallbackWorst, coverage.fallback + coverage.missing);
+		if (log)
+			fprintf(log, "%.4f,%.4f,%.4f,%.4f\n", t, coverage.detail, coverage.fallback, coverage.missing);
+
+		if (settling && coverage.fallback == 0 && coverage.missing == 0) {
+			settleTimes.push_back(t - lastChange);
+			settling = false;
+		}
+
+		std::this_thread::sleep_for(std::chrono::microseconds((long long)(frameTime * 1e6)));
+		t = wallTime() - startTime;
+	}
+	if (settling)
+		neverSettled++;
+	if (log)
+		fclose(log);
+
+	int solved = 0;
+	int wasted = 0;
+	countSolved(grid->root, solved, wasted);
+	// speculative jobs taken back out of the queue before they were solved.
+	long long cancelled = metrics.prefetchCancelled - cancelledBefore;
+
+	int queued;
+	{
+		std::lock_guard<std::mutex> guard(grid->renderQueue->queueLock);
+		queued = (int)grid->renderQueue->jobQueue.size();
+	}
+
+	std::sort(settleTimes.begin(), settleTimes.end());
+	double settleMean = 0;
+	for (auto time : settleTimes)
+		settleMean += time;
+	if (!settleTimes.empty())
+		settleMean /= settleTimes.size();
+
+	TRACE("Replayed " + intToStr(frames) + " frames over " + floatToStr(t) + " seconds.");
+	TRACE("Time to full detail: mean " + floatToStr(settleMean) + "s, worst " + floatToStr(settleTimes.empty() ? 0 : settleTimes.back()) +
+		"s, " + intToStr(neverSettled) + " of " + intToStr((int)trace.samples.size()) + " moves never reached full detail.");
+	TRACE("Screen on fallback tiles: mean " + floatToStr(fallbackTotal / frames * 100) + "%, missing " + floatToStr(missingTotal / frames * 100) +
+		"%, worst frame " + floatToStr(fallbackWorst * 100) + "%.");
+	TRACE("Solves: " + intToStr(solved) + ", never on screen " + intToStr(wasted) + ", cancelled " + intToStr((int)cancelled) + ", still queued " + intToStr(queued) + ".");
+}
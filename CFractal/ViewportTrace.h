@@ -0,0 +1,87 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <set>
+#include "helper.h"
+#include "RenderGrid.h"
+
+using std::string;
+
+// A recorded path of the viewport over time, used to replay an interactive session.
+//
+// Traces are text files, a "size <width> <height>" line followed by one
+// "<seconds> <offset x> <offset y> <scale>" line each time the viewport changed.
+class ViewportTrace
+{
+private:
+	FILE *recordFile = NULL;
+	double recordStart = 0;
+	Vector2d lastOffset;
+	double lastScale = 0;
+
+public:
+	struct Sample
+	{
+		double time;
+		Vector2d offset;
+		double scale;
+	};
+
+	Vector2d size;
+	std::vector<Sample> samples;
+
+	bool load(string filename);
+
+	// Starts writing samples to filename as they are recorded.
+	bool startRecording(string filename, Vector2d size);
+
+	// Adds a sample if the viewport has moved since the last one.
+	void record(Viewport *viewport);
+
+	void stopRecording();
+
+	// Returns the last sample at or before time.
+	const Sample &sampleAt(double time);
+
+	~ViewportTrace() { stopRecording(); }
+};
+
+// Screen coverage of a single frame.
+struct FrameCoverage
+{
+	// Fractions of the screen drawn from tiles at the target depth, from a parent tile, or not at all.
+	double detail = 0;
+	double fallback = 0;
+	double missing = 0;
+};
+
+// Replays a trace headless against a RenderGrid at wall clock speed and measures what the
+// user would have seen.
+class TraceReplay
+{
+private:
+	Viewport viewport;
+	RenderGrid *grid;
+
+	// Blocks that were on screen, at full detail or as a fallback, at some point after being solved.
+	std::set<RenderBlock*> shown;
+
+	FrameCoverage measureFrame(int depth);
+	void countSolved(RenderNode *node, int &solved, int &wasted);
+
+public:
+	// Time between frames, the interactive loop waits 10ms per frame.
+	double frameTime = 0.01;
+
+	// How long to keep going after the trace ends while waiting for full detail.
+	double settleTimeout = 10.0;
+
+	// If set, the coverage of every frame is written here as CSV.
+	string frameLog;
+
+	TraceReplay(int tileSize = 64);
+	~TraceReplay();
+
+	void run(ViewportTrace &trace);
+};
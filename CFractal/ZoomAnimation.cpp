@@ -0,0 +1,216 @@
+//
+// Zoom animation renderer.  Frames are resampled from cached grid tiles by the Compositor.
+//
+// Date: 2016/07/22
+//
+
+#include "stdafx.h"
+#include "ZoomAnimation.h"
+#include "ImageWriter.h"
+#include <math.h>
+#include <algorithm>
+
+ZoomAnimation::ZoomAnimation(int tileSize)
+{
+	// tiles are solved by solveTiles with its own threads, the queue's workers would only sit idle.
+	grid = new RenderGrid(&viewport, 0, tileSize);
+}
+
+ZoomAnimation::~ZoomAnimation()
+{
+	delete grid;
+}
+
+// Returns the shallowest grid depth whose tiles have at least one pixel per screen pixel.
+int ZoomAnimation::depthForScale(double scale)
+{
+	// a node at depth d is 8 / 2^d fractal units wide, which is 16 * 8 / 2^d viewport units.
+	double tilePixels = grid->root->getSize() * 16.0 * scale / grid->blockSize;
+	int depth = (int)ceil(log2(tilePixels));
+	return depth < 0 ? 0 : depth;
+}
+
+// Returns every tile at the given depth that covers part of the current viewport.
+std::vector<RenderNode*> ZoomAnimation::getVisibleTiles(int depth)
+{
+	auto topLeft = viewport.toViewport(Vector2d(0, 0));
+	auto bottomRight = viewport.toViewport(viewport.size);
+
+	double size = grid->root->getSize() / pow(2, depth);
+	auto origin = grid->root->getTopLeft();
+	int tileCount = 1 << depth;
+
+	int x1 = (int)floor((topLeft.x / 16.0 - origin.x) / size);
+	int y1 = (int)floor((topLeft.y / 16.0 - origin.y) / size);
+	int x2 = (int)floor((bottomRight.x / 16.0 - origin.x) / size);
+	int y2 = (int)floor((bottomRight.y / 16.0 - origin.y) / size);
+	if (x1 < 0) x1 = 0;
+	if (y1 < 0) y1 = 0;
+	if (x2 > tileCount - 1) x2 = tileCount - 1;
+	if (y2 > tileCount - 1) y2 = tileCount - 1;
+
+	std::vector<RenderNode*> tiles;
+	for (int y = y1; y <= y2; y++)
+		for (int x = x1; x <= x2; x++)
+			tiles.push_back(grid->getTile(x, y, depth));
+	return tiles;
+}
+
+// Solves any tiles that do not have data yet.
+void ZoomAnimation::solveTiles(std::vector<RenderNode*> &tiles)
+{
+	auto queue = grid->renderQueue;
+	bool symmetric = queue->solver.isConjugateSymmetric();
+
+	// tiles whose mirror image across the real axis is solved, or is about to be, are copied
+	// from it afterwards.
+	std::vector<RenderBlock*> missing;
+	std::vector<RenderBlock*> mirrored;
+	std::vector<RenderBlock*> sources;
+	for (auto node : tiles)
+	{
+		auto block = node->renderBlock;
+		if (block->status != rsEMPTY)
+			continue;
+		RenderNode *mirror = NULL;
+		if (symmetric && block->depth > 0)
+			mirror = grid->findTile(block->tileX, (1LL << block->depth) - 1 - block->tileY, block->depth);
+		if (mirror && (mirror->renderBlock->status == rsRENDERED || std::find(missing.begin(), missing.end(), mirror->renderBlock) != missing.end())) {
+			mirrored.push_back(block);
+			sources.push_back(mirror->renderBlock);
+		}
+		else
+			missing.push_back(block);
+	}
+
+	parallelFor((int)missing.size(), settings.threads, [&](int i) {
+		queue->solveBlock(missing[i]);
+	});
+
+	for (size_t i = 0; i < mirrored.size(); i++)
+	{
+		queue->copyMirror(mirrored[i], sources[i]);
+		mirrored[i]->status = rsRENDERED;
+	}
+
+	tilesSolved += (int)missing.size();
+}
+
+// Releases the data of tiles that have not been needed for a while.  Zooms only ever pass
+// through a depth once so these are very unlikely to be needed again.
+void ZoomAnimation::releaseUnused(int frame)
+{
+	for (auto it = lastUsed.begin(); it != lastUsed.end();)
+	{
+		if (it->second < frame - settings.keepFrames)
+		{
+			it->first->renderBlock->release();
+			it = lastUsed.erase(it);
+		}
+		else
+			it++;
+	}
+}
+
+// Writes the file name of frame into name.  pattern must hold exactly one "%d", optionally zero
+// padded and with a width (e.g. "%05d"), and "%%" for a literal percent sign.  The pattern
+// comes from the command line, so it is never handed to printf.  Returns false if it is not valid.
+static bool frameFilename(const string &pattern, int frame, string &name)
+{
+	name.clear();
+	int conversions = 0;
+	for (size_t i = 0; i < pattern.size(); i++)
+	{
+		if (pattern[i] != '%') {
+			name += pattern[i];
+			continue;
+		}
+		if (++i < pattern.size() && pattern[i] == '%') {
+			name += '%';
+			continue;
+		}
+		bool zeros = i < pattern.size() && pattern[i] == '0';
+		if (zeros)
+			i++;
+		int width = 0;
+		while (i < pattern.size() && pattern[i] >= '0' && pattern[i] <= '9' && width < 100)
+			width = width * 10 + pattern[i++] - '0';
+		if (i >= pattern.size() || pattern[i] != 'd' || width >= 100)
+			return false;
+
+		string number = intToStr(frame);
+		if ((int)number.size() < width)
+			name += string(width - number.size(), zeros ? '0' : ' ');
+		name += number;
+		conversions++;
+	}
+	return conversions == 1;
+}
+
+// Renders all frames of the animation.  Returns false if the output could not be written.
+bool ZoomAnimation::run(AnimationSettings settings)
+{
+	this->settings = settings;
+
+	string filename;
+	if (settings.output[0] != '|' && !frameFilename(settings.output, 0, filename)) {
+		TRACE("Output must be |command or a file name with one %d for the frame number, e.g. zoom%05d.ppm");
+		return false;
+	}
+
+	viewport.size = Vector2d(settings.width, settings.height);
+	viewport.offset = Vector2d(settings.target.x * 16.0, settings.target.y * 16.0);
+
+	FILE *pipe = NULL;
+	if (settings.output[0] == '|') {
+		pipe = _popen(settings.output.substr(1).c_str(), "wb");
+		if (!pipe) {
+			TRACE("Could not start " + settings.output.substr(1));
+			return false;
+		}
+	}
+
+	compositor.threads = settings.threads;
+	compositor.resize(settings.width, settings.height);
+	auto rgb = compositor.frame.data();
+	double startTime = time();
+	bool ok = true;
+
+	for (int frame = 0; frame < settings.frames && ok; frame++)
+	{
+		// zoom at a constant rate, i.e. scale grows exponentially.
+		double t = settings.frames > 1 ? (double)frame / (settings.frames - 1) : 0;
+		viewport.scale = settings.startScale * pow(settings.endScale / settings.startScale, t);
+
+		int solvedBefore = tilesSolved;
+		int depth = depthForScale(viewport.scale);
+		auto tiles = getVisibleTiles(depth);
+		solveTiles(tiles);
+		for (auto node : tiles)
+			lastUsed[node] = frame;
+
+		grid->targetDepth = depth;
+		compositor.clear(Color(0, 0, 0));
+		grid->compose(compositor);
+
+		if (pipe)
+			ok = fwrite(rgb, 3, (size_t)settings.width * settings.height, pipe) == (size_t)settings.width * settings.height;
+		else {
+			frameFilename(settings.output, frame, filename);
+			ok = writePPM(filename, settings.width, settings.height, rgb);
+		}
+
+		releaseUnused(frame);
+
+		TRACE("Frame " + intToStr(frame + 1) + " of " + intToStr(settings.frames) + ", " + intToStr(tilesSolved - solvedBefore) + " new tiles.");
+	}
+
+	if (pipe)
+		_pclose(pipe);
+
+	if (!ok)
+		TRACE("Failed to write frame to " + settings.output);
+
+	TRACE("Animation took " + floatToStr(time() - startTime) + " seconds, " + intToStr(tilesSolved) + " tiles solved.");
+	return ok;
+}
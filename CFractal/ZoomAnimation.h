@@ -0,0 +1,61 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include "helper.h"
+#include "RenderGrid.h"
+#include "Compositor.h"
+
+struct AnimationSettings
+{
+	// Either a file name with one %d for the frame number (e.g. "zoom%05d.ppm"), or "|command"
+	// to stream raw 24 bit RGB frames into another program such as ffmpeg.
+	string output;
+
+	// Size of each frame in pixels.
+	int width = 1280;
+	int height = 720;
+
+	// Fractal space location to zoom in on.
+	Vector2d target;
+
+	// Viewport scale of the first and last frames.
+	double startScale = 1.0;
+	double endScale = 1024.0;
+
+	int frames = 300;
+
+	int threads = 4;
+
+	// Frames a tile may go unused before its data is released.
+	int keepFrames = 30;
+};
+
+// Renders a zoom into the fractal by composing frames from the tile pyramid in a RenderGrid.
+// Tiles are only solved the first time a frame needs them, so the cost of each frame is the
+// new detail it reveals rather than its pixel count.  Frames are drawn with the Compositor.
+class ZoomAnimation
+{
+private:
+	AnimationSettings settings;
+	Viewport viewport;
+	RenderGrid *grid;
+	Compositor compositor;
+
+	// Frame number each solved tile was last used on.
+	std::unordered_map<RenderNode*, int> lastUsed;
+
+	int tilesSolved = 0;
+
+	int depthForScale(double scale);
+	std::vector<RenderNode*> getVisibleTiles(int depth);
+	void solveTiles(std::vector<RenderNode*> &tiles);
+	void releaseUnused(int frame);
+
+public:
+	ZoomAnimation(int tileSize = 64);
+	~ZoomAnimation();
+
+	bool run(AnimationSettings settings);
+};
@@ -42,6 +42,26 @@ void drawRect(Vector2d topLeft, Vector2d bottomRight,  Color color)
 	glVertex3f(topLeft.x, topLeft.y, 0.0);
 	glEnd();	
 }
+/*
+ * Draws text on the screen, one line per newline.  topLeft is the baseline of the first line.
+ */
+void drawText(Vector2d topLeft, std::string text, Color color)
+{
+	glColor3f(color.r / 255.0, color.g / 255.0, color.b / 255.0);
+	int y = (int)topLeft.y;
+	size_t start = 0;
+	while (start <= text.size())
+	{
+		size_t end = text.find('\n', start);
+		if (end == std::string::npos)
+			end = text.size();
+		glRasterPos2i((int)topLeft.x, y);
+		glutBitmapString(GLUT_BITMAP_8_BY_13, (const unsigned char*)text.substr(start, end - start).c_str());
+		y += 15;
+		start = end + 1;
+	}
+}
+
 /*
  * Creates a texture from given data.
  * Data is just a 2d array of RGB.
@@ -69,6 +89,15 @@ Texture createTexture(int width, int height, uint8_t *data)
 	return result;
 }
 
+/*
+ * Frees a texture created by createTexture.
+ */
+void deleteTexture(Texture texture)
+{
+	GLuint textureID = texture.id;
+	glDeleteTextures(1, &textureID);
+}
+
 /*
  * Draws a texture on the screen
  */
@@ -101,4 +130,27 @@ void drawTexture(Vector2d topLeft, Vector2d bottomRight, Vector2d uv1, Vector2d
 		TRACE("Draw error " + intToStr(error));
 	}
 
-}
\ No newline at end of file
+}
+
+/*
+ * Draws a frame of RGB pixels stretched over the window, for the software display path.
+ */
+void drawPixels(int width, int height, const uint8_t *rgb)
+{
+	glDisable(GL_TEXTURE_2D);
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+
+	// rows are stored top down and the projection has y going down, so draw from the top left
+	// with the rows flipped.
+	GLint window[4];
+	glGetIntegerv(GL_VIEWPORT, window);
+	glRasterPos2i(0, 0);
+	glPixelZoom((float)window[2] / width, -(float)window[3] / height);
+	glDrawPixels(width, height, GL_RGB, GL_UNSIGNED_BYTE, rgb);
+	glPixelZoom(1, 1);
+
+	auto error = glGetError();
+	if (error) {
+		TRACE("Draw error " + intToStr(error));
+	}
+}
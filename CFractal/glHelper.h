@@ -12,8 +12,14 @@ void drawTestObject();
 void drawRect(Vector2d topLeft, Vector2d bottomRight,  Color color);
 
 Texture createTexture(int width, int height, uint8_t * data);
+void deleteTexture(Texture texture);
 
 void drawTexture(Vector2d topLeft, Vector2d bottomRight, Texture texture);
 void drawTexture(Vector2d topLeft, Vector2d bottomRight, Vector2d uv1, Vector2d uv2, Texture texture);
 
-void setOrtho(int width, int height);
\ No newline at end of file
+// Draws a frame of RGB pixels, top row first, stretched over the whole window.
+void drawPixels(int width, int height, const uint8_t *rgb);
+
+void setOrtho(int width, int height);
+
+void drawText(Vector2d topLeft, std::string text, Color color);
\ No newline at end of file
@@ -2,6 +2,10 @@
 #include "helper.h"
 #include <iostream>
 #include <ctime>
+#include <thread>
+#include <atomic>
+#include <vector>
+#include <chrono>
 
 //
 // Collection of helpful routines.  Hopefuly as I move towards the sdl these will be come less necessary.
@@ -132,6 +136,36 @@ double time()
 	return (double)clock() / CLOCKS_PER_SEC;
 }
 
+// Returns elapsed real time in seconds.  Unlike time() this keeps counting while the thread
+// is waiting and does not add up the time of all threads.
+double wallTime()
+{
+	using namespace std::chrono;
+	return duration_cast<duration<double>>(steady_clock::now().time_since_epoch()).count();
+}
+
+// Calls func(i) for every i in [0, count), spread across the given number of threads.
+// Items are handed out in order, so low indices are always started first.
+void parallelFor(int count, int threads, std::function<void(int)> func)
+{
+	if (threads < 1) threads = 1;
+	if (threads > count) threads = count;
+
+	std::atomic<int> next(0);
+	auto worker = [&]() {
+		int i;
+		while ((i = next++) < count)
+			func(i);
+	};
+
+	std::vector<std::thread> pool;
+	for (int i = 1; i < threads; i++)
+		pool.push_back(std::thread(worker));
+	worker();
+	for (auto &thread : pool)
+		thread.join();
+}
+
 ///  ------------------------------------------------------------------
 ///  Vector2d
 ///  ------------------------------------------------------------------
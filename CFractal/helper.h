@@ -1,6 +1,7 @@
 #pragma once
 
 #include <string>
+#include <functional>
 
 using std::string;
 
@@ -42,6 +43,8 @@ BOOL DrawBitmap(HDC hDC, INT x, INT y, HBITMAP hBitmap, DWORD dwROP);
 HBITMAP createDIB(HDC hdc, int width, int height);
 void Assert(bool condition, string message);
 double time();
+double wallTime();
 void fillBitmap(HBITMAP bitmap, COLORREF color);
 void drawRect(HBITMAP bitmap, Vector2d topLeft, Vector2d bottomRight, COLORREF color);
+void parallelFor(int count, int threads, std::function<void(int)> func);
 
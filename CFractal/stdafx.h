@@ -8,6 +8,7 @@
 #include "targetver.h"
 
 #define WIN32_LEAN_AND_MEAN             // Exclude rarely-used stuff from Windows headers
+#define NOMINMAX                        // Use std::min and std::max rather than the macros
 // Windows Header Files:
 #include <windows.h>
 